@@ -1,9 +1,11 @@
 //include stuff here
 #include <cstdio>
 
+#include <algorithm>
 #include <mutex>
 #include <condition_variable>
 #include <chrono>
+#include <future>
 #include <grpc/grpc.h>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/server.h>
@@ -23,167 +25,616 @@ namespace {
 }
 
 GrpcClient::GrpcClient()
+	: GrpcClient(kDefaultGrpcServiceAddress, GRPC_DEFAULT_DEADLINE_MS)
 {
-	m_channel = grpc::CreateChannel(kDefaultGrpcServiceAddress,
-			grpc::InsecureChannelCredentials());
+}
+
+GrpcClient::GrpcClient(const std::string& address, int deadline_ms,
+		       int keepalive_ms)
+	: m_deadline_ms(deadline_ms)
+{
+	grpc::ChannelArguments args;
+
+	// notices a shell that went away while the AppStatusState stream
+	// waits for its next message
+	if (keepalive_ms > 0) {
+		args.SetInt(GRPC_ARG_KEEPALIVE_TIME_MS, keepalive_ms);
+		args.SetInt(GRPC_ARG_KEEPALIVE_TIMEOUT_MS, GRPC_KEEPALIVE_TIMEOUT_MS);
+	}
+
+	m_channel = grpc::CreateCustomChannel(address,
+			grpc::InsecureChannelCredentials(), args);
 
 	// init the stub here
 	m_stub = agl_shell_ipc::AglShellManagerService::NewStub(m_channel);
-	reader = new Reader(m_stub.get());
+}
+
+GrpcClient::~GrpcClient()
+{
+	StopAppStatusState();
 }
 
 void
-GrpcClient::WaitForConnected(int wait_time_ms, int tries_timeout)
+GrpcClient::SetDeadline(int deadline_ms)
 {
-	struct timespec ts;
-	grpc_connectivity_state state;
-	int try_ = 0;
+	m_deadline_ms = deadline_ms;
+}
 
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	ts.tv_sec = 0;
-	ts.tv_nsec = 500 * 1000 * 1000; // 500ms
+void
+GrpcClient::SetContextDeadline(grpc::ClientContext *context)
+{
+	context->set_deadline(system_clock::now() + milliseconds(m_deadline_ms));
+}
+
+bool
+GrpcClient::WaitForConnected(int timeout_ms)
+{
+	system_clock::time_point deadline = system_clock::now() + milliseconds(timeout_ms);
+	grpc_connectivity_state state;
 
-	while (((state = m_channel->GetState(true)) != GRPC_CHANNEL_READY) && 
-		try_++ < tries_timeout) {
-		fprintf(stderr, "waiting for channel state to be ready, current state %d", state);
-		nanosleep(&ts, NULL);
+	// GetState(true) gets an idle channel, or one backing off after a
+	// failure, to try connecting again. The wait is cut in slices for
+	// CancelWaitForConnected() to be noticed, gRPC can't cancel it.
+	while ((state = m_channel->GetState(true)) != GRPC_CHANNEL_READY) {
+		system_clock::time_point now = system_clock::now();
+		system_clock::time_point until =
+			std::min(deadline, now + milliseconds(GRPC_CONNECT_CANCEL_MS));
+
+		if (m_connect_cancelled || now >= deadline)
+			return false;
+		m_channel->WaitForStateChange(state, until);
 	}
 
+	return true;
 }
 
+void
+GrpcClient::CancelWaitForConnected()
+{
+	m_connect_cancelled = true;
+}
 
-bool
-GrpcClient::ActivateApp(const std::string& app_id, const std::string& output_name)
+/*
+ * Fire the call through the callback API and hand back a future for
+ * its outcome. Without the deadline an absent server would leave the
+ * call pending forever, gRPC keeps retrying to connect.
+ */
+template <typename Request, typename Response, typename Start>
+std::future<bool>
+GrpcClient::StartCall(AsyncCall<Request, Response> *call, Start start)
 {
-	agl_shell_ipc::ActivateRequest request;
+	std::future<bool> future = call->promise.get_future();
 
-	request.set_app_id(app_id);
-	request.set_output_name(output_name);
+	SetContextDeadline(&call->context);
 
-	grpc::ClientContext context;
-	::agl_shell_ipc::ActivateResponse reply;
+	start(&call->context, &call->request, &call->reply,
+	      [call](grpc::Status status) {
+		if (!status.ok())
+			fprintf(stderr, "gRPC call failed: %s (%d)\n",
+				status.error_message().c_str(),
+				status.error_code());
+
+		call->promise.set_value(status.ok());
+		delete call;
+	});
 
-	grpc::Status status = m_stub->ActivateApp(&context, request, &reply);
-	return status.ok();
+	return future;
 }
 
-bool
-GrpcClient::DeactivateApp(const std::string& app_id)
+std::future<bool>
+GrpcClient::ActivateAppAsync(const std::string& app_id, const std::string& output_name)
 {
-	agl_shell_ipc::DeactivateRequest request;
+	auto *call = new AsyncCall<agl_shell_ipc::ActivateRequest,
+				   agl_shell_ipc::ActivateResponse>;
 
-	request.set_app_id(app_id);
+	call->request.set_app_id(app_id);
+	call->request.set_output_name(output_name);
 
-	grpc::ClientContext context;
-	::agl_shell_ipc::DeactivateResponse reply;
+	return StartCall(call, [this](auto *context, auto *request, auto *reply, auto done) {
+		m_stub->async()->ActivateApp(context, request, reply, std::move(done));
+	});
+}
 
-	grpc::Status status = m_stub->DeactivateApp(&context, request, &reply);
-	return status.ok();
+std::future<bool>
+GrpcClient::DeactivateAppAsync(const std::string& app_id)
+{
+	auto *call = new AsyncCall<agl_shell_ipc::DeactivateRequest,
+				   agl_shell_ipc::DeactivateResponse>;
+
+	call->request.set_app_id(app_id);
+
+	return StartCall(call, [this](auto *context, auto *request, auto *reply, auto done) {
+		m_stub->async()->DeactivateApp(context, request, reply, std::move(done));
+	});
 }
 
-bool
-GrpcClient::SetAppFloat(const std::string& app_id, int32_t x_pos, int32_t y_pos)
+std::future<bool>
+GrpcClient::SetAppFloatAsync(const std::string& app_id, int32_t x_pos, int32_t y_pos)
 {
-	agl_shell_ipc::FloatRequest request;
+	auto *call = new AsyncCall<agl_shell_ipc::FloatRequest,
+				   agl_shell_ipc::FloatResponse>;
 
-	request.set_app_id(app_id);
+	call->request.set_app_id(app_id);
+	call->request.set_x_pos(x_pos);
+	call->request.set_y_pos(y_pos);
 
-	request.set_x_pos(x_pos);
-	request.set_y_pos(y_pos);
+	return StartCall(call, [this](auto *context, auto *request, auto *reply, auto done) {
+		m_stub->async()->SetAppFloat(context, request, reply, std::move(done));
+	});
+}
 
-	grpc::ClientContext context;
-	::agl_shell_ipc::FloatResponse reply;
+std::future<bool>
+GrpcClient::SetAppNormalAsync(const std::string& app_id)
+{
+	auto *call = new AsyncCall<agl_shell_ipc::NormalRequest,
+				   agl_shell_ipc::NormalResponse>;
 
-	grpc::Status status = m_stub->SetAppFloat(&context, request, &reply);
-	return status.ok();
+	call->request.set_app_id(app_id);
+
+	return StartCall(call, [this](auto *context, auto *request, auto *reply, auto done) {
+		m_stub->async()->SetAppNormal(context, request, reply, std::move(done));
+	});
 }
 
-bool
-GrpcClient::SetAppNormal(const std::string& app_id)
+std::future<bool>
+GrpcClient::SetAppFullscreenAsync(const std::string& app_id)
 {
-	agl_shell_ipc::NormalRequest request;
+	auto *call = new AsyncCall<agl_shell_ipc::FullscreenRequest,
+				   agl_shell_ipc::FullscreenResponse>;
 
-	request.set_app_id(app_id);
+	call->request.set_app_id(app_id);
 
-	grpc::ClientContext context;
-	::agl_shell_ipc::NormalResponse reply;
+	return StartCall(call, [this](auto *context, auto *request, auto *reply, auto done) {
+		m_stub->async()->SetAppFullscreen(context, request, reply, std::move(done));
+	});
+}
+
+std::future<bool>
+GrpcClient::SetAppOnOutputAsync(const std::string& app_id, const std::string &output)
+{
+	auto *call = new AsyncCall<agl_shell_ipc::AppOnOutputRequest,
+				   agl_shell_ipc::AppOnOutputResponse>;
+
+	call->request.set_app_id(app_id);
+	call->request.set_output(output);
 
-	grpc::Status status = m_stub->SetAppNormal(&context, request, &reply);
-	return status.ok();
+	return StartCall(call, [this](auto *context, auto *request, auto *reply, auto done) {
+		m_stub->async()->SetAppOnOutput(context, request, reply, std::move(done));
+	});
 }
 
-bool
-GrpcClient::SetAppFullscreen(const std::string& app_id)
+std::future<bool>
+GrpcClient::SetAppPositionAsync(const std::string& app_id, int32_t x, int32_t y)
 {
-	agl_shell_ipc::FullscreenRequest request;
+	auto *call = new AsyncCall<agl_shell_ipc::AppPositionRequest,
+				   agl_shell_ipc::AppPositionResponse>;
 
-	request.set_app_id(app_id);
+	call->request.set_app_id(app_id);
+	call->request.set_x(x);
+	call->request.set_y(y);
 
-	grpc::ClientContext context;
-	::agl_shell_ipc::FullscreenResponse reply;
+	return StartCall(call, [this](auto *context, auto *request, auto *reply, auto done) {
+		m_stub->async()->SetAppPosition(context, request, reply, std::move(done));
+	});
+}
+
+std::future<bool>
+GrpcClient::SetAppScaleAsync(const std::string& app_id, int32_t width, int32_t height)
+{
+	auto *call = new AsyncCall<agl_shell_ipc::AppScaleRequest,
+				   agl_shell_ipc::AppScaleResponse>;
 
-	grpc::Status status = m_stub->SetAppFullscreen(&context, request, &reply);
-	return status.ok();
+	call->request.set_app_id(app_id);
+	call->request.set_width(width);
+	call->request.set_height(height);
+
+	return StartCall(call, [this](auto *context, auto *request, auto *reply, auto done) {
+		m_stub->async()->SetAppScale(context, request, reply, std::move(done));
+	});
+}
+
+LayoutTransaction&
+LayoutTransaction::Float(int32_t x, int32_t y)
+{
+	m_mode = MODE_FLOAT;
+	return Position(x, y);
 }
 
+LayoutTransaction&
+LayoutTransaction::Normal()
+{
+	m_mode = MODE_NORMAL;
+	return *this;
+}
+
+LayoutTransaction&
+LayoutTransaction::Fullscreen()
+{
+	m_mode = MODE_FULLSCREEN;
+	return *this;
+}
+
+LayoutTransaction&
+LayoutTransaction::Position(int32_t x, int32_t y)
+{
+	m_has_position = true;
+	m_x = x;
+	m_y = y;
+	return *this;
+}
+
+LayoutTransaction&
+LayoutTransaction::Scale(int32_t width, int32_t height)
+{
+	m_has_scale = true;
+	m_width = width;
+	m_height = height;
+	return *this;
+}
+
+LayoutTransaction&
+LayoutTransaction::Output(const std::string& output)
+{
+	m_has_output = true;
+	m_output = output;
+	return *this;
+}
+
+LayoutTransaction&
+LayoutTransaction::Activate(const std::string& output)
+{
+	m_activate = true;
+	m_activate_output = output;
+	return *this;
+}
+
+// only a window that keeps its mode takes a separate position, a
+// floating one gets it with the float call
 bool
-GrpcClient::SetAppOnOutput(const std::string& app_id, const std::string &output)
+LayoutTransaction::SendsPosition() const
 {
-	agl_shell_ipc::AppOnOutputRequest request;
+	return m_has_position && m_mode == MODE_KEEP;
+}
 
-	request.set_app_id(app_id);
-	request.set_output(output);
+bool
+LayoutTransaction::SendsScale() const
+{
+	return m_has_scale && m_mode != MODE_FULLSCREEN;
+}
 
-	grpc::ClientContext context;
-	::agl_shell_ipc::AppOnOutputResponse reply;
+// activating on the same output puts the window there anyway
+bool
+LayoutTransaction::SendsOutput() const
+{
+	return m_has_output && !(m_activate && m_activate_output == m_output);
+}
 
-	grpc::Status status = m_stub->SetAppOnOutput(&context, request, &reply);
-	return status.ok();
+int
+LayoutTransaction::Calls() const
+{
+	return (m_mode != MODE_KEEP) + SendsPosition() + SendsScale() +
+	       SendsOutput() + m_activate;
+}
+
+// one ApplyLayoutAsync(), shared by its calls in flight
+struct LayoutBatch {
+	LayoutTransaction layout{""};
+	system_clock::time_point deadline;
+
+	std::mutex mutex;
+	int pending = 0;
+	// the first failure
+	grpc::Status status;
+	bool activate_sent = false;
+
+	std::promise<grpc::Status> promise;
+};
+
+template <typename Request, typename Response, typename Start>
+void
+GrpcClient::StartBatchCall(std::shared_ptr<LayoutBatch> batch, const char *name,
+			   BatchCall<Request, Response> *call, Start start)
+{
+	call->context.set_deadline(batch->deadline);
+
+	start(&call->context, &call->request, &call->reply,
+	      [this, batch, name, call](grpc::Status status) {
+		delete call;
+		LayoutCallDone(batch, name, status);
+	});
+}
+
+/*
+ * Runs on a gRPC thread as each call completes. The last placement call
+ * to complete sends the activation, if any, and the last call overall
+ * resolves the batch.
+ */
+void
+GrpcClient::LayoutCallDone(std::shared_ptr<LayoutBatch> batch, const char *name,
+			   const grpc::Status& status)
+{
+	const LayoutTransaction& layout = batch->layout;
+
+	{
+		std::lock_guard<std::mutex> l(batch->mutex);
+
+		if (!status.ok() && batch->status.ok())
+			batch->status = grpc::Status(status.error_code(),
+						     std::string(name) + ": " +
+						     status.error_message());
+		if (--batch->pending > 0)
+			return;
+	}
+
+	// a window placed wrong is better left hidden
+	if (layout.m_activate && !batch->activate_sent && batch->status.ok()) {
+		auto *call = new BatchCall<agl_shell_ipc::ActivateRequest,
+					   agl_shell_ipc::ActivateResponse>;
+
+		batch->activate_sent = true;
+		batch->pending = 1;
+		call->request.set_app_id(layout.m_app_id);
+		call->request.set_output_name(layout.m_activate_output);
+		StartBatchCall(batch, "ActivateApp", call,
+			       [this](auto *context, auto *request, auto *reply, auto done) {
+			m_stub->async()->ActivateApp(context, request, reply, std::move(done));
+		});
+		return;
+	}
+
+	if (!batch->status.ok())
+		fprintf(stderr, "Layout of %s failed: %s (%d)\n",
+			layout.m_app_id.c_str(),
+			batch->status.error_message().c_str(),
+			batch->status.error_code());
+
+	batch->promise.set_value(batch->status);
+}
+
+void
+GrpcClient::StartLayoutCalls(std::shared_ptr<LayoutBatch> batch)
+{
+	const LayoutTransaction& layout = batch->layout;
+
+	switch (layout.m_mode) {
+	case LayoutTransaction::MODE_FLOAT: {
+		auto *call = new BatchCall<agl_shell_ipc::FloatRequest,
+					   agl_shell_ipc::FloatResponse>;
+
+		call->request.set_app_id(layout.m_app_id);
+		call->request.set_x_pos(layout.m_x);
+		call->request.set_y_pos(layout.m_y);
+		StartBatchCall(batch, "SetAppFloat", call,
+			       [this](auto *context, auto *request, auto *reply, auto done) {
+			m_stub->async()->SetAppFloat(context, request, reply, std::move(done));
+		});
+		break;
+	}
+	case LayoutTransaction::MODE_NORMAL: {
+		auto *call = new BatchCall<agl_shell_ipc::NormalRequest,
+					   agl_shell_ipc::NormalResponse>;
+
+		call->request.set_app_id(layout.m_app_id);
+		StartBatchCall(batch, "SetAppNormal", call,
+			       [this](auto *context, auto *request, auto *reply, auto done) {
+			m_stub->async()->SetAppNormal(context, request, reply, std::move(done));
+		});
+		break;
+	}
+	case LayoutTransaction::MODE_FULLSCREEN: {
+		auto *call = new BatchCall<agl_shell_ipc::FullscreenRequest,
+					   agl_shell_ipc::FullscreenResponse>;
+
+		call->request.set_app_id(layout.m_app_id);
+		StartBatchCall(batch, "SetAppFullscreen", call,
+			       [this](auto *context, auto *request, auto *reply, auto done) {
+			m_stub->async()->SetAppFullscreen(context, request, reply, std::move(done));
+		});
+		break;
+	}
+	case LayoutTransaction::MODE_KEEP:
+		break;
+	}
+
+	if (layout.SendsPosition()) {
+		auto *call = new BatchCall<agl_shell_ipc::AppPositionRequest,
+					   agl_shell_ipc::AppPositionResponse>;
+
+		call->request.set_app_id(layout.m_app_id);
+		call->request.set_x(layout.m_x);
+		call->request.set_y(layout.m_y);
+		StartBatchCall(batch, "SetAppPosition", call,
+			       [this](auto *context, auto *request, auto *reply, auto done) {
+			m_stub->async()->SetAppPosition(context, request, reply, std::move(done));
+		});
+	}
+
+	if (layout.SendsScale()) {
+		auto *call = new BatchCall<agl_shell_ipc::AppScaleRequest,
+					   agl_shell_ipc::AppScaleResponse>;
+
+		call->request.set_app_id(layout.m_app_id);
+		call->request.set_width(layout.m_width);
+		call->request.set_height(layout.m_height);
+		StartBatchCall(batch, "SetAppScale", call,
+			       [this](auto *context, auto *request, auto *reply, auto done) {
+			m_stub->async()->SetAppScale(context, request, reply, std::move(done));
+		});
+	}
+
+	if (layout.SendsOutput()) {
+		auto *call = new BatchCall<agl_shell_ipc::AppOnOutputRequest,
+					   agl_shell_ipc::AppOnOutputResponse>;
+
+		call->request.set_app_id(layout.m_app_id);
+		call->request.set_output(layout.m_output);
+		StartBatchCall(batch, "SetAppOnOutput", call,
+			       [this](auto *context, auto *request, auto *reply, auto done) {
+			m_stub->async()->SetAppOnOutput(context, request, reply, std::move(done));
+		});
+	}
+}
+
+/*
+ * The placement calls all go out back to back, pipelined over the one
+ * channel, and the activation follows once they're done: two round
+ * trips at most however many intents there are, and the window never
+ * shows up in between.
+ */
+std::future<grpc::Status>
+GrpcClient::ApplyLayoutAsync(const LayoutTransaction& layout)
+{
+	auto batch = std::make_shared<LayoutBatch>();
+	std::future<grpc::Status> future = batch->promise.get_future();
+	int placement_calls = layout.Calls() - layout.m_activate;
+
+	batch->layout = layout;
+	batch->deadline = system_clock::now() + milliseconds(m_deadline_ms);
+
+	if (placement_calls == 0) {
+		// as if the placement had just been done
+		batch->pending = 1;
+		LayoutCallDone(batch, NULL, grpc::Status::OK);
+		return future;
+	}
+
+	// counted in full up front, calls may complete while the others
+	// are still being started
+	batch->pending = placement_calls;
+	StartLayoutCalls(batch);
+
+	return future;
+}
+
+grpc::Status
+GrpcClient::ApplyLayout(const LayoutTransaction& layout)
+{
+	return ApplyLayoutAsync(layout).get();
 }
 
 bool
-GrpcClient::SetAppPosition(const std::string& app_id, int32_t x, int32_t y)
+GrpcClient::ActivateApp(const std::string& app_id, const std::string& output_name)
 {
-	agl_shell_ipc::AppPositionRequest request;
+	return ActivateAppAsync(app_id, output_name).get();
+}
 
-	request.set_app_id(app_id);
-	request.set_x(x);
-	request.set_y(y);
+bool
+GrpcClient::DeactivateApp(const std::string& app_id)
+{
+	return DeactivateAppAsync(app_id).get();
+}
 
-	grpc::ClientContext context;
-	::agl_shell_ipc::AppPositionResponse reply;
+bool
+GrpcClient::SetAppFloat(const std::string& app_id, int32_t x_pos, int32_t y_pos)
+{
+	return SetAppFloatAsync(app_id, x_pos, y_pos).get();
+}
 
-	grpc::Status status = m_stub->SetAppPosition(&context, request, &reply);
-	return status.ok();
+bool
+GrpcClient::SetAppNormal(const std::string& app_id)
+{
+	return SetAppNormalAsync(app_id).get();
 }
 
 bool
-GrpcClient::SetAppScale(const std::string& app_id, int32_t width, int32_t height)
+GrpcClient::SetAppFullscreen(const std::string& app_id)
 {
-	agl_shell_ipc::AppScaleRequest request;
+	return SetAppFullscreenAsync(app_id).get();
+}
 
-	request.set_app_id(app_id);
-	request.set_width(width);
-	request.set_height(height);
+bool
+GrpcClient::SetAppOnOutput(const std::string& app_id, const std::string &output)
+{
+	return SetAppOnOutputAsync(app_id, output).get();
+}
 
-	grpc::ClientContext context;
-	::agl_shell_ipc::AppScaleResponse reply;
+bool
+GrpcClient::SetAppPosition(const std::string& app_id, int32_t x, int32_t y)
+{
+	return SetAppPositionAsync(app_id, x, y).get();
+}
 
-	grpc::Status status = m_stub->SetAppScale(&context, request, &reply);
-	return status.ok();
+bool
+GrpcClient::SetAppScale(const std::string& app_id, int32_t width, int32_t height)
+{
+	return SetAppScaleAsync(app_id, width, height).get();
 }
 
 
 grpc::Status
 GrpcClient::Wait(void)
 {
-	return reader->Await();
+	if (m_stream_thread.joinable())
+		m_stream_thread.join();
+
+	return m_stream_status;
+}
+
+void
+GrpcClient::AppStatusStateLoop(Callback callback, void *data)
+{
+	int backoff_ms = GRPC_RECONNECT_MIN_MS;
+
+	while (true) {
+		Reader reader(m_stub.get(), callback, data);
+
+		{
+			std::lock_guard<std::mutex> l(m_stream_mutex);
+			if (m_stream_stopping)
+				return;
+			m_reader = &reader;
+		}
+
+		reader.Start();
+		grpc::Status status = reader.Await();
+
+		std::unique_lock<std::mutex> l(m_stream_mutex);
+		m_reader = nullptr;
+		m_stream_status = status;
+		if (m_stream_stopping)
+			return;
+
+		if (reader.Received())
+			backoff_ms = GRPC_RECONNECT_MIN_MS;
+
+		fprintf(stderr, "App state stream ended (%s), reconnecting in %d ms\n",
+			status.ok() ? "closed by the shell" :
+				      status.error_message().c_str(),
+			backoff_ms);
+
+		m_stream_cv.wait_for(l, milliseconds(backoff_ms),
+				     [this] { return m_stream_stopping; });
+		if (m_stream_stopping)
+			return;
+
+		backoff_ms = std::min(backoff_ms * 2, GRPC_RECONNECT_MAX_MS);
+	}
 }
 
 void
 GrpcClient::AppStatusState(Callback callback, void *data)
 {
-	reader->AppStatusState(callback, data);
+	if (m_stream_thread.joinable())
+		return;
+
+	m_stream_stopping = false;
+	m_stream_thread = std::thread(&GrpcClient::AppStatusStateLoop, this,
+				      callback, data);
+}
+
+void
+GrpcClient::StopAppStatusState()
+{
+	{
+		std::lock_guard<std::mutex> l(m_stream_mutex);
+		m_stream_stopping = true;
+		if (m_reader)
+			m_reader->Cancel();
+	}
+	m_stream_cv.notify_one();
+
+	if (m_stream_thread.joinable())
+		m_stream_thread.join();
 }
 
 std::vector<std::string>
@@ -192,6 +643,8 @@ GrpcClient::GetOutputs()
 	grpc::ClientContext context;
 	std::vector<std::string> v;
 
+	SetContextDeadline(&context);
+
 	::agl_shell_ipc::OutputRequest request;
 	::agl_shell_ipc::ListOutputResponse response;
 
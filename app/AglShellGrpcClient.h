@@ -1,9 +1,13 @@
 #pragma once
 
+#include <atomic>
 #include <cstdio>
 
 #include <mutex>
 #include <condition_variable>
+#include <future>
+#include <memory>
+#include <thread>
 #include <grpc/grpc.h>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/server.h>
@@ -15,22 +19,44 @@
 
 #include "agl_shell.grpc.pb.h"
 
-typedef void (*Callback)(agl_shell_ipc::AppStateResponse app_response, void *data);
+// runs on a gRPC thread; @app_response is only valid during the call
+typedef void (*Callback)(const agl_shell_ipc::AppStateResponse &app_response, void *data);
 
+// how long a unary call may take before it fails with DEADLINE_EXCEEDED
+#define GRPC_DEFAULT_DEADLINE_MS	500
+
+// keepalive pings on the channel; servers by default only put up with
+// one every five minutes
+#define GRPC_DEFAULT_KEEPALIVE_MS	(5 * 60 * 1000)
+#define GRPC_KEEPALIVE_TIMEOUT_MS	5000
+
+// the AppStatusState stream is reopened after a delay doubling from the
+// first to the second, back to the first once a stream delivered
+#define GRPC_RECONNECT_MIN_MS		250
+#define GRPC_RECONNECT_MAX_MS		8000
+
+// longest WaitForConnected() takes to notice it got cancelled
+#define GRPC_CONNECT_CANCEL_MS		100
+
+// AppStateResponse::state, the agl_shell app_state values
+#define APP_STATE_STARTED	0
+#define APP_STATE_TERMINATED	1
+#define APP_STATE_ACTIVATED	2
+#define APP_STATE_DEACTIVATED	3
+
+// one AppStatusState stream, from Start() to OnDone()
 class Reader : public grpc::ClientReadReactor<::agl_shell_ipc::AppStateResponse> {
 public:
-	Reader(agl_shell_ipc::AglShellManagerService::Stub *stub)
-		: m_stub(stub)
+	Reader(agl_shell_ipc::AglShellManagerService::Stub *stub,
+	       Callback callback, void *data)
+		: m_stub(stub), m_callback(callback), m_data(data)
 	{
 	}
 
-	void AppStatusState(Callback callback, void *_data)
+	void Start()
 	{
 		::agl_shell_ipc::AppStateRequest request;
 
-		// set up the callback
-		m_callback = callback;
-		m_data = _data;
 		m_stub->async()->AppStatusState(&m_context, &request, this);
 
 		StartRead(&m_app_state);
@@ -39,49 +65,55 @@ public:
 
 	void OnReadDone(bool ok) override
 	{
-		if (ok) {
-			m_callback(m_app_state, m_data);
+		if (!ok)
+			return;
 
-			// blocks in StartRead() if the server doesn't send
-			// antyhing
-			StartRead(&m_app_state);
-		}
-	}
+		m_received = true;
+		m_callback(m_app_state, m_data);
 
-	void SetDone()
-	{
-		fprintf(stderr, "%s()\n", __func__);
-		std::unique_lock<std::mutex> l(m_mutex);
-		m_done = true;
+		// the message is reused for the next read, nothing gets
+		// allocated per message past the first one
+		StartRead(&m_app_state);
 	}
 
 	void OnDone(const grpc::Status& s) override
 	{
-		fprintf(stderr, "%s()\n", __func__);
 		std::unique_lock<std::mutex> l(m_mutex);
 
 		m_status = s;
-
-		fprintf(stderr, "%s() done\n", __func__);
+		m_done = true;
 		m_cv.notify_one();
 	}
 
+	// ends the stream, OnDone() follows; fine before Start() too
+	void Cancel()
+	{
+		m_context.TryCancel();
+	}
+
 	grpc::Status Await()
 	{
 		std::unique_lock<std::mutex> l(m_mutex);
 
 		m_cv.wait(l, [this] { return m_done; });
 
-		return std::move(m_status);
+		return m_status;
+	}
+
+	// only meaningful once Await() returned
+	bool Received()
+	{
+		return m_received;
 	}
+
 private:
 	grpc::ClientContext m_context;
 	::agl_shell_ipc::AppStateResponse m_app_state;
-	void *m_data;
 	agl_shell_ipc::AglShellManagerService::Stub *m_stub;
 
 	Callback m_callback;
-
+	void *m_data;
+	bool m_received = false;
 
 	std::mutex m_mutex;
 	std::condition_variable m_cv;
@@ -89,10 +121,108 @@ private:
 	bool m_done = false;
 };
 
+// a unary call in flight, owned by the completion callback
+template <typename Request, typename Response>
+struct AsyncCall {
+	grpc::ClientContext context;
+	Request request;
+	Response reply;
+	std::promise<bool> promise;
+};
+
+// one call of a LayoutTransaction, the batch it belongs to has the outcome
+template <typename Request, typename Response>
+struct BatchCall {
+	grpc::ClientContext context;
+	Request request;
+	Response reply;
+};
+
+/*
+ * Where one app's window should go, collected up front and sent by
+ * GrpcClient::ApplyLayoutAsync() as one batch. Intents that override
+ * each other are coalesced: the last of Float(), Normal() and
+ * Fullscreen() wins, a floating window gets its position with the float
+ * call, and a fullscreen one has no use for a position nor a scale.
+ */
+class LayoutTransaction {
+public:
+	explicit LayoutTransaction(const std::string& app_id)
+		: m_app_id(app_id)
+	{
+	}
+
+	LayoutTransaction& Float(int32_t x, int32_t y);
+	LayoutTransaction& Normal();
+	LayoutTransaction& Fullscreen();
+	LayoutTransaction& Position(int32_t x, int32_t y);
+	LayoutTransaction& Scale(int32_t width, int32_t height);
+	LayoutTransaction& Output(const std::string& output);
+	// sent once everything else is in place, so that the window shows
+	// up where it belongs right away
+	LayoutTransaction& Activate(const std::string& output);
+
+	// calls the batch takes, after coalescing
+	int Calls() const;
+
+private:
+	friend class GrpcClient;
+
+	enum Mode { MODE_KEEP, MODE_FLOAT, MODE_NORMAL, MODE_FULLSCREEN };
+
+	bool SendsPosition() const;
+	bool SendsScale() const;
+	bool SendsOutput() const;
+
+	std::string m_app_id;
+	Mode m_mode = MODE_KEEP;
+	bool m_has_position = false;
+	int32_t m_x = 0, m_y = 0;
+	bool m_has_scale = false;
+	int32_t m_width = 0, m_height = 0;
+	bool m_has_output = false;
+	std::string m_output;
+	bool m_activate = false;
+	std::string m_activate_output;
+};
+
+struct LayoutBatch;
+
 class GrpcClient {
 public:
 	GrpcClient();
-	void WaitForConnected(int wait_time_ms, int tries_timeout);
+	// @address is host:port or unix:/path, @keepalive_ms 0 disables the
+	// keepalive pings
+	GrpcClient(const std::string& address, int deadline_ms,
+		   int keepalive_ms = GRPC_DEFAULT_KEEPALIVE_MS);
+	~GrpcClient();
+	void SetDeadline(int deadline_ms);
+	// connects if need be and waits for the channel to be ready, woken
+	// up by its state changes; false if it isn't within @timeout_ms or
+	// got cancelled
+	bool WaitForConnected(int timeout_ms);
+	// has WaitForConnected() give up shortly, from any thread, so the
+	// client can be deleted without waiting for the whole timeout
+	void CancelWaitForConnected();
+
+	// these return right away, the future becomes ready with the
+	// outcome of the call once the server answered or the deadline
+	// passed; gRPC completes them on its own threads
+	std::future<bool> ActivateAppAsync(const std::string& app_id, const std::string& output_name);
+	std::future<bool> DeactivateAppAsync(const std::string& app_id);
+	std::future<bool> SetAppFloatAsync(const std::string& app_id, int32_t x_pos, int32_t y_pos);
+	std::future<bool> SetAppFullscreenAsync(const std::string& app_id);
+	std::future<bool> SetAppOnOutputAsync(const std::string& app_id, const std::string& output);
+	std::future<bool> SetAppNormalAsync(const std::string& app_id);
+	std::future<bool> SetAppPositionAsync(const std::string& app_id, int32_t x, int32_t y);
+	std::future<bool> SetAppScaleAsync(const std::string& app_id, int32_t width, int32_t height);
+
+	// all the calls of @layout at once, bounded by a single deadline;
+	// the status is the first failure, if any
+	std::future<grpc::Status> ApplyLayoutAsync(const LayoutTransaction& layout);
+	grpc::Status ApplyLayout(const LayoutTransaction& layout);
+
+	// blocking variants, bounded by the deadline as well
 	bool ActivateApp(const std::string& app_id, const std::string& output_name);
 	bool DeactivateApp(const std::string& app_id);
 	bool SetAppFloat(const std::string& app_id, int32_t x_pos, int32_t y_pos);
@@ -103,12 +233,39 @@ public:
 	bool SetAppScale(const std::string& app_id, int32_t width, int32_t height);
 	std::vector<std::string> GetOutputs();
 	void GetAppState();
+	// @callback runs on a gRPC thread, for every state change of any
+	// app; the stream is reopened with a backoff whenever it breaks
 	void AppStatusState(Callback callback, void *data);
+	// cancels the AppStatusState() stream and waits for it to end
+	void StopAppStatusState();
+	// how the last AppStatusState() stream ended
 	grpc::Status Wait();
 
 private:
-	Reader *reader;
+	template <typename Request, typename Response, typename Start>
+	std::future<bool> StartCall(AsyncCall<Request, Response> *call, Start start);
+	template <typename Request, typename Response, typename Start>
+	void StartBatchCall(std::shared_ptr<LayoutBatch> batch, const char *name,
+			    BatchCall<Request, Response> *call, Start start);
+	void StartLayoutCalls(std::shared_ptr<LayoutBatch> batch);
+	void LayoutCallDone(std::shared_ptr<LayoutBatch> batch, const char *name,
+			    const grpc::Status& status);
+	void SetContextDeadline(grpc::ClientContext *context);
+	void AppStatusStateLoop(Callback callback, void *data);
+
+	// the AppStatusState() stream and its reconnects, m_reader is the
+	// current one if any
+	std::thread m_stream_thread;
+	std::mutex m_stream_mutex;
+	std::condition_variable m_stream_cv;
+	Reader *m_reader = nullptr;
+	bool m_stream_stopping = false;
+	grpc::Status m_stream_status;
+
+	std::atomic<bool> m_connect_cancelled{false};
+
 	std::unique_ptr<agl_shell_ipc::AglShellManagerService::Stub> m_stub;
 	std::shared_ptr<grpc::Channel> m_channel;
+	int m_deadline_ms;
 };
 
@@ -0,0 +1,647 @@
+/*
+ * Streams frames through a pipeline made by pipeline_build(), the same
+ * code create_pipeline() uses, for a matrix of resolutions and formats
+ * and reports for each of them:
+ *
+ *   - throughput, in frames per second
+ *   - CPU time (user + system) spent per frame
+ *   - bytes written per frame by elements that produced a new buffer
+ *     instead of passing theirs on, i.e. conversions and copies, plus
+ *     the copy waylandsink makes of frames it can't hand over as an fd
+ *   - resident set size after the run, and the peak so far
+ *   - the longest gap between two frames reaching the sink
+ *
+ * With -s snapshots are taken back to back all along, see snapshot.h,
+ * and their latency is reported too; the frame gap then shows whether
+ * the preview keeps its pace (use -l for a paced preview). With -R the
+ * stream is also recorded, see record.h, cut into segments of the given
+ * length, and the encoder frame rate, bytes written and segment rotation
+ * times are reported.
+ *
+ * The source is videotestsrc, or a V4L2 device such as vivid. The sink
+ * is fakesink, so it runs on a box without a GPU or compositor, or
+ * waylandsink, e.g. on a headless Weston. videotestsrc isn't live
+ * unless -l is given, so the numbers are what the pipeline can do
+ * rather than the frame rate.
+ *
+ * Exits with a non-zero status if any of the runs fails.
+ *
+ *   camera-gstreamer-bench [-d device [-e]] [-k sink] [-n frames]
+ *                          [-r WxH,...] [-f format,...] [-c] [-q] [-L] [-s]
+ *                          [-R seconds] [-l] [-j]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <mutex>
+
+#include <getopt.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <gst/gst.h>
+#include <gst/allocators/allocators.h>
+
+#include "event-loop.h"
+#include "pipeline.h"
+#include "snapshot.h"
+#include "record.h"
+
+#define DEFAULT_FRAMES		300
+#define DEFAULT_SIZES		"640x480,1280x720,1920x1080"
+#define DEFAULT_FORMATS		"NV12,YUY2,BGRx"
+
+/* frames that aren't measured, while pools fill up and caches warm */
+#define WARMUP_FRAMES		30
+#define RUN_TIMEOUT_S		60
+
+/* segments -R leaves behind */
+#define BENCH_RECORD_SEGMENTS	3
+
+/* buffers an element may hold on to before passing them on */
+#define SEEN_MEMORIES		32
+
+/* caps, queue, convert and sink */
+#define MAX_COPY_PROBES		4
+
+struct copy_probe {
+	std::mutex mutex;
+	GstMemory *seen[SEEN_MEMORIES];
+	unsigned int next_seen;
+	guint64 bytes;
+};
+
+struct bench_run {
+	int width;
+	int height;
+	const char *format;
+
+	int frames;
+	double start_us;
+	struct rusage start_usage;
+	double last_frame_us;
+	double max_gap_us;
+
+	struct copy_probe copies[MAX_COPY_PROBES];
+	int n_copies;
+	/* waylandsink copies into wl_shm what isn't fd-backed */
+	bool sink_uploads;
+
+	/* results */
+	bool ok;
+	int measured;
+	double fps;
+	double cpu_us_per_frame;
+	double copy_bytes_per_frame;
+	long rss_kb;
+	long max_rss_kb;
+	struct pipeline_counters counters;
+	bool snapshots;
+	struct snapshot_stats snapshot_stats;
+	bool recorded;
+	struct record_stats record_stats;
+};
+
+static double
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double
+cpu_us(const struct rusage *usage)
+{
+	return usage->ru_utime.tv_sec * 1e6 + usage->ru_utime.tv_usec +
+	       usage->ru_stime.tv_sec * 1e6 + usage->ru_stime.tv_usec;
+}
+
+static long
+current_rss_kb(void)
+{
+	long pages = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return 0;
+
+	if (fscanf(f, "%*s %ld", &pages) != 1)
+		pages = 0;
+	fclose(f);
+
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void
+copy_probe_reset(struct copy_probe *probe)
+{
+	memset(probe->seen, 0, sizeof(probe->seen));
+	probe->next_seen = 0;
+	probe->bytes = 0;
+}
+
+static GstPadProbeReturn
+copy_probe_in(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+	struct copy_probe *probe = static_cast<struct copy_probe *>(data);
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	std::lock_guard<std::mutex> lock(probe->mutex);
+
+	probe->seen[probe->next_seen] = gst_buffer_peek_memory(buffer, 0);
+	probe->next_seen = (probe->next_seen + 1) % SEEN_MEMORIES;
+
+	return GST_PAD_PROBE_OK;
+}
+
+/*
+ * An element that pushes out memory it wasn't given has written the
+ * whole frame, be it a conversion or a plain copy.
+ */
+static GstPadProbeReturn
+copy_probe_out(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+	struct copy_probe *probe = static_cast<struct copy_probe *>(data);
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	GstMemory *memory = gst_buffer_peek_memory(buffer, 0);
+	std::lock_guard<std::mutex> lock(probe->mutex);
+	int i;
+
+	for (i = 0; i < SEEN_MEMORIES; i++)
+		if (probe->seen[i] == memory)
+			return GST_PAD_PROBE_OK;
+
+	probe->bytes += gst_buffer_get_size(buffer);
+	return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+sink_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+	struct bench_run *run = static_cast<struct bench_run *>(data);
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	double now = now_us();
+
+	if (run->frames > WARMUP_FRAMES && now - run->last_frame_us > run->max_gap_us)
+		run->max_gap_us = now - run->last_frame_us;
+	run->last_frame_us = now;
+
+	run->frames++;
+	if (run->frames == WARMUP_FRAMES) {
+		int i;
+
+		run->start_us = now_us();
+		getrusage(RUSAGE_SELF, &run->start_usage);
+
+		// only count what happens from here on
+		for (i = 0; i < run->n_copies; i++) {
+			std::lock_guard<std::mutex> lock(run->copies[i].mutex);
+			run->copies[i].bytes = 0;
+		}
+		return GST_PAD_PROBE_OK;
+	}
+
+	if (run->frames > WARMUP_FRAMES && run->sink_uploads &&
+	    !gst_is_fd_memory(gst_buffer_peek_memory(buffer, 0))) {
+		struct copy_probe *probe = &run->copies[run->n_copies - 1];
+		std::lock_guard<std::mutex> lock(probe->mutex);
+
+		probe->bytes += gst_buffer_get_size(buffer);
+	}
+
+	return GST_PAD_PROBE_OK;
+}
+
+static void
+add_copy_probe(struct bench_run *run, GstElement *pipeline, const char *name)
+{
+	GstElement *element;
+	GstPad *pad;
+	struct copy_probe *probe;
+
+	element = gst_bin_get_by_name(GST_BIN(pipeline), name);
+	if (!element)
+		return;
+
+	probe = &run->copies[run->n_copies++];
+	copy_probe_reset(probe);
+
+	pad = gst_element_get_static_pad(element, "sink");
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, copy_probe_in, probe, NULL);
+	gst_object_unref(pad);
+
+	pad = gst_element_get_static_pad(element, "src");
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, copy_probe_out, probe, NULL);
+	gst_object_unref(pad);
+
+	gst_object_unref(element);
+}
+
+static void
+add_probes(struct bench_run *run, GstElement *pipeline, const char *sink_name)
+{
+	GstElement *sink;
+	GstPad *pad;
+
+	run->n_copies = 0;
+	add_copy_probe(run, pipeline, "caps");
+	add_copy_probe(run, pipeline, "queue");
+	add_copy_probe(run, pipeline, "convert");
+
+	// the sink only ever gets counted in sink_probe()
+	copy_probe_reset(&run->copies[run->n_copies++]);
+	run->sink_uploads = strcmp(sink_name, "waylandsink") == 0;
+
+	sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+	pad = gst_element_get_static_pad(sink, "sink");
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, sink_probe, run, NULL);
+	gst_object_unref(pad);
+	gst_object_unref(sink);
+}
+
+/*
+ * Waits for the end of the stream, asking for the next snapshot as soon
+ * as the previous one is written if @snapshot is set, and running @loop,
+ * which has the recorder's messages, if that is.
+ */
+static GstMessage *
+wait_for_eos(struct bench_run *run, GstBus *bus, struct snapshot *snapshot,
+	     struct event_loop *loop)
+{
+	GstMessageType types = (GstMessageType) (GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+	double deadline = now_us() + RUN_TIMEOUT_S * 1e6;
+	GstMessage *msg;
+
+	if (!snapshot && !loop)
+		return gst_bus_timed_pop_filtered(bus, RUN_TIMEOUT_S * GST_SECOND, types);
+
+	while (now_us() <= deadline) {
+		msg = gst_bus_timed_pop_filtered(bus, 5 * GST_MSECOND, types);
+		if (msg)
+			return msg;
+
+		if (loop)
+			event_loop_dispatch(loop, 0);
+
+		if (snapshot && run->frames >= WARMUP_FRAMES && snapshot_idle(snapshot))
+			snapshot_request(snapshot);
+	}
+
+	return NULL;
+}
+
+static void
+run_pipeline(struct bench_run *run, struct pipeline_config *config, int frames,
+	     bool live)
+{
+	struct snapshot *snapshot = NULL;
+	struct recorder *recorder = NULL;
+	struct event_loop *loop = NULL;
+	const char *tmp_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	GstElement *pipeline;
+	GstElement *element;
+	GstMessage *msg;
+	GstBus *bus;
+	struct rusage usage;
+	guint64 copy_bytes = 0;
+	double end_us;
+	int i;
+
+	run->ok = false;
+	run->frames = 0;
+
+	config->width = run->width;
+	config->height = run->height;
+	config->format = run->format;
+
+	if (config->add_record_tap) {
+		loop = event_loop_create();
+		recorder = recorder_create(loop, tmp_dir, BENCH_RECORD_SEGMENTS, NULL);
+		config->record_location = recorder_location(recorder);
+	}
+
+	pipeline = pipeline_build(config);
+	if (!pipeline) {
+		if (recorder) {
+			recorder_destroy(recorder);
+			event_loop_destroy(loop);
+		}
+		return;
+	}
+
+	element = gst_bin_get_by_name(GST_BIN(pipeline), "source");
+	g_object_set(element, "num-buffers", frames + WARMUP_FRAMES, NULL);
+	if (config->source == PIPELINE_SOURCE_TEST && !live) {
+		g_object_set(element, "is-live", FALSE, NULL);
+		// rendering the default pattern would dwarf the pipeline
+		gst_util_set_object_arg(G_OBJECT(element), "pattern", "black");
+	}
+	gst_object_unref(element);
+
+	element = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+	g_object_set(element, "sync", (gboolean) live, NULL);
+	gst_object_unref(element);
+
+	add_probes(run, pipeline, config->sink);
+
+	if (config->add_snapshot_tap) {
+		snapshot = snapshot_create(tmp_dir, SNAPSHOT_FORMAT_JPEG, NULL);
+		element = gst_bin_get_by_name(GST_BIN(pipeline), "snapshot");
+		snapshot_set_sink(snapshot, element);
+		gst_object_unref(element);
+	}
+
+	if (recorder) {
+		recorder_set_pipeline(recorder, pipeline, config);
+		recorder_start(recorder);
+	}
+
+	bus = gst_element_get_bus(pipeline);
+	if (gst_element_set_state(pipeline, GST_STATE_PLAYING) ==
+	    GST_STATE_CHANGE_FAILURE) {
+		fprintf(stderr, "%dx%d %s: pipeline failed to start\n",
+			run->width, run->height, run->format);
+		goto out;
+	}
+
+	msg = wait_for_eos(run, bus, snapshot, loop);
+	end_us = now_us();
+	if (recorder)
+		recorder_stop(recorder);
+	getrusage(RUSAGE_SELF, &usage);
+
+	if (!msg) {
+		fprintf(stderr, "%dx%d %s: timed out after %d frames\n",
+			run->width, run->height, run->format, run->frames);
+		goto out;
+	}
+
+	if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+		GError *error = NULL;
+
+		gst_message_parse_error(msg, &error, NULL);
+		fprintf(stderr, "%dx%d %s: %s\n", run->width, run->height,
+			run->format, error->message);
+		g_error_free(error);
+		gst_message_unref(msg);
+		goto out;
+	}
+	gst_message_unref(msg);
+
+	run->measured = run->frames - WARMUP_FRAMES;
+	if (run->measured <= 0) {
+		fprintf(stderr, "%dx%d %s: only %d frames got through\n",
+			run->width, run->height, run->format, run->frames);
+		goto out;
+	}
+
+	for (i = 0; i < run->n_copies; i++)
+		copy_bytes += run->copies[i].bytes;
+
+	run->fps = run->measured * 1e6 / (end_us - run->start_us);
+	run->cpu_us_per_frame = (cpu_us(&usage) - cpu_us(&run->start_usage)) /
+				run->measured;
+	run->copy_bytes_per_frame = (double) copy_bytes / run->measured;
+	run->rss_kb = current_rss_kb();
+	run->max_rss_kb = usage.ru_maxrss;
+	pipeline_get_counters(pipeline, &run->counters);
+	run->ok = true;
+
+out:
+	if (snapshot) {
+		snapshot_set_sink(snapshot, NULL);
+		run->snapshots = true;
+		snapshot_get_stats(snapshot, &run->snapshot_stats);
+		snapshot_destroy(snapshot);
+	}
+
+	gst_element_set_state(pipeline, GST_STATE_NULL);
+	if (recorder) {
+		recorder_set_pipeline(recorder, NULL, NULL);
+		run->recorded = true;
+		recorder_get_stats(recorder, &run->record_stats);
+		recorder_destroy(recorder);
+		event_loop_destroy(loop);
+	}
+	gst_object_unref(bus);
+	gst_object_unref(pipeline);
+}
+
+static void
+bench_run_print(const struct bench_run *run, bool json)
+{
+	if (json) {
+		fprintf(stdout, "{\"width\": %d, \"height\": %d, \"format\": \"%s\", "
+			"\"ok\": %s", run->width, run->height, run->format,
+			run->ok ? "true" : "false");
+		if (run->ok)
+			fprintf(stdout, ", \"frames\": %d, \"fps\": %.1f, "
+				"\"cpu_us_per_frame\": %.1f, "
+				"\"copy_bytes_per_frame\": %.0f, "
+				"\"rss_kb\": %ld, \"max_rss_kb\": %ld",
+				run->measured, run->fps, run->cpu_us_per_frame,
+				run->copy_bytes_per_frame, run->rss_kb,
+				run->max_rss_kb);
+		if (run->ok) {
+			fprintf(stdout, ", \"max_frame_gap_us\": %.0f, \"counters\": ",
+				run->max_gap_us);
+			pipeline_counters_write_json(&run->counters, stdout);
+		}
+		if (run->ok && run->snapshots) {
+			const struct snapshot_stats *s = &run->snapshot_stats;
+
+			fprintf(stdout, ", \"snapshots\": {\"written\": %u, "
+				"\"failed\": %u, \"latency_us_mean\": %lld, "
+				"\"latency_us_max\": %lld}", s->written, s->failed,
+				(long long) s->latency_mean, (long long) s->latency_max);
+		}
+		if (run->ok && run->recorded) {
+			const struct record_stats *s = &run->record_stats;
+
+			fprintf(stdout, ", \"recording\": {\"frames_encoded\": %llu, "
+				"\"encode_fps\": %.1f, \"frames_dropped\": %llu, "
+				"\"bytes_written\": %llu, \"segments\": %u, "
+				"\"rotation_us_mean\": %lld, \"rotation_us_max\": %lld}",
+				(unsigned long long) s->frames_encoded, s->encode_fps,
+				(unsigned long long) s->frames_dropped,
+				(unsigned long long) s->bytes_written, s->segments_closed,
+				(long long) s->rotation_mean, (long long) s->rotation_max);
+		}
+		fprintf(stdout, "}\n");
+		return;
+	}
+
+	if (!run->ok) {
+		fprintf(stdout, "%5dx%-5d %-6s FAILED\n",
+			run->width, run->height, run->format);
+		return;
+	}
+
+	fprintf(stdout, "%5dx%-5d %-6s %8.1f fps  cpu %8.1f us/frame  "
+		"copies %9.0f B/frame  rss %6ld kB (peak %ld kB)",
+		run->width, run->height, run->format, run->fps,
+		run->cpu_us_per_frame, run->copy_bytes_per_frame,
+		run->rss_kb, run->max_rss_kb);
+	fprintf(stdout, "  max gap %.1f ms", run->max_gap_us / 1000.0);
+	if (run->snapshots)
+		fprintf(stdout, "  snapshots %u (latency mean %.1f ms, max %.1f ms)",
+			run->snapshot_stats.written,
+			run->snapshot_stats.latency_mean / 1000.0,
+			run->snapshot_stats.latency_max / 1000.0);
+	if (run->recorded)
+		fprintf(stdout, "  encoded %.1f fps (%llu dropped), %.1f MiB in "
+			"%u segments (rotation mean %.1f ms, max %.1f ms)",
+			run->record_stats.encode_fps,
+			(unsigned long long) run->record_stats.frames_dropped,
+			run->record_stats.bytes_written / (1024.0 * 1024.0),
+			run->record_stats.segments_closed,
+			run->record_stats.rotation_mean / 1000.0,
+			run->record_stats.rotation_max / 1000.0);
+	if (run->counters.queue_dropped || run->counters.late_dropped)
+		fprintf(stdout, "  dropped %llu queue %llu late",
+			(unsigned long long) run->counters.queue_dropped,
+			(unsigned long long) run->counters.late_dropped);
+	fprintf(stdout, "\n");
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-d device [-e]] [-k sink] [-n frames] [-r WxH,...] "
+		"[-f format,...] [-c] [-q] [-L] [-s] [-R seconds] [-l] [-j]\n"
+		"  -d  capture from a V4L2 device, e.g. vivid, instead of videotestsrc\n"
+		"  -e  have the device export DMABUFs rather than mmap its buffers\n"
+		"  -k  sink element (default fakesink)\n"
+		"  -n  frames measured per run (default %d)\n"
+		"  -r  resolutions (default %s)\n"
+		"  -f  formats (default %s)\n"
+		"  -c  add a videoconvert, as when the compositor lacks the format\n"
+		"  -q  add a queue\n"
+		"  -L  low latency mode, see PIPELINE_LATENCY_LOW\n"
+		"  -s  take JPEG snapshots back to back, into TMPDIR or /tmp\n"
+		"  -R  record in segments of that many seconds, into TMPDIR or\n"
+		"      /tmp, keeping the newest %d\n"
+		"  -l  keep videotestsrc live and the sink synchronised\n"
+		"  -j  one JSON object per run\n",
+		name, DEFAULT_FRAMES, DEFAULT_SIZES, DEFAULT_FORMATS,
+		BENCH_RECORD_SEGMENTS);
+}
+
+int main(int argc, char *argv[])
+{
+	struct pipeline_config config = {};
+	const char *sizes = DEFAULT_SIZES;
+	const char *formats = DEFAULT_FORMATS;
+	int frames = DEFAULT_FRAMES;
+	bool live = false;
+	bool json = false;
+	char pipeline_str[1024];
+	char **size_list;
+	char **format_list;
+	int failures = 0;
+	int opt;
+	int i, j;
+
+	gst_init(&argc, &argv);
+
+	config.source = PIPELINE_SOURCE_TEST;
+	config.io_mode = V4L2_IO_MODE_MMAP;
+	config.sink = "fakesink";
+
+	while ((opt = getopt(argc, argv, "d:ek:n:r:f:cqLsR:ljh")) != -1) {
+		switch (opt) {
+		case 'd':
+			config.source = PIPELINE_SOURCE_V4L2;
+			config.device = optarg;
+			break;
+		case 'e':
+			config.io_mode = V4L2_IO_MODE_DMABUF;
+			break;
+		case 'k':
+			config.sink = optarg;
+			break;
+		case 'n':
+			frames = atoi(optarg);
+			break;
+		case 'r':
+			sizes = optarg;
+			break;
+		case 'f':
+			formats = optarg;
+			break;
+		case 'c':
+			config.add_convert = true;
+			break;
+		case 'q':
+			config.add_queue = true;
+			break;
+		case 'L':
+			config.latency = PIPELINE_LATENCY_LOW;
+			break;
+		case 's':
+			config.add_snapshot_tap = true;
+			break;
+		case 'R':
+			config.add_record_tap = true;
+			config.record_segment_s = atoi(optarg);
+			break;
+		case 'l':
+			live = true;
+			break;
+		case 'j':
+			json = true;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (frames <= 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	pipeline_config_describe(&config, pipeline_str, sizeof(pipeline_str));
+	if (!json)
+		fprintf(stdout, "pipeline: %s, %d frames per run\n",
+			pipeline_str, frames);
+
+	size_list = g_strsplit(sizes, ",", -1);
+	format_list = g_strsplit(formats, ",", -1);
+
+	for (i = 0; size_list[i]; i++) {
+		struct bench_run *run;
+		int width, height;
+
+		if (sscanf(size_list[i], "%dx%d", &width, &height) != 2) {
+			fprintf(stderr, "Invalid resolution %s\n", size_list[i]);
+			failures++;
+			continue;
+		}
+
+		for (j = 0; format_list[j]; j++) {
+			run = new struct bench_run();
+			run->width = width;
+			run->height = height;
+			run->format = format_list[j];
+
+			run_pipeline(run, &config, frames, live);
+			bench_run_print(run, json);
+			if (!run->ok)
+				failures++;
+
+			delete run;
+		}
+	}
+
+	g_strfreev(size_list);
+	g_strfreev(format_list);
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
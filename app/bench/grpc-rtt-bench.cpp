@@ -0,0 +1,146 @@
+/*
+ * Round-trip latency of GrpcClient calls against an in-process stub
+ * AglShellManagerService, over loopback TCP and over a Unix domain
+ * socket. For each transport it reports the first call of a cold client
+ * (which pays for the connection), the time WaitForConnected() takes
+ * to warm a channel up, and the percentiles of back to back calls on
+ * the warm channel.
+ *
+ * Exits with a non-zero status if a call fails.
+ *
+ *   grpc-rtt-bench [iterations]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "AglShellGrpcClient.h"
+#include "agl_shell.grpc.pb.h"
+
+#define DEFAULT_ITERATIONS	1000
+#define DEADLINE_MS		1000
+
+class StubShellService final : public agl_shell_ipc::AglShellManagerService::Service {
+public:
+	grpc::Status SetAppFloat(grpc::ServerContext *context,
+				 const agl_shell_ipc::FloatRequest *request,
+				 agl_shell_ipc::FloatResponse *reply) override
+	{
+		return grpc::Status::OK;
+	}
+};
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static double
+percentile(std::vector<double> &samples, double p)
+{
+	size_t i = (size_t) (p * (samples.size() - 1));
+
+	std::nth_element(samples.begin(), samples.begin() + i, samples.end());
+	return samples[i];
+}
+
+/* returns false if a call failed */
+static bool
+run_transport(const char *name, const std::string &address, int iterations)
+{
+	std::vector<double> samples;
+	double start, cold_ms, connect_ms;
+	bool connected;
+	int i;
+
+	// a client of its own, the first call connects
+	{
+		GrpcClient cold(address, DEADLINE_MS);
+
+		start = now_ms();
+		if (!cold.SetAppFloat("rtt-bench", 0, 0)) {
+			fprintf(stderr, "%s: first call failed\n", name);
+			return false;
+		}
+		cold_ms = now_ms() - start;
+	}
+
+	GrpcClient client(address, DEADLINE_MS);
+
+	start = now_ms();
+	connected = client.WaitForConnected(DEADLINE_MS);
+	connect_ms = now_ms() - start;
+	if (!connected) {
+		fprintf(stderr, "%s: channel not ready after %d ms\n", name, DEADLINE_MS);
+		return false;
+	}
+
+	samples.reserve(iterations);
+	for (i = 0; i < iterations; i++) {
+		start = now_ms();
+		if (!client.SetAppFloat("rtt-bench", 0, 0)) {
+			fprintf(stderr, "%s: call %d failed\n", name, i);
+			return false;
+		}
+		samples.push_back(now_ms() - start);
+	}
+
+	fprintf(stdout, "%-6s cold call %7.2f ms  warm-up %7.2f ms  "
+		"rtt p50 %6.3f ms  p99 %6.3f ms  max %6.3f ms\n",
+		name, cold_ms, connect_ms, percentile(samples, 0.5),
+		percentile(samples, 0.99),
+		*std::max_element(samples.begin(), samples.end()));
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	StubShellService service;
+	grpc::ServerBuilder builder;
+	std::unique_ptr<grpc::Server> server;
+	std::string socket_path;
+	int port = 0;
+	bool ok;
+
+	if (iterations <= 0)
+		iterations = DEFAULT_ITERATIONS;
+
+	socket_path = std::string(runtime_dir ? runtime_dir : "/tmp") +
+		      "/grpc-rtt-bench-" + std::to_string(getpid()) + ".sock";
+
+	builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(), &port);
+	builder.AddListeningPort("unix:" + socket_path, grpc::InsecureServerCredentials());
+	builder.RegisterService(&service);
+	server = builder.BuildAndStart();
+	if (!server || port == 0) {
+		fprintf(stderr, "Couldn't start the stub shell server\n");
+		return EXIT_FAILURE;
+	}
+
+	fprintf(stdout, "stub shell on 127.0.0.1:%d and %s, %d calls each\n",
+		port, socket_path.c_str(), iterations);
+
+	ok = run_transport("tcp", "127.0.0.1:" + std::to_string(port), iterations);
+	ok &= run_transport("unix", "unix:" + socket_path, iterations);
+
+	server->Shutdown();
+	unlink(socket_path.c_str());
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
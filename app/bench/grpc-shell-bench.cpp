@@ -0,0 +1,219 @@
+/*
+ * Runs GrpcClient against an in-process fake AglShellManagerService that
+ * can be told to answer late or to fail, and checks that calls stay
+ * bounded by the client deadline and that the asynchronous variants let
+ * the caller get on with its own work in the meantime, and that a layout
+ * transaction pipelines its calls.
+ *
+ * Exits with a non-zero status if any of the expectations isn't met.
+ *
+ *   grpc-shell-bench [deadline-ms]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <grpcpp/grpcpp.h>
+
+#include "AglShellGrpcClient.h"
+#include "agl_shell.grpc.pb.h"
+
+#define DEFAULT_DEADLINE_MS	200
+#define ITERATIONS		50
+
+class FakeShellService final : public agl_shell_ipc::AglShellManagerService::Service {
+public:
+	// every call sleeps @delay_ms, and one in @fail_every fails
+	void Configure(int delay_ms, int fail_every)
+	{
+		m_delay_ms = delay_ms;
+		m_fail_every = fail_every;
+	}
+
+	grpc::Status SetAppFloat(grpc::ServerContext *context,
+				 const agl_shell_ipc::FloatRequest *request,
+				 agl_shell_ipc::FloatResponse *reply) override
+	{
+		return Answer();
+	}
+
+	grpc::Status SetAppNormal(grpc::ServerContext *context,
+				  const agl_shell_ipc::NormalRequest *request,
+				  agl_shell_ipc::NormalResponse *reply) override
+	{
+		return Answer();
+	}
+
+	grpc::Status SetAppScale(grpc::ServerContext *context,
+				 const agl_shell_ipc::AppScaleRequest *request,
+				 agl_shell_ipc::AppScaleResponse *reply) override
+	{
+		return Answer();
+	}
+
+	grpc::Status SetAppOnOutput(grpc::ServerContext *context,
+				    const agl_shell_ipc::AppOnOutputRequest *request,
+				    agl_shell_ipc::AppOnOutputResponse *reply) override
+	{
+		return Answer();
+	}
+
+	grpc::Status ActivateApp(grpc::ServerContext *context,
+				 const agl_shell_ipc::ActivateRequest *request,
+				 agl_shell_ipc::ActivateResponse *reply) override
+	{
+		return Answer();
+	}
+
+private:
+	grpc::Status Answer()
+	{
+		int call = m_calls++;
+
+		if (m_delay_ms > 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(m_delay_ms.load()));
+
+		if (m_fail_every > 0 && call % m_fail_every == 0)
+			return grpc::Status(grpc::StatusCode::UNAVAILABLE, "injected failure");
+
+		return grpc::Status::OK;
+	}
+
+	std::atomic<int> m_delay_ms{0};
+	std::atomic<int> m_fail_every{0};
+	std::atomic<int> m_calls{0};
+};
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int failures;
+
+static void
+expect(bool condition, const char *what)
+{
+	fprintf(stdout, "  %-58s %s\n", what, condition ? "ok" : "FAILED");
+	if (!condition)
+		failures++;
+}
+
+static void
+run_sync(GrpcClient *client, const char *name, int *ok_count, double *mean_ms,
+	 double *max_ms)
+{
+	double total = 0;
+	int i;
+
+	*ok_count = 0;
+	*max_ms = 0;
+
+	for (i = 0; i < ITERATIONS; i++) {
+		double start = now_ms();
+		double elapsed;
+
+		if (client->SetAppFloat(name, 30, 400))
+			(*ok_count)++;
+
+		elapsed = now_ms() - start;
+		total += elapsed;
+		if (elapsed > *max_ms)
+			*max_ms = elapsed;
+	}
+
+	*mean_ms = total / ITERATIONS;
+	fprintf(stdout, "%-16s ok %2d/%d  mean %7.2f ms  max %7.2f ms\n",
+		name, *ok_count, ITERATIONS, *mean_ms, *max_ms);
+}
+
+int main(int argc, char *argv[])
+{
+	int deadline_ms = argc > 1 ? atoi(argv[1]) : DEFAULT_DEADLINE_MS;
+	FakeShellService service;
+	grpc::ServerBuilder builder;
+	std::unique_ptr<grpc::Server> server;
+	int port = 0;
+	int ok_count;
+	double mean_ms, max_ms, start, elapsed;
+
+	builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(), &port);
+	builder.RegisterService(&service);
+	server = builder.BuildAndStart();
+	if (!server || port == 0) {
+		fprintf(stderr, "Couldn't start the fake shell server\n");
+		return EXIT_FAILURE;
+	}
+
+	std::string address = "127.0.0.1:" + std::to_string(port);
+	GrpcClient client(address, deadline_ms);
+
+	fprintf(stdout, "fake shell on %s, deadline %d ms\n", address.c_str(), deadline_ms);
+
+	service.Configure(0, 0);
+	run_sync(&client, "fast server", &ok_count, &mean_ms, &max_ms);
+	expect(ok_count == ITERATIONS, "all calls succeed");
+
+	service.Configure(0, 5);
+	run_sync(&client, "failing server", &ok_count, &mean_ms, &max_ms);
+	expect(ok_count == ITERATIONS - ITERATIONS / 5, "injected failures are reported");
+
+	// the slow server keeps its threads busy, a few calls are enough
+	service.Configure(deadline_ms * 3, 0);
+	start = now_ms();
+	expect(!client.SetAppFloat("slow server", 30, 400), "late answer fails");
+	elapsed = now_ms() - start;
+	fprintf(stdout, "slow server      call returned after %.1f ms\n", elapsed);
+	expect(elapsed < deadline_ms * 2, "call is bounded by the deadline");
+
+	// overlap: the caller's own work runs while the call is in flight
+	service.Configure(deadline_ms / 2, 0);
+	start = now_ms();
+	std::future<bool> result = client.SetAppFloatAsync("overlap", 30, 400);
+	std::this_thread::sleep_for(std::chrono::milliseconds(deadline_ms / 2));
+	expect(result.get(), "async call succeeds");
+	elapsed = now_ms() - start;
+	fprintf(stdout, "overlap          work + call took %.1f ms, serial would be %d ms\n",
+		elapsed, deadline_ms);
+	expect(elapsed < deadline_ms * 0.9, "async call overlaps with other work");
+
+	// a layout: the normal mode is overridden, float, scale and output
+	// are in flight together and the activation follows them, where
+	// one call after the other would take four round trips
+	LayoutTransaction layout("layout");
+	layout.Normal().Float(30, 400).Scale(640, 480).Output("HDMI-A-1").Activate("");
+	expect(layout.Calls() == 4, "redundant layout calls are coalesced");
+
+	service.Configure(deadline_ms / 4, 0);
+	start = now_ms();
+	grpc::Status status = client.ApplyLayout(layout);
+	elapsed = now_ms() - start;
+	fprintf(stdout, "layout           %d calls took %.1f ms, serial would be %d ms\n",
+		layout.Calls(), elapsed, deadline_ms);
+	expect(status.ok(), "layout succeeds");
+	expect(elapsed < deadline_ms * 0.75, "layout calls are pipelined");
+
+	service.Configure(0, 1);
+	expect(!client.ApplyLayout(layout).ok(), "a failed layout call fails the layout");
+
+	server->Shutdown();
+
+	// nobody listening any more: gRPC would keep retrying to connect
+	start = now_ms();
+	expect(!client.SetAppNormal("no server"), "call without a server fails");
+	elapsed = now_ms() - start;
+	fprintf(stdout, "no server        call returned after %.1f ms\n", elapsed);
+	expect(elapsed < deadline_ms * 2, "missing server doesn't stall the caller");
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,121 @@
+/*
+ * Compares the time it takes to get a pipeline to READY when it's
+ * described as a gst-launch string and handed to gst_parse_launch(),
+ * which is what create_pipeline() used to do, versus building it with
+ * pipeline_build().
+ *
+ * Runs headless: videotestsrc ! capsfilter ! fakesink by default.
+ *
+ *   pipeline-startup-bench [iterations] [width] [height]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include <gst/gst.h>
+
+#include "pipeline.h"
+
+#define DEFAULT_ITERATIONS	200
+
+struct bench_result {
+	double min_us;
+	double max_us;
+	double total_us;
+	int runs;
+};
+
+static double
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void
+bench_result_add(struct bench_result *result, double us)
+{
+	if (result->runs == 0 || us < result->min_us)
+		result->min_us = us;
+	if (us > result->max_us)
+		result->max_us = us;
+
+	result->total_us += us;
+	result->runs++;
+}
+
+static void
+bench_result_print(const char *name, const struct bench_result *result)
+{
+	fprintf(stdout, "%-14s runs %4d  mean %8.1f us  min %8.1f us  max %8.1f us\n",
+		name, result->runs, result->total_us / result->runs,
+		result->min_us, result->max_us);
+}
+
+static bool
+bring_up(GstElement *pipeline)
+{
+	bool ok = gst_element_set_state(pipeline, GST_STATE_READY) !=
+		GST_STATE_CHANGE_FAILURE;
+
+	gst_element_set_state(pipeline, GST_STATE_NULL);
+	gst_object_unref(pipeline);
+
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	struct pipeline_config config = {};
+	struct bench_result parse = {};
+	struct bench_result build = {};
+	char pipeline_str[1024];
+	int iterations = DEFAULT_ITERATIONS;
+	int i;
+
+	gst_init(&argc, &argv);
+
+	if (argc >= 2)
+		iterations = atoi(argv[1]);
+
+	config.source = PIPELINE_SOURCE_TEST;
+	config.width = argc >= 3 ? atoi(argv[2]) : 640;
+	config.height = argc >= 4 ? atoi(argv[3]) : 480;
+	config.sink = "fakesink";
+
+	pipeline_config_describe(&config, pipeline_str, sizeof(pipeline_str));
+	fprintf(stdout, "pipeline: %s\n", pipeline_str);
+
+	// warm up the registry and plugin loading so that neither path
+	// pays for it
+	bring_up(pipeline_build(&config));
+
+	for (i = 0; i < iterations; i++) {
+		GError *error = NULL;
+		GstElement *pipeline;
+		double start;
+
+		start = now_us();
+		pipeline = gst_parse_launch(pipeline_str, &error);
+		if (error || !pipeline || !bring_up(pipeline)) {
+			fprintf(stderr, "gst_parse_launch() failed\n");
+			return EXIT_FAILURE;
+		}
+		bench_result_add(&parse, now_us() - start);
+
+		start = now_us();
+		pipeline = pipeline_build(&config);
+		if (!pipeline || !bring_up(pipeline)) {
+			fprintf(stderr, "pipeline_build() failed\n");
+			return EXIT_FAILURE;
+		}
+		bench_result_add(&build, now_us() - start);
+	}
+
+	bench_result_print("parse-launch", &parse);
+	bench_result_print("builder", &build);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,584 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+#include <linux/videodev2.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "camera-discovery.h"
+
+#define CAMERA_CACHE_MAGIC	0x43474431	/* CGD1 */
+#define CAMERA_CACHE_FILE	"camera-gstreamer-devices.cache"
+
+struct camera_probe {
+	struct camera_device device;
+	bool done;
+	bool ok;
+};
+
+/* shared with the probing threads, which may outlive the discovery
+ * if a node hangs past the timeout */
+struct camera_probe_state {
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::vector<camera_probe> probes;
+	int pending;
+};
+
+struct camera_discovery {
+	std::shared_ptr<camera_probe_state> state;
+	std::chrono::steady_clock::time_point deadline;
+	uint64_t key;
+
+	/* set when the result comes from the cache */
+	bool cached;
+	struct camera_device_list list;
+};
+
+struct camera_cache_header {
+	uint32_t magic;
+	uint32_t header_size;
+	uint32_t device_size;
+	int32_t count;
+	uint64_t key;
+};
+
+static bool
+is_video_node(const char *name)
+{
+	return strncmp(name, "video", 5) == 0 && isdigit(name[5]);
+}
+
+static int
+video_node_number(const char *path)
+{
+	const char *name = strrchr(path, '/');
+
+	return atoi((name ? name + 1 : path) + 5);
+}
+
+static uint64_t
+fnv1a(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *p = static_cast<const unsigned char *>(data);
+
+	for (size_t i = 0; i < size; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/*
+ * Lists the video nodes in /dev and computes a key out of their names,
+ * device numbers and ctimes. udev recreates the nodes whenever devices
+ * come and go, so the key changes with them.
+ */
+static uint64_t
+scan_video_nodes(std::vector<std::string> *nodes)
+{
+	uint64_t key = 0xcbf29ce484222325ULL;
+	struct dirent *dirent;
+	DIR *dir;
+
+	dir = opendir("/dev");
+	if (!dir) {
+		perror("Couldn't open the '/dev' directory");
+		return 0;
+	}
+
+	while ((dirent = readdir(dir)) != NULL) {
+		char path[PATH_MAX];
+
+		if (!is_video_node(dirent->d_name))
+			continue;
+
+		snprintf(path, sizeof(path), "/dev/%s", dirent->d_name);
+		nodes->push_back(path);
+	}
+
+	closedir(dir);
+
+	// readdir() order isn't stable, the key has to be
+	std::sort(nodes->begin(), nodes->end());
+
+	for (const std::string &node : *nodes) {
+		struct stat st;
+
+		if (stat(node.c_str(), &st) < 0)
+			continue;
+
+		key = fnv1a(key, node.c_str(), node.size());
+		key = fnv1a(key, &st.st_rdev, sizeof(st.st_rdev));
+		key = fnv1a(key, &st.st_ctim.tv_sec, sizeof(st.st_ctim.tv_sec));
+		key = fnv1a(key, &st.st_ctim.tv_nsec, sizeof(st.st_ctim.tv_nsec));
+	}
+
+	return key;
+}
+
+/* the rates a stepwise interval range gets sampled at, besides its fastest */
+static const uint32_t common_rates[] = { 60, 30, 25, 15 };
+
+/* and the sizes a stepwise size range gets sampled at, besides its largest */
+static const struct {
+	uint32_t width;
+	uint32_t height;
+} common_sizes[] = {
+	{ 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 },
+};
+
+static void
+add_mode(struct camera_device *device, uint32_t format, uint32_t width,
+	 uint32_t height, uint32_t fps_num, uint32_t fps_den)
+{
+	struct camera_mode *mode;
+	int i;
+
+	for (i = 0; i < device->n_modes; i++) {
+		mode = &device->modes[i];
+		if (mode->format == format && mode->width == width &&
+		    mode->height == height &&
+		    (uint64_t) mode->fps_num * fps_den == (uint64_t) fps_num * mode->fps_den)
+			return;
+	}
+
+	if (device->n_modes == CAMERA_MAX_MODES)
+		return;
+
+	mode = &device->modes[device->n_modes++];
+	mode->format = format;
+	mode->width = width;
+	mode->height = height;
+	mode->fps_num = fps_num;
+	mode->fps_den = fps_den;
+}
+
+/* V4L2 lists frame intervals, seconds per frame, rather than rates */
+static void
+probe_frame_intervals(int fd, uint32_t pixelformat, uint32_t width,
+		      uint32_t height, struct camera_device *device)
+{
+	struct v4l2_frmivalenum frmival;
+	bool found = false;
+
+	memset(&frmival, 0, sizeof(frmival));
+	frmival.pixel_format = pixelformat;
+	frmival.width = width;
+	frmival.height = height;
+
+	while (ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) == 0) {
+		const struct v4l2_fract *fastest, *slowest;
+
+		found = true;
+
+		if (frmival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+			add_mode(device, pixelformat, width, height,
+				 frmival.discrete.denominator,
+				 frmival.discrete.numerator);
+			frmival.index++;
+			continue;
+		}
+
+		// stepwise or continuous, there's only one entry
+		fastest = &frmival.stepwise.min;
+		slowest = &frmival.stepwise.max;
+		add_mode(device, pixelformat, width, height,
+			 fastest->denominator, fastest->numerator);
+		for (uint32_t rate : common_rates) {
+			if ((uint64_t) rate * fastest->numerator <= fastest->denominator &&
+			    (uint64_t) rate * slowest->numerator >= slowest->denominator)
+				add_mode(device, pixelformat, width, height, rate, 1);
+		}
+		break;
+	}
+
+	if (!found)
+		add_mode(device, pixelformat, width, height, 0, 0);
+}
+
+static void
+probe_frame_sizes(int fd, uint32_t pixelformat, struct camera_device *device)
+{
+	struct v4l2_frmsizeenum frmsize;
+
+	memset(&frmsize, 0, sizeof(frmsize));
+	frmsize.pixel_format = pixelformat;
+
+	while (ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) == 0) {
+		const struct v4l2_frmsize_stepwise *range = &frmsize.stepwise;
+		uint32_t width, height;
+
+		if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+			width = frmsize.discrete.width;
+			height = frmsize.discrete.height;
+		} else {
+			// stepwise or continuous, there's only one entry
+			width = range->max_width;
+			height = range->max_height;
+		}
+
+		if ((uint64_t) width * height >
+		    (uint64_t) device->max_width * device->max_height) {
+			device->max_width = width;
+			device->max_height = height;
+		}
+
+		probe_frame_intervals(fd, pixelformat, width, height, device);
+
+		if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+			frmsize.index++;
+			continue;
+		}
+
+		for (const auto &size : common_sizes) {
+			uint32_t step_width = std::max(range->step_width, 1u);
+			uint32_t step_height = std::max(range->step_height, 1u);
+
+			if (size.width < range->min_width || size.width > range->max_width ||
+			    size.height < range->min_height || size.height > range->max_height ||
+			    (size.width - range->min_width) % step_width ||
+			    (size.height - range->min_height) % step_height)
+				continue;
+
+			probe_frame_intervals(fd, pixelformat, size.width,
+					      size.height, device);
+		}
+		break;
+	}
+}
+
+static bool
+probe_node(const char *path, struct camera_device *device)
+{
+	struct v4l2_capability vid_cap;
+	struct v4l2_fmtdesc fmtdesc;
+	int fd;
+
+	memset(device, 0, sizeof(*device));
+	snprintf(device->path, sizeof(device->path), "%s", path);
+
+	fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+
+	if (ioctl(fd, VIDIOC_QUERYCAP, &vid_cap) < 0) {
+		close(fd);
+		return false;
+	}
+
+	snprintf(device->card, sizeof(device->card), "%s", vid_cap.card);
+
+	// device_caps describes this node, capabilities the whole device
+	if (vid_cap.capabilities & V4L2_CAP_DEVICE_CAPS)
+		device->caps = vid_cap.device_caps;
+	else
+		device->caps = vid_cap.capabilities;
+
+	device->capture = (device->caps & V4L2_CAP_VIDEO_CAPTURE) ||
+			  (device->caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE);
+
+	if (!device->capture) {
+		close(fd);
+		return true;
+	}
+
+	memset(&fmtdesc, 0, sizeof(fmtdesc));
+	fmtdesc.type = (device->caps & V4L2_CAP_VIDEO_CAPTURE) ?
+		V4L2_BUF_TYPE_VIDEO_CAPTURE : V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+
+	while (device->n_formats < CAMERA_MAX_FORMATS &&
+	       ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0) {
+		device->formats[device->n_formats++] = fmtdesc.pixelformat;
+		probe_frame_sizes(fd, fmtdesc.pixelformat, device);
+		fmtdesc.index++;
+	}
+
+	close(fd);
+	return true;
+}
+
+/*
+ * Capture nodes first, then the ones that can stream, then by number
+ * of formats and largest frame size. Ties keep /dev order.
+ */
+static bool
+camera_device_better(const struct camera_device &a, const struct camera_device &b)
+{
+	uint64_t a_pixels = (uint64_t) a.max_width * a.max_height;
+	uint64_t b_pixels = (uint64_t) b.max_width * b.max_height;
+	bool a_streaming = a.caps & V4L2_CAP_STREAMING;
+	bool b_streaming = b.caps & V4L2_CAP_STREAMING;
+
+	if (a.capture != b.capture)
+		return a.capture;
+	if (a_streaming != b_streaming)
+		return a_streaming;
+	if (a.n_formats != b.n_formats)
+		return a.n_formats > b.n_formats;
+	if (a_pixels != b_pixels)
+		return a_pixels > b_pixels;
+
+	return video_node_number(a.path) < video_node_number(b.path);
+}
+
+static bool
+camera_cache_path(char *path, size_t size)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+
+	if (!dir)
+		return false;
+
+	snprintf(path, size, "%s/%s", dir, CAMERA_CACHE_FILE);
+	return true;
+}
+
+static bool
+camera_cache_load(uint64_t key, struct camera_device_list *list)
+{
+	struct camera_cache_header header;
+	char path[PATH_MAX];
+	bool ok;
+	FILE *file;
+
+	if (!camera_cache_path(path, sizeof(path)))
+		return false;
+
+	file = fopen(path, "rb");
+	if (!file)
+		return false;
+
+	ok = fread(&header, sizeof(header), 1, file) == 1 &&
+	     header.magic == CAMERA_CACHE_MAGIC &&
+	     header.header_size == sizeof(header) &&
+	     header.device_size == sizeof(struct camera_device) &&
+	     header.key == key &&
+	     header.count >= 0 && header.count <= CAMERA_MAX_DEVICES;
+
+	if (ok && header.count > 0)
+		ok = fread(list->devices, sizeof(list->devices[0]),
+			   header.count, file) == (size_t) header.count;
+
+	fclose(file);
+
+	list->count = ok ? header.count : 0;
+	return ok;
+}
+
+static void
+camera_cache_save(uint64_t key, const struct camera_device_list *list)
+{
+	struct camera_cache_header header = {};
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX + 4];
+	bool written;
+	FILE *file;
+
+	if (!camera_cache_path(path, sizeof(path)))
+		return;
+
+	header.magic = CAMERA_CACHE_MAGIC;
+	header.header_size = sizeof(header);
+	header.device_size = sizeof(struct camera_device);
+	header.key = key;
+	header.count = list->count;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	file = fopen(tmp_path, "wb");
+	if (!file)
+		return;
+
+	written = fwrite(&header, sizeof(header), 1, file) == 1;
+	if (written && list->count > 0)
+		written = fwrite(list->devices, sizeof(list->devices[0]),
+				 list->count, file) == (size_t) list->count;
+	written = fclose(file) == 0 && written;
+
+	if (!written || rename(tmp_path, path) < 0)
+		unlink(tmp_path);
+}
+
+struct camera_discovery *
+camera_discovery_start(int timeout_ms)
+{
+	struct camera_discovery *discovery = new camera_discovery();
+	std::vector<std::string> nodes;
+
+	discovery->key = scan_video_nodes(&nodes);
+	discovery->deadline = std::chrono::steady_clock::now() +
+		std::chrono::milliseconds(timeout_ms);
+
+	if (camera_cache_load(discovery->key, &discovery->list)) {
+		discovery->cached = true;
+		return discovery;
+	}
+
+	discovery->state = std::make_shared<camera_probe_state>();
+	discovery->state->probes.resize(nodes.size());
+	discovery->state->pending = nodes.size();
+
+	for (size_t i = 0; i < nodes.size(); i++)
+		snprintf(discovery->state->probes[i].device.path,
+			 sizeof(discovery->state->probes[i].device.path),
+			 "%s", nodes[i].c_str());
+
+	for (size_t i = 0; i < nodes.size(); i++) {
+		std::shared_ptr<camera_probe_state> state = discovery->state;
+		std::string node = nodes[i];
+
+		// detached: a node stuck in open() or an ioctl must not
+		// hold up the rest, we just stop waiting for it
+		std::thread([state, node, i]() {
+			struct camera_device device;
+			bool ok = probe_node(node.c_str(), &device);
+
+			std::lock_guard<std::mutex> lock(state->mutex);
+			state->probes[i].device = device;
+			state->probes[i].ok = ok;
+			state->probes[i].done = true;
+			state->pending--;
+			state->cv.notify_one();
+		}).detach();
+	}
+
+	return discovery;
+}
+
+int
+camera_discovery_finish(struct camera_discovery *discovery,
+			struct camera_device_list *list)
+{
+	std::vector<camera_device> devices;
+	bool complete;
+	int i;
+
+	if (discovery->cached) {
+		*list = discovery->list;
+		delete discovery;
+		return list->count;
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(discovery->state->mutex);
+
+		complete = discovery->state->cv.wait_until(lock, discovery->deadline,
+				[discovery] { return discovery->state->pending == 0; });
+
+		for (const camera_probe &probe : discovery->state->probes) {
+			if (probe.done && probe.ok)
+				devices.push_back(probe.device);
+			else if (!probe.done)
+				fprintf(stderr, "Timed out probing %s\n", probe.device.path);
+		}
+	}
+
+	std::stable_sort(devices.begin(), devices.end(), camera_device_better);
+
+	list->count = std::min<int>(devices.size(), CAMERA_MAX_DEVICES);
+	for (i = 0; i < list->count; i++)
+		list->devices[i] = devices[i];
+
+	// don't remember a partial result
+	if (complete)
+		camera_cache_save(discovery->key, list);
+
+	delete discovery;
+	return list->count;
+}
+
+const struct camera_device *
+camera_device_list_first_capture(const struct camera_device_list *list)
+{
+	if (list->count == 0 || !list->devices[0].capture)
+		return NULL;
+
+	return &list->devices[0];
+}
+
+static double
+mode_fps(const struct camera_mode *mode)
+{
+	return mode->fps_den ? (double) mode->fps_num / mode->fps_den : 0;
+}
+
+/* 29.97 is as good as 30 */
+static bool
+mode_fast_enough(const struct camera_mode *mode, int fps)
+{
+	return !mode->fps_den || mode_fps(mode) >= fps - 0.5;
+}
+
+static bool
+camera_mode_better(const struct camera_mode *a, const struct camera_mode *b,
+		   int width, int height, int fps)
+{
+	uint64_t a_pixels = (uint64_t) a->width * a->height;
+	uint64_t b_pixels = (uint64_t) b->width * b->height;
+	bool a_fast = mode_fast_enough(a, fps);
+	bool b_fast = mode_fast_enough(b, fps);
+	bool a_covers = a->width >= (uint32_t) width && a->height >= (uint32_t) height;
+	bool b_covers = b->width >= (uint32_t) width && b->height >= (uint32_t) height;
+
+	// a smooth preview matters more than a sharp one
+	if (a_fast != b_fast)
+		return a_fast;
+	if (!a_fast && mode_fps(a) != mode_fps(b))
+		return mode_fps(a) > mode_fps(b);
+
+	if (a_covers != b_covers)
+		return a_covers;
+	if (a_pixels != b_pixels)
+		return a_covers ? a_pixels < b_pixels : a_pixels > b_pixels;
+
+	// known rates over unknown ones, then the least bandwidth
+	if (!a->fps_den != !b->fps_den)
+		return a->fps_den;
+	return mode_fps(a) < mode_fps(b);
+}
+
+bool
+camera_device_pick_mode(const struct camera_device *device, uint32_t format,
+			int width, int height, int fps, struct camera_mode *mode)
+{
+	const struct camera_mode *best = NULL;
+	int i;
+
+	for (i = 0; i < device->n_modes; i++) {
+		const struct camera_mode *candidate = &device->modes[i];
+
+		if (format && candidate->format != format)
+			continue;
+
+		if (!best || camera_mode_better(candidate, best, width, height, fps))
+			best = candidate;
+	}
+
+	if (!best)
+		return false;
+
+	*mode = *best;
+	return true;
+}
+
+bool
+camera_device_probe(const char *path, struct camera_device *device)
+{
+	return probe_node(path, device);
+}
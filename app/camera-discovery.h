@@ -0,0 +1,85 @@
+#ifndef __CAMERA_DISCOVERY_H
+#define __CAMERA_DISCOVERY_H
+
+#include <cstdint>
+
+#define CAMERA_MAX_DEVICES	32
+#define CAMERA_MAX_FORMATS	16
+#define CAMERA_MAX_MODES	96
+
+/* a frame size and rate the camera captures in */
+struct camera_mode {
+	uint32_t format;	/* V4L2 fourcc */
+	uint32_t width;
+	uint32_t height;
+	/* frames per second as a fraction, 0/0 if the driver doesn't say */
+	uint32_t fps_num;
+	uint32_t fps_den;
+};
+
+struct camera_device {
+	char path[32];
+	char card[32];
+	uint32_t caps;
+	bool capture;
+
+	/* V4L2 fourccs, as returned by VIDIOC_ENUM_FMT */
+	int n_formats;
+	uint32_t formats[CAMERA_MAX_FORMATS];
+
+	/* largest frame size over all formats */
+	uint32_t max_width;
+	uint32_t max_height;
+
+	/* from VIDIOC_ENUM_FRAMESIZES and VIDIOC_ENUM_FRAMEINTERVALS;
+	 * stepwise sizes and rates are sampled at the usual values */
+	int n_modes;
+	struct camera_mode modes[CAMERA_MAX_MODES];
+};
+
+/* ranked, best candidate first */
+struct camera_device_list {
+	int count;
+	struct camera_device devices[CAMERA_MAX_DEVICES];
+};
+
+struct camera_discovery;
+
+/*
+ * Start probing the /dev/video* nodes in the background, one thread per
+ * node. A node that doesn't answer within @timeout_ms is left out. The
+ * result is cached in XDG_RUNTIME_DIR and reused for as long as the set
+ * of device nodes stays the same, in which case nothing gets probed.
+ */
+struct camera_discovery *
+camera_discovery_start(int timeout_ms);
+
+/*
+ * Wait for the probing started with camera_discovery_start() and free
+ * @discovery. Returns the number of devices stored in @list.
+ */
+int
+camera_discovery_finish(struct camera_discovery *discovery,
+			struct camera_device_list *list);
+
+/* returns the best capture device in @list, or NULL */
+const struct camera_device *
+camera_device_list_first_capture(const struct camera_device_list *list);
+
+/*
+ * Pick the mode of @format (0 for any) to show at @width x @height and
+ * @fps: the smallest one covering that size at that rate at least, so
+ * that the compositor only ever scales down and no more pixels than
+ * needed go over the bus, then the slowest such rate. Failing that the
+ * fastest rate, then the largest size. Returns false if there's no mode
+ * to pick from.
+ */
+bool
+camera_device_pick_mode(const struct camera_device *device, uint32_t format,
+			int width, int height, int fps, struct camera_mode *mode);
+
+/* synchronously probe a single node, for devices that weren't discovered */
+bool
+camera_device_probe(const char *path, struct camera_device *device);
+
+#endif
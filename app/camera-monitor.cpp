@@ -0,0 +1,90 @@
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <cctype>
+
+#include "camera-monitor.h"
+
+struct camera_monitor {
+	int fd;
+	camera_monitor_func_t func;
+	void *data;
+};
+
+struct camera_monitor *
+camera_monitor_create(camera_monitor_func_t func, void *data)
+{
+	struct camera_monitor *monitor;
+
+	monitor = static_cast<struct camera_monitor *>(calloc(1, sizeof(*monitor)));
+	if (!monitor)
+		return NULL;
+
+	monitor->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (monitor->fd < 0) {
+		fprintf(stderr, "inotify_init1() failed: %s\n", strerror(errno));
+		free(monitor);
+		return NULL;
+	}
+
+	if (inotify_add_watch(monitor->fd, "/dev",
+			      IN_CREATE | IN_DELETE | IN_ATTRIB) < 0) {
+		fprintf(stderr, "Couldn't watch /dev: %s\n", strerror(errno));
+		close(monitor->fd);
+		free(monitor);
+		return NULL;
+	}
+
+	monitor->func = func;
+	monitor->data = data;
+
+	return monitor;
+}
+
+int
+camera_monitor_get_fd(struct camera_monitor *monitor)
+{
+	return monitor->fd;
+}
+
+void
+camera_monitor_dispatch(struct camera_monitor *monitor)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	char path[PATH_MAX];
+	ssize_t len;
+	char *p;
+
+	while (true) {
+		len = read(monitor->fd, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+
+		for (p = buf; p < buf + len; p += sizeof(*event) + event->len) {
+			event = reinterpret_cast<const struct inotify_event *>(p);
+
+			if (event->len == 0 ||
+			    strncmp(event->name, "video", 5) != 0 ||
+			    !isdigit(event->name[5]))
+				continue;
+
+			snprintf(path, sizeof(path), "/dev/%s", event->name);
+			monitor->func(path, !(event->mask & IN_DELETE),
+				      monitor->data);
+		}
+	}
+}
+
+void
+camera_monitor_destroy(struct camera_monitor *monitor)
+{
+	close(monitor->fd);
+	free(monitor);
+}
@@ -0,0 +1,26 @@
+#ifndef __CAMERA_MONITOR_H
+#define __CAMERA_MONITOR_H
+
+/*
+ * Watches /dev with inotify for video nodes coming and going. @added is
+ * also reported when a node changes attributes, as udev fixes up the
+ * permissions only after creating it.
+ */
+typedef void (*camera_monitor_func_t)(const char *path, bool added, void *data);
+
+struct camera_monitor;
+
+struct camera_monitor *
+camera_monitor_create(camera_monitor_func_t func, void *data);
+
+/* becomes readable when there are events to dispatch */
+int
+camera_monitor_get_fd(struct camera_monitor *monitor);
+
+void
+camera_monitor_dispatch(struct camera_monitor *monitor);
+
+void
+camera_monitor_destroy(struct camera_monitor *monitor);
+
+#endif
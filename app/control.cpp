@@ -0,0 +1,266 @@
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <wayland-util.h>
+
+#include "control.h"
+
+/* a client that doesn't read its replies gets dropped past this */
+#define CONTROL_MAX_OUTPUT	(1024 * 1024)
+
+struct control {
+	struct event_loop *loop;
+	char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+	int fd;
+	struct event_source *source;
+
+	control_command_func_t command;
+	control_hangup_func_t hangup;
+	void *data;
+
+	struct wl_list clients;
+};
+
+struct control_client {
+	struct control *control;
+	int fd;
+	struct event_source *source;
+	struct wl_list link;
+
+	char in[CONTROL_MAX_LINE];
+	size_t in_len;
+	std::string out;
+	bool writable_armed;
+};
+
+static void
+client_destroy(struct control_client *client)
+{
+	struct control *control = client->control;
+
+	control->hangup(client, control->data);
+
+	event_source_remove(client->source);
+	close(client->fd);
+	wl_list_remove(&client->link);
+	delete client;
+}
+
+static void
+client_flush(struct control_client *client)
+{
+	ssize_t sent;
+
+	while (!client->out.empty()) {
+		sent = send(client->fd, client->out.data(), client->out.size(),
+			    MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			break;
+		client->out.erase(0, sent);
+	}
+
+	// whatever went wrong shows up as a hangup on the next dispatch
+	if (client->out.empty() == !client->writable_armed)
+		return;
+
+	client->writable_armed = !client->out.empty();
+	event_source_fd_update(client->source, EVENT_READABLE |
+			       (client->writable_armed ? EVENT_WRITABLE : 0));
+}
+
+static void
+client_handle_line(struct control_client *client, char *line)
+{
+	struct control *control = client->control;
+	char *argv[CONTROL_MAX_ARGS];
+	char *saveptr = NULL;
+	char *arg;
+	int argc = 0;
+
+	for (arg = strtok_r(line, " \t\r", &saveptr); arg;
+	     arg = strtok_r(NULL, " \t\r", &saveptr)) {
+		if (argc == CONTROL_MAX_ARGS) {
+			control_reply(client, "error too many arguments");
+			return;
+		}
+		argv[argc++] = arg;
+	}
+
+	if (argc)
+		control->command(client, argc, argv, control->data);
+}
+
+static void
+client_handle_data(int fd, uint32_t mask, void *data)
+{
+	struct control_client *client = static_cast<struct control_client *>(data);
+	char *newline;
+	ssize_t len;
+
+	if (mask & EVENT_WRITABLE)
+		client_flush(client);
+
+	if (mask & (EVENT_HANGUP | EVENT_ERROR) && !(mask & EVENT_READABLE)) {
+		client_destroy(client);
+		return;
+	}
+
+	if (!(mask & EVENT_READABLE))
+		return;
+
+	len = read(fd, client->in + client->in_len,
+		   sizeof(client->in) - client->in_len);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len <= 0) {
+		client_destroy(client);
+		return;
+	}
+	client->in_len += len;
+
+	while ((newline = static_cast<char *>(memchr(client->in, '\n',
+						      client->in_len)))) {
+		size_t line_len = newline - client->in + 1;
+
+		*newline = '\0';
+		client_handle_line(client, client->in);
+		memmove(client->in, client->in + line_len, client->in_len - line_len);
+		client->in_len -= line_len;
+	}
+
+	if (client->in_len == sizeof(client->in)) {
+		control_reply(client, "error line too long");
+		client->in_len = 0;
+	}
+}
+
+static void
+control_handle_connection(int fd, uint32_t mask, void *data)
+{
+	struct control *control = static_cast<struct control *>(data);
+	struct control_client *client;
+	int client_fd;
+
+	client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client_fd < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			fprintf(stderr, "Control socket accept failed: %s\n",
+				strerror(errno));
+		return;
+	}
+
+	client = new control_client();
+	client->control = control;
+	client->fd = client_fd;
+	client->source = event_loop_add_fd(control->loop, client_fd,
+					   EVENT_READABLE, client_handle_data,
+					   client);
+	if (!client->source) {
+		close(client_fd);
+		delete client;
+		return;
+	}
+
+	wl_list_insert(&control->clients, &client->link);
+}
+
+struct control *
+control_create(struct event_loop *loop, const char *path,
+	       control_command_func_t command, control_hangup_func_t hangup,
+	       void *data)
+{
+	struct control *control;
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Control socket path %s is too long\n", path);
+		return NULL;
+	}
+
+	control = new struct control();
+	control->loop = loop;
+	control->command = command;
+	control->hangup = hangup;
+	control->data = data;
+	wl_list_init(&control->clients);
+	snprintf(control->path, sizeof(control->path), "%s", path);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+	control->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (control->fd < 0)
+		goto err;
+
+	// left behind by an instance that didn't get to clean up
+	unlink(path);
+	if (bind(control->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    listen(control->fd, 4) < 0)
+		goto err_close;
+
+	control->source = event_loop_add_fd(loop, control->fd, EVENT_READABLE,
+					    control_handle_connection, control);
+	if (!control->source)
+		goto err_unlink;
+
+	return control;
+
+err_unlink:
+	unlink(path);
+err_close:
+	close(control->fd);
+err:
+	fprintf(stderr, "Couldn't create the control socket %s: %s\n", path,
+		strerror(errno));
+	delete control;
+	return NULL;
+}
+
+void
+control_destroy(struct control *control)
+{
+	struct control_client *client, *next;
+
+	wl_list_for_each_safe(client, next, &control->clients, link)
+		client_destroy(client);
+
+	event_source_remove(control->source);
+	close(control->fd);
+	unlink(control->path);
+	delete control;
+}
+
+void
+control_reply(struct control_client *client, const char *fmt, ...)
+{
+	va_list args;
+	gchar *line;
+
+	va_start(args, fmt);
+	line = g_strdup_vprintf(fmt, args);
+	va_end(args);
+
+	if (client->out.size() < CONTROL_MAX_OUTPUT) {
+		client->out += line;
+		client->out += '\n';
+	} else {
+		// the hangup comes with the next dispatch
+		shutdown(client->fd, SHUT_RDWR);
+	}
+	g_free(line);
+
+	client_flush(client);
+}
@@ -0,0 +1,40 @@
+#ifndef __CONTROL_H
+#define __CONTROL_H
+
+#include "event-loop.h"
+
+/*
+ * A Unix stream socket taking one command per line, e.g. through
+ * `socat - UNIX-CONNECT:$XDG_RUNTIME_DIR/camera-gstreamer.sock`. Each
+ * command gets a one line reply, which doesn't have to be right away: the
+ * handler may hold on to the client and reply once the command is done.
+ */
+struct control;
+struct control_client;
+
+/* @argv is the command line split on blanks, @argv[0] is the command */
+typedef void (*control_command_func_t)(struct control_client *client,
+				       int argc, char **argv, void *data);
+
+/* the client is gone, a reply still owed to it has to be dropped */
+typedef void (*control_hangup_func_t)(struct control_client *client,
+				      void *data);
+
+#define CONTROL_MAX_LINE	256
+#define CONTROL_MAX_ARGS	8
+
+/* replaces whatever is at @path, which is removed again on destroy */
+struct control *
+control_create(struct event_loop *loop, const char *path,
+	       control_command_func_t command, control_hangup_func_t hangup,
+	       void *data);
+
+void
+control_destroy(struct control *control);
+
+/* sends a line, the newline is added */
+void
+control_reply(struct control_client *client, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+#endif
@@ -0,0 +1,308 @@
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+#include <signal.h>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+
+#include <wayland-util.h>
+
+#include "event-loop.h"
+
+#define EVENT_LOOP_MAX_EVENTS	16
+
+enum event_source_type {
+	EVENT_SOURCE_FD,
+	EVENT_SOURCE_TIMER,
+	EVENT_SOURCE_SIGNAL,
+};
+
+struct event_source {
+	struct event_loop *loop;
+	enum event_source_type type;
+	int fd;
+	void *data;
+
+	union {
+		event_loop_fd_func_t fd_func;
+		event_loop_timer_func_t timer_func;
+		event_loop_signal_func_t signal_func;
+	};
+
+	int signal_number;
+
+	/* event_loop::source_list, or destroy_list once removed */
+	struct wl_list link;
+};
+
+struct event_loop {
+	int epoll_fd;
+
+	/* the sources in use, removed along with the loop */
+	struct wl_list source_list;
+	/* sources removed while dispatching, freed afterwards */
+	struct wl_list destroy_list;
+};
+
+static uint32_t
+event_mask_to_epoll(uint32_t mask)
+{
+	uint32_t events = 0;
+
+	if (mask & EVENT_READABLE)
+		events |= EPOLLIN;
+	if (mask & EVENT_WRITABLE)
+		events |= EPOLLOUT;
+
+	return events;
+}
+
+static uint32_t
+epoll_to_event_mask(uint32_t events)
+{
+	uint32_t mask = 0;
+
+	if (events & EPOLLIN)
+		mask |= EVENT_READABLE;
+	if (events & EPOLLOUT)
+		mask |= EVENT_WRITABLE;
+	if (events & EPOLLHUP)
+		mask |= EVENT_HANGUP;
+	if (events & EPOLLERR)
+		mask |= EVENT_ERROR;
+
+	return mask;
+}
+
+struct event_loop *
+event_loop_create(void)
+{
+	struct event_loop *loop;
+
+	loop = static_cast<struct event_loop *>(calloc(1, sizeof(*loop)));
+	if (!loop)
+		return NULL;
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		fprintf(stderr, "epoll_create1() failed: %s\n", strerror(errno));
+		free(loop);
+		return NULL;
+	}
+
+	wl_list_init(&loop->source_list);
+	wl_list_init(&loop->destroy_list);
+
+	return loop;
+}
+
+static void
+event_loop_process_destroy_list(struct event_loop *loop)
+{
+	struct event_source *source, *next;
+
+	wl_list_for_each_safe(source, next, &loop->destroy_list, link) {
+		wl_list_remove(&source->link);
+		free(source);
+	}
+}
+
+void
+event_loop_destroy(struct event_loop *loop)
+{
+	struct event_source *source, *next;
+
+	wl_list_for_each_safe(source, next, &loop->source_list, link)
+		event_source_remove(source);
+
+	event_loop_process_destroy_list(loop);
+	close(loop->epoll_fd);
+	free(loop);
+}
+
+static struct event_source *
+event_loop_add_source(struct event_loop *loop, enum event_source_type type,
+		      int fd, uint32_t mask, void *data)
+{
+	struct event_source *source;
+	struct epoll_event ep;
+
+	source = static_cast<struct event_source *>(calloc(1, sizeof(*source)));
+	if (!source)
+		return NULL;
+
+	source->loop = loop;
+	source->type = type;
+	source->fd = fd;
+	source->data = data;
+
+	memset(&ep, 0, sizeof(ep));
+	ep.events = event_mask_to_epoll(mask);
+	ep.data.ptr = source;
+
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ep) < 0) {
+		fprintf(stderr, "epoll_ctl() failed: %s\n", strerror(errno));
+		free(source);
+		return NULL;
+	}
+
+	wl_list_insert(&loop->source_list, &source->link);
+	return source;
+}
+
+struct event_source *
+event_loop_add_fd(struct event_loop *loop, int fd, uint32_t mask,
+		  event_loop_fd_func_t func, void *data)
+{
+	struct event_source *source;
+
+	source = event_loop_add_source(loop, EVENT_SOURCE_FD, fd, mask, data);
+	if (source)
+		source->fd_func = func;
+
+	return source;
+}
+
+int
+event_source_fd_update(struct event_source *source, uint32_t mask)
+{
+	struct epoll_event ep;
+
+	memset(&ep, 0, sizeof(ep));
+	ep.events = event_mask_to_epoll(mask);
+	ep.data.ptr = source;
+
+	return epoll_ctl(source->loop->epoll_fd, EPOLL_CTL_MOD, source->fd, &ep);
+}
+
+struct event_source *
+event_loop_add_timer(struct event_loop *loop,
+		     event_loop_timer_func_t func, void *data)
+{
+	struct event_source *source;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	source = event_loop_add_source(loop, EVENT_SOURCE_TIMER, fd,
+				       EVENT_READABLE, data);
+	if (!source) {
+		close(fd);
+		return NULL;
+	}
+
+	source->timer_func = func;
+	return source;
+}
+
+int
+event_source_timer_update(struct event_source *source, int ms_delay)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms_delay / 1000;
+	its.it_value.tv_nsec = (ms_delay % 1000) * 1000 * 1000;
+
+	return timerfd_settime(source->fd, 0, &its, NULL);
+}
+
+struct event_source *
+event_loop_add_signal(struct event_loop *loop, int signal_number,
+		      event_loop_signal_func_t func, void *data)
+{
+	struct event_source *source;
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, signal_number);
+
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	source = event_loop_add_source(loop, EVENT_SOURCE_SIGNAL, fd,
+				       EVENT_READABLE, data);
+	if (!source) {
+		close(fd);
+		return NULL;
+	}
+
+	source->signal_func = func;
+	source->signal_number = signal_number;
+	return source;
+}
+
+void
+event_source_remove(struct event_source *source)
+{
+	struct event_loop *loop = source->loop;
+
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+
+	if (source->type != EVENT_SOURCE_FD)
+		close(source->fd);
+
+	// there might be a pending event for it in the current batch
+	source->fd = -1;
+	wl_list_remove(&source->link);
+	wl_list_insert(&loop->destroy_list, &source->link);
+}
+
+static void
+event_source_dispatch(struct event_source *source, uint32_t events)
+{
+	switch (source->type) {
+	case EVENT_SOURCE_FD:
+		source->fd_func(source->fd, epoll_to_event_mask(events),
+				source->data);
+		break;
+	case EVENT_SOURCE_TIMER: {
+		uint64_t expires;
+
+		if (read(source->fd, &expires, sizeof(expires)) != sizeof(expires))
+			break;
+
+		source->timer_func(source->data);
+		break;
+	}
+	case EVENT_SOURCE_SIGNAL: {
+		struct signalfd_siginfo info;
+
+		if (read(source->fd, &info, sizeof(info)) != sizeof(info))
+			break;
+
+		source->signal_func(source->signal_number, source->data);
+		break;
+	}
+	}
+}
+
+int
+event_loop_dispatch(struct event_loop *loop, int timeout)
+{
+	struct epoll_event ep[EVENT_LOOP_MAX_EVENTS];
+	int count, i;
+
+	count = epoll_wait(loop->epoll_fd, ep, EVENT_LOOP_MAX_EVENTS, timeout);
+	if (count < 0)
+		return errno == EINTR ? 0 : -1;
+
+	for (i = 0; i < count; i++) {
+		struct event_source *source =
+			static_cast<struct event_source *>(ep[i].data.ptr);
+
+		if (source->fd != -1)
+			event_source_dispatch(source, ep[i].events);
+	}
+
+	event_loop_process_destroy_list(loop);
+
+	return 0;
+}
@@ -0,0 +1,69 @@
+#ifndef __EVENT_LOOP_H
+#define __EVENT_LOOP_H
+
+#include <cstdint>
+
+/*
+ * A small epoll based loop, modelled after wl_event_loop: file
+ * descriptors, timers (timerfd) and signals (signalfd) all end up as
+ * event sources. Sources may be removed from within callbacks.
+ */
+
+/* @mask is a combination of EVENT_READABLE / EVENT_WRITABLE / ... */
+typedef void (*event_loop_fd_func_t)(int fd, uint32_t mask, void *data);
+typedef void (*event_loop_timer_func_t)(void *data);
+typedef void (*event_loop_signal_func_t)(int signal_number, void *data);
+
+#define EVENT_READABLE	0x01
+#define EVENT_WRITABLE	0x02
+#define EVENT_HANGUP	0x04
+#define EVENT_ERROR	0x08
+
+struct event_loop;
+struct event_source;
+
+struct event_loop *
+event_loop_create(void);
+
+/* removes the sources still added, their fds are closed as with
+ * event_source_remove() */
+void
+event_loop_destroy(struct event_loop *loop);
+
+/* the fd isn't owned by the source, the caller closes it */
+struct event_source *
+event_loop_add_fd(struct event_loop *loop, int fd, uint32_t mask,
+		  event_loop_fd_func_t func, void *data);
+
+/* change what an fd source waits for */
+int
+event_source_fd_update(struct event_source *source, uint32_t mask);
+
+/* disarmed until event_source_timer_update() is called */
+struct event_source *
+event_loop_add_timer(struct event_loop *loop,
+		     event_loop_timer_func_t func, void *data);
+
+/* fires once after @ms_delay milliseconds, 0 disarms the timer */
+int
+event_source_timer_update(struct event_source *source, int ms_delay);
+
+/*
+ * The signal has to be blocked in every thread, so block it with
+ * sigprocmask() before any thread gets created.
+ */
+struct event_source *
+event_loop_add_signal(struct event_loop *loop, int signal_number,
+		      event_loop_signal_func_t func, void *data);
+
+void
+event_source_remove(struct event_source *source);
+
+/*
+ * Wait up to @timeout ms (-1 waits forever) for events and dispatch
+ * them. Returns 0, or -1 on error.
+ */
+int
+event_loop_dispatch(struct event_loop *loop, int timeout);
+
+#endif
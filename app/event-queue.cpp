@@ -0,0 +1,180 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <atomic>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "event-queue.h"
+
+/*
+ * Each slot carries a sequence number telling whose turn it is: a
+ * producer claims position pos when the slot's sequence is pos, and
+ * publishes the event by setting it to pos + 1; the consumer hands the
+ * slot back for the next lap with pos + size.
+ */
+struct event_queue_slot {
+	std::atomic<uint64_t> sequence;
+	struct queued_event event;
+};
+
+struct event_queue {
+	struct event_loop *loop;
+	struct event_source *source;
+	int fd;
+
+	event_queue_func_t func;
+	void *data;
+
+	struct event_queue_slot *slots;
+	uint64_t mask;
+
+	/* producers and the consumer on cache lines of their own */
+	alignas(64) std::atomic<uint64_t> enqueue_pos;
+	std::atomic<uint64_t> dropped;
+	/* the eventfd has been written to since the last drain */
+	std::atomic<bool> wake_pending;
+
+	alignas(64) uint64_t dequeue_pos;
+};
+
+static bool
+event_queue_pop(struct event_queue *queue, struct queued_event *event)
+{
+	struct event_queue_slot *slot = &queue->slots[queue->dequeue_pos & queue->mask];
+
+	// not published yet, or the producer is still copying it in
+	if (slot->sequence.load(std::memory_order_acquire) != queue->dequeue_pos + 1)
+		return false;
+
+	*event = slot->event;
+	slot->sequence.store(queue->dequeue_pos + queue->mask + 1,
+			     std::memory_order_release);
+	queue->dequeue_pos++;
+
+	return true;
+}
+
+static void
+event_queue_handle_data(int fd, uint32_t mask, void *data)
+{
+	struct event_queue *queue = static_cast<struct event_queue *>(data);
+	struct queued_event event;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "Couldn't read the event queue fd: %s\n",
+			strerror(errno));
+
+	// before draining, anything pushed from now on wakes us up again
+	queue->wake_pending.store(false);
+
+	while (event_queue_pop(queue, &event))
+		queue->func(&event, queue->data);
+}
+
+struct event_queue *
+event_queue_create(struct event_loop *loop, unsigned int size,
+		   event_queue_func_t func, void *data)
+{
+	struct event_queue *queue;
+	uint64_t slots = 1;
+	uint64_t i;
+
+	while (slots < size)
+		slots <<= 1;
+
+	queue = new event_queue();
+	queue->loop = loop;
+	queue->func = func;
+	queue->data = data;
+	queue->mask = slots - 1;
+	queue->slots = new event_queue_slot[slots];
+	for (i = 0; i < slots; i++)
+		queue->slots[i].sequence.store(i, std::memory_order_relaxed);
+
+	queue->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (queue->fd < 0) {
+		fprintf(stderr, "Couldn't create the event queue eventfd: %s\n",
+			strerror(errno));
+		goto err;
+	}
+
+	queue->source = event_loop_add_fd(loop, queue->fd, EVENT_READABLE,
+					  event_queue_handle_data, queue);
+	if (!queue->source)
+		goto err_close;
+
+	return queue;
+
+err_close:
+	close(queue->fd);
+err:
+	delete[] queue->slots;
+	delete queue;
+	return NULL;
+}
+
+void
+event_queue_destroy(struct event_queue *queue)
+{
+	event_source_remove(queue->source);
+	close(queue->fd);
+	delete[] queue->slots;
+	delete queue;
+}
+
+bool
+event_queue_push(struct event_queue *queue, const struct queued_event *event)
+{
+	uint64_t pos = queue->enqueue_pos.load(std::memory_order_relaxed);
+	struct event_queue_slot *slot;
+	uint64_t wake = 1;
+
+	while (true) {
+		int64_t diff;
+
+		slot = &queue->slots[pos & queue->mask];
+		diff = (int64_t) slot->sequence.load(std::memory_order_acquire) -
+		       (int64_t) pos;
+
+		if (diff == 0) {
+			if (queue->enqueue_pos.compare_exchange_weak(pos, pos + 1,
+								     std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			// a lap ahead of the consumer
+			queue->dropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		} else {
+			pos = queue->enqueue_pos.load(std::memory_order_relaxed);
+		}
+	}
+
+	slot->event = *event;
+	slot->sequence.store(pos + 1, std::memory_order_release);
+
+	// one write per drain is enough
+	if (!queue->wake_pending.exchange(true) &&
+	    write(queue->fd, &wake, sizeof(wake)) < 0)
+		fprintf(stderr, "Couldn't wake up the event loop: %s\n",
+			strerror(errno));
+
+	return true;
+}
+
+void
+queued_event_set_name(struct queued_event *event, const char *name, size_t len)
+{
+	len = len < sizeof(event->name) - 1 ? len : sizeof(event->name) - 1;
+	memcpy(event->name, name, len);
+	event->name[len] = '\0';
+}
+
+uint64_t
+event_queue_get_dropped(struct event_queue *queue)
+{
+	return queue->dropped.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,59 @@
+#ifndef __EVENT_QUEUE_H
+#define __EVENT_QUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "event-loop.h"
+
+/*
+ * Hands events from any thread over to the one running the event loop:
+ * a bounded lock-free multi-producer, single-consumer ring of fixed size
+ * records, allocated up front, with an eventfd waking the loop. Pushing
+ * takes no lock and allocates nothing.
+ */
+
+#define EVENT_QUEUE_NAME_MAX	64
+
+enum queued_event_type {
+	/* an app changed state, @name is its app_id and @value the
+	 * APP_STATE_* */
+	QUEUED_EVENT_APP_STATE,
+};
+
+struct queued_event {
+	enum queued_event_type type;
+	int32_t value;
+	/* truncated to fit, always NUL terminated */
+	char name[EVENT_QUEUE_NAME_MAX];
+};
+
+struct event_queue;
+
+/* runs on the event loop thread, once per event and in order */
+typedef void (*event_queue_func_t)(const struct queued_event *event, void *data);
+
+/* @size is rounded up to a power of two */
+struct event_queue *
+event_queue_create(struct event_loop *loop, unsigned int size,
+		   event_queue_func_t func, void *data);
+
+/* the producers have to be done with it */
+void
+event_queue_destroy(struct event_queue *queue);
+
+/*
+ * Copies @event in, from any thread. Returns false, and counts it as
+ * dropped, if the queue is full.
+ */
+bool
+event_queue_push(struct event_queue *queue, const struct queued_event *event);
+
+/* fills in the name of @event from @name, truncating it */
+void
+queued_event_set_name(struct queued_event *event, const char *name, size_t len);
+
+uint64_t
+event_queue_get_dropped(struct event_queue *queue);
+
+#endif
@@ -0,0 +1,146 @@
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <mutex>
+
+#include "frame-stats.h"
+
+struct frame_stats {
+	std::mutex mutex;
+
+	uint64_t frames;
+	uint64_t dropped;
+	int64_t last_sequence;
+	gint64 first_frame_at;
+	gint64 last_frame_at;
+
+	/* ring of the last latencies */
+	gint64 samples[FRAME_STATS_SAMPLES];
+	unsigned int n_samples;
+	unsigned int next_sample;
+};
+
+struct frame_stats *
+frame_stats_create(void)
+{
+	struct frame_stats *stats = new frame_stats();
+
+	frame_stats_reset(stats);
+	return stats;
+}
+
+void
+frame_stats_destroy(struct frame_stats *stats)
+{
+	delete stats;
+}
+
+void
+frame_stats_reset(struct frame_stats *stats)
+{
+	std::lock_guard<std::mutex> lock(stats->mutex);
+
+	stats->frames = 0;
+	stats->dropped = 0;
+	stats->last_sequence = -1;
+	stats->first_frame_at = 0;
+	stats->last_frame_at = 0;
+	stats->n_samples = 0;
+	stats->next_sample = 0;
+}
+
+void
+frame_stats_add(struct frame_stats *stats, int64_t sequence, gint64 latency_us)
+{
+	gint64 now = g_get_monotonic_time();
+	std::lock_guard<std::mutex> lock(stats->mutex);
+
+	if (stats->frames == 0)
+		stats->first_frame_at = now;
+	stats->last_frame_at = now;
+	stats->frames++;
+
+	if (sequence >= 0) {
+		if (stats->last_sequence >= 0 && sequence > stats->last_sequence + 1)
+			stats->dropped += sequence - stats->last_sequence - 1;
+		stats->last_sequence = sequence;
+	}
+
+	if (latency_us < 0)
+		return;
+
+	stats->samples[stats->next_sample] = latency_us;
+	stats->next_sample = (stats->next_sample + 1) % FRAME_STATS_SAMPLES;
+	if (stats->n_samples < FRAME_STATS_SAMPLES)
+		stats->n_samples++;
+}
+
+static gint64
+percentile(const gint64 *sorted, unsigned int count, int pct)
+{
+	unsigned int index;
+
+	if (count == 0)
+		return 0;
+
+	index = (count * pct + 99) / 100;
+	return sorted[index > 0 ? index - 1 : 0];
+}
+
+void
+frame_stats_get_summary(struct frame_stats *stats,
+			struct frame_stats_summary *summary)
+{
+	gint64 sorted[FRAME_STATS_SAMPLES];
+	unsigned int count;
+	gint64 span;
+
+	{
+		std::lock_guard<std::mutex> lock(stats->mutex);
+
+		summary->frames = stats->frames;
+		summary->dropped = stats->dropped;
+		span = stats->last_frame_at - stats->first_frame_at;
+		summary->fps = span > 0 ? (stats->frames - 1) * 1e6 / span : 0;
+
+		count = stats->n_samples;
+		memcpy(sorted, stats->samples, count * sizeof(sorted[0]));
+	}
+
+	std::sort(sorted, sorted + count);
+
+	summary->latency_p50 = percentile(sorted, count, 50);
+	summary->latency_p95 = percentile(sorted, count, 95);
+	summary->latency_p99 = percentile(sorted, count, 99);
+	summary->latency_max = count ? sorted[count - 1] : 0;
+}
+
+void
+frame_stats_print(struct frame_stats *stats, FILE *out)
+{
+	struct frame_stats_summary s;
+
+	frame_stats_get_summary(stats, &s);
+
+	fprintf(out, "frames %llu, dropped %llu, %.1f fps, latency p50 %.1f ms "
+		"p95 %.1f ms p99 %.1f ms max %.1f ms\n",
+		(unsigned long long) s.frames, (unsigned long long) s.dropped,
+		s.fps, s.latency_p50 / 1000.0, s.latency_p95 / 1000.0,
+		s.latency_p99 / 1000.0, s.latency_max / 1000.0);
+}
+
+void
+frame_stats_write_json(struct frame_stats *stats, FILE *out)
+{
+	struct frame_stats_summary s;
+
+	frame_stats_get_summary(stats, &s);
+
+	fprintf(out, "{\"frames\": %llu, \"dropped\": %llu, \"fps\": %.2f, "
+		"\"latency_us\": {\"p50\": %lld, \"p95\": %lld, \"p99\": %lld, "
+		"\"max\": %lld}}",
+		(unsigned long long) s.frames, (unsigned long long) s.dropped,
+		s.fps, (long long) s.latency_p50, (long long) s.latency_p95,
+		(long long) s.latency_p99, (long long) s.latency_max);
+}
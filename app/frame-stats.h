@@ -0,0 +1,57 @@
+#ifndef __FRAME_STATS_H
+#define __FRAME_STATS_H
+
+#include <cstdio>
+#include <cstdint>
+
+#include <glib.h>
+
+/* latencies kept for the percentiles, the most recent ones win */
+#define FRAME_STATS_SAMPLES	1024
+
+struct frame_stats_summary {
+	uint64_t frames;
+	/* gaps in the capture sequence numbers */
+	uint64_t dropped;
+	double fps;
+
+	/* capture to sink, us */
+	gint64 latency_p50;
+	gint64 latency_p95;
+	gint64 latency_p99;
+	gint64 latency_max;
+};
+
+struct frame_stats;
+
+struct frame_stats *
+frame_stats_create(void);
+
+void
+frame_stats_destroy(struct frame_stats *stats);
+
+/*
+ * Record a frame reaching the sink, safe to call from the streaming
+ * thread. @sequence is the capture sequence number, or -1 if unknown;
+ * @latency_us is -1 if the buffer had no timestamp.
+ */
+void
+frame_stats_add(struct frame_stats *stats, int64_t sequence, gint64 latency_us);
+
+/* forget everything, e.g. when the camera pipeline is recreated */
+void
+frame_stats_reset(struct frame_stats *stats);
+
+void
+frame_stats_get_summary(struct frame_stats *stats,
+			struct frame_stats_summary *summary);
+
+/* single line, for periodic logging */
+void
+frame_stats_print(struct frame_stats *stats, FILE *out);
+
+/* JSON object, without a trailing newline */
+void
+frame_stats_write_json(struct frame_stats *stats, FILE *out);
+
+#endif
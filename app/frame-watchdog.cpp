@@ -0,0 +1,387 @@
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+
+#include "frame-watchdog.h"
+
+/* frame interval assumed until the caps or the frames tell otherwise */
+#define DEFAULT_INTERVAL_US	(G_USEC_PER_SEC / 15)
+/* below that scheduling hiccups alone would set it off */
+#define MIN_TIMEOUT_US		(50 * 1000)
+/* words of each frame that go into its hash */
+#define HASH_SAMPLES		1024
+/* of frame_watchdog.failure taken by the enum */
+#define FAILURE_BITS		2
+
+struct frame_watchdog {
+	struct frame_watchdog_config config;
+	struct event_source *timer;
+
+	GstPad *pad;
+	gulong probe_id;
+	bool check_freeze;
+
+	/* set by the probe once a frame arrived after attach or reset */
+	std::atomic<bool> armed;
+	std::atomic<gint64> last_frame_at;
+	/* from the caps, 0 for a variable rate, and a running average of
+	 * the time between frames */
+	std::atomic<gint64> caps_interval;
+	std::atomic<gint64> frame_interval;
+
+	/* the enum frame_watchdog_failure in the low bits and when it
+	 * happened above them, in one so the two always go together; 0
+	 * until something failed or since it was checked */
+	std::atomic<gint64> failure;
+	/* frames came, and changed, since attach */
+	std::atomic<bool> delivering;
+
+	/* only touched by the probe */
+	bool has_hash;
+	uint64_t last_hash;
+	int repeats;
+	gint64 first_repeat_at;
+
+	/* main loop only */
+	unsigned int stalls;
+	unsigned int freezes;
+	gint64 detect_last;
+	gint64 detect_total;
+	gint64 detect_max;
+};
+
+static gint64
+frame_watchdog_timeout(struct frame_watchdog *watchdog, gint64 *interval)
+{
+	*interval = std::max(watchdog->caps_interval.load(),
+			     watchdog->frame_interval.load());
+	if (*interval <= 0)
+		*interval = DEFAULT_INTERVAL_US;
+
+	return std::max(*interval * watchdog->config.stall_frames,
+			(gint64) MIN_TIMEOUT_US);
+}
+
+/* safe from any thread, it's a timerfd */
+static void
+frame_watchdog_arm(struct frame_watchdog *watchdog, gint64 delay_us)
+{
+	// a zero delay would disarm the timer
+	event_source_timer_update(watchdog->timer,
+				  std::max((gint64) 1, (delay_us + 999) / 1000));
+}
+
+/*
+ * FNV-1a over words spread evenly across the first memory of @buffer,
+ * the luma plane for the formats we use. Sensor noise usually changes
+ * them from one frame to the next, so identical hashes mean the same
+ * frame was likely sent again; a dark or static scene behind temporal
+ * denoising can do the same, which is why freeze checks are opt-in.
+ * Returns false if the buffer can't be read.
+ */
+static bool
+sample_hash(GstBuffer *buffer, uint64_t *hash)
+{
+	GstMemory *memory = gst_buffer_peek_memory(buffer, 0);
+	GstMapInfo map;
+	size_t step;
+	int i;
+
+	if (!memory || !gst_memory_map(memory, &map, GST_MAP_READ))
+		return false;
+
+	step = map.size / HASH_SAMPLES;
+	if (step < sizeof(uint64_t)) {
+		gst_memory_unmap(memory, &map);
+		return false;
+	}
+
+	*hash = 0xcbf29ce484222325ULL;
+	for (i = 0; i < HASH_SAMPLES; i++) {
+		uint64_t word;
+
+		// the middle of each step, not always the start of a row
+		memcpy(&word, map.data + i * step + step / 2 - sizeof(word) / 2,
+		       sizeof(word));
+		*hash = (*hash ^ word) * 0x100000001b3ULL;
+	}
+
+	gst_memory_unmap(memory, &map);
+	return true;
+}
+
+/* the first failure stays, with its time */
+static void
+frame_watchdog_fail(struct frame_watchdog *watchdog,
+		    enum frame_watchdog_failure failure, gint64 failed_at)
+{
+	gint64 ok = 0;
+
+	watchdog->armed = false;
+	watchdog->failure.compare_exchange_strong(ok,
+		(failed_at << FAILURE_BITS) | failure);
+}
+
+static void
+frame_watchdog_handle_caps(struct frame_watchdog *watchdog, GstEvent *event)
+{
+	GstCaps *caps;
+	gint num, den;
+
+	gst_event_parse_caps(event, &caps);
+	if (gst_structure_get_fraction(gst_caps_get_structure(caps, 0),
+				       "framerate", &num, &den) &&
+	    num > 0 && den > 0)
+		watchdog->caps_interval = (gint64) den * G_USEC_PER_SEC / num;
+	else
+		watchdog->caps_interval = 0;
+}
+
+/* @now is when @buffer arrived, returns true if it was once too often */
+static bool
+frame_watchdog_check_freeze(struct frame_watchdog *watchdog, GstBuffer *buffer,
+			    gint64 now)
+{
+	uint64_t hash;
+
+	if (!sample_hash(buffer, &hash)) {
+		watchdog->has_hash = false;
+		return false;
+	}
+
+	if (!watchdog->has_hash || hash != watchdog->last_hash) {
+		if (watchdog->has_hash)
+			watchdog->delivering = true;
+		watchdog->has_hash = true;
+		watchdog->last_hash = hash;
+		watchdog->repeats = 0;
+		return false;
+	}
+
+	if (watchdog->repeats++ == 0)
+		watchdog->first_repeat_at = now;
+
+	return watchdog->repeats + 1 >= watchdog->config.freeze_frames;
+}
+
+static GstPadProbeReturn
+frame_watchdog_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct frame_watchdog *watchdog = static_cast<struct frame_watchdog *>(user_data);
+	GstElement *source;
+	gint64 now, interval;
+
+	if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+		if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) == GST_EVENT_CAPS)
+			frame_watchdog_handle_caps(watchdog,
+						   GST_PAD_PROBE_INFO_EVENT(info));
+		return GST_PAD_PROBE_OK;
+	}
+
+	// nothing more to tell until it's checked
+	if (watchdog->failure)
+		return GST_PAD_PROBE_OK;
+
+	now = g_get_monotonic_time();
+
+	if (!watchdog->armed) {
+		watchdog->has_hash = false;
+		watchdog->repeats = 0;
+		watchdog->last_frame_at = now;
+		watchdog->armed = true;
+		frame_watchdog_arm(watchdog, frame_watchdog_timeout(watchdog, &interval));
+	} else {
+		interval = now - watchdog->last_frame_at.exchange(now);
+		watchdog->frame_interval = watchdog->frame_interval ?
+			watchdog->frame_interval + (interval - watchdog->frame_interval) / 8 :
+			interval;
+	}
+
+	if (!watchdog->check_freeze) {
+		watchdog->delivering = true;
+		return GST_PAD_PROBE_OK;
+	}
+
+	if (!frame_watchdog_check_freeze(watchdog, GST_PAD_PROBE_INFO_BUFFER(info), now))
+		return GST_PAD_PROBE_OK;
+
+	frame_watchdog_fail(watchdog, FRAME_WATCHDOG_FROZEN, watchdog->first_repeat_at);
+
+	// wake up the main loop to switch away from it
+	source = GST_ELEMENT(GST_PAD_PARENT(pad));
+	gst_element_post_message(source,
+		gst_message_new_application(GST_OBJECT(source),
+			gst_structure_new_empty("camera-frozen")));
+
+	return GST_PAD_PROBE_OK;
+}
+
+/*
+ * Goes off once per timeout while frames keep coming, rather than being
+ * pushed back on every frame: a new deadline is taken from the last
+ * frame each time.
+ */
+static void
+frame_watchdog_timer(void *data)
+{
+	struct frame_watchdog *watchdog = static_cast<struct frame_watchdog *>(data);
+	gint64 now = g_get_monotonic_time();
+	gint64 last_frame_at, timeout, interval;
+
+	if (!watchdog->armed)
+		return;
+
+	last_frame_at = watchdog->last_frame_at;
+	timeout = frame_watchdog_timeout(watchdog, &interval);
+	if (now < last_frame_at + timeout) {
+		frame_watchdog_arm(watchdog, last_frame_at + timeout - now);
+		return;
+	}
+
+	// late since the next frame was due
+	frame_watchdog_fail(watchdog, FRAME_WATCHDOG_STALLED,
+			    last_frame_at + interval);
+}
+
+struct frame_watchdog *
+frame_watchdog_create(struct event_loop *loop,
+		      const struct frame_watchdog_config *config)
+{
+	struct frame_watchdog *watchdog = new struct frame_watchdog();
+
+	watchdog->config = *config;
+	watchdog->timer = event_loop_add_timer(loop, frame_watchdog_timer, watchdog);
+	if (!watchdog->timer) {
+		delete watchdog;
+		return NULL;
+	}
+
+	return watchdog;
+}
+
+void
+frame_watchdog_destroy(struct frame_watchdog *watchdog)
+{
+	frame_watchdog_detach(watchdog);
+	event_source_remove(watchdog->timer);
+	delete watchdog;
+}
+
+void
+frame_watchdog_attach(struct frame_watchdog *watchdog, GstElement *pipeline,
+		      bool check_freeze)
+{
+	GstElement *source;
+
+	frame_watchdog_detach(watchdog);
+
+	source = gst_bin_get_by_name(GST_BIN(pipeline), "source");
+	if (!source)
+		return;
+
+	watchdog->pad = gst_element_get_static_pad(source, "src");
+	gst_object_unref(source);
+	if (!watchdog->pad)
+		return;
+
+	watchdog->check_freeze = check_freeze && watchdog->config.freeze_frames > 0;
+	watchdog->caps_interval = 0;
+	watchdog->frame_interval = 0;
+	watchdog->delivering = false;
+	watchdog->probe_id =
+		gst_pad_add_probe(watchdog->pad,
+				  (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER |
+						     GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+				  frame_watchdog_probe, watchdog, NULL);
+}
+
+void
+frame_watchdog_detach(struct frame_watchdog *watchdog)
+{
+	if (watchdog->pad) {
+		gst_pad_remove_probe(watchdog->pad, watchdog->probe_id);
+		gst_object_unref(watchdog->pad);
+		watchdog->pad = NULL;
+	}
+
+	frame_watchdog_reset(watchdog);
+}
+
+void
+frame_watchdog_reset(struct frame_watchdog *watchdog)
+{
+	watchdog->armed = false;
+	watchdog->failure = 0;
+	event_source_timer_update(watchdog->timer, 0);
+}
+
+bool
+frame_watchdog_delivering(struct frame_watchdog *watchdog)
+{
+	return !watchdog->pad || watchdog->delivering;
+}
+
+enum frame_watchdog_failure
+frame_watchdog_check(struct frame_watchdog *watchdog, gint64 *failed_at)
+{
+	gint64 packed = watchdog->failure.exchange(0);
+	enum frame_watchdog_failure failure;
+	gint64 latency;
+
+	if (!packed)
+		return FRAME_WATCHDOG_OK;
+
+	failure = (enum frame_watchdog_failure)
+		(packed & ((1 << FAILURE_BITS) - 1));
+	*failed_at = packed >> FAILURE_BITS;
+	latency = g_get_monotonic_time() - *failed_at;
+
+	if (failure == FRAME_WATCHDOG_STALLED)
+		watchdog->stalls++;
+	else
+		watchdog->freezes++;
+	watchdog->detect_last = latency;
+	watchdog->detect_total += latency;
+	watchdog->detect_max = std::max(watchdog->detect_max, latency);
+
+	return failure;
+}
+
+const char *
+frame_watchdog_failure_to_str(enum frame_watchdog_failure failure)
+{
+	switch (failure) {
+	case FRAME_WATCHDOG_OK:
+		return "ok";
+	case FRAME_WATCHDOG_STALLED:
+		return "stalled";
+	case FRAME_WATCHDOG_FROZEN:
+		return "frozen";
+	}
+
+	return "unknown";
+}
+
+void
+frame_watchdog_print(struct frame_watchdog *watchdog, FILE *out)
+{
+	fprintf(out, "watchdog: %u stalls, %u freezes, detected in last %.1f ms "
+		"max %.1f ms\n", watchdog->stalls, watchdog->freezes,
+		watchdog->detect_last / 1000.0, watchdog->detect_max / 1000.0);
+}
+
+void
+frame_watchdog_write_json(struct frame_watchdog *watchdog, FILE *out)
+{
+	unsigned int detections = watchdog->stalls + watchdog->freezes;
+	gint64 interval;
+
+	fprintf(out, "{\"stalls\": %u, \"freezes\": %u, \"timeout_us\": %lld, "
+		"\"detect_last_us\": %lld, \"detect_mean_us\": %lld, "
+		"\"detect_max_us\": %lld}", watchdog->stalls, watchdog->freezes,
+		(long long) frame_watchdog_timeout(watchdog, &interval),
+		(long long) watchdog->detect_last,
+		(long long) (detections ? watchdog->detect_total / detections : 0),
+		(long long) watchdog->detect_max);
+}
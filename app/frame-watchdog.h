@@ -0,0 +1,86 @@
+#ifndef __FRAME_WATCHDOG_H
+#define __FRAME_WATCHDOG_H
+
+#include <cstdio>
+
+#include <glib.h>
+#include <gst/gst.h>
+
+#include "event-loop.h"
+
+/*
+ * Notices a camera that stops delivering frames without posting an
+ * error, a stalled driver or a loose cable, and one that keeps sending
+ * the very same frame. A probe on the source pad takes the arrival time
+ * and a hash of a few sampled bytes of each frame; a timer in the main
+ * loop goes off once no frame came for a few frame intervals.
+ */
+
+enum frame_watchdog_failure {
+	FRAME_WATCHDOG_OK,
+	/* no frame for stall_frames frame intervals */
+	FRAME_WATCHDOG_STALLED,
+	/* freeze_frames identical frames in a row */
+	FRAME_WATCHDOG_FROZEN,
+};
+
+struct frame_watchdog_config {
+	/* frame intervals without a frame before the camera is stalled */
+	int stall_frames;
+	/* identical frames in a row before it's frozen, 0 doesn't check */
+	int freeze_frames;
+};
+
+struct frame_watchdog;
+
+struct frame_watchdog *
+frame_watchdog_create(struct event_loop *loop,
+		      const struct frame_watchdog_config *config);
+
+void
+frame_watchdog_destroy(struct frame_watchdog *watchdog);
+
+/*
+ * Watches the frames leaving the "source" element of @pipeline, timing
+ * starts with the first one. Sources that repeat frames on purpose, like
+ * test patterns, are attached with @check_freeze false.
+ */
+void
+frame_watchdog_attach(struct frame_watchdog *watchdog, GstElement *pipeline,
+		      bool check_freeze);
+
+void
+frame_watchdog_detach(struct frame_watchdog *watchdog);
+
+/* stops timing until the next frame, e.g. while the camera is paused */
+void
+frame_watchdog_reset(struct frame_watchdog *watchdog);
+
+/*
+ * Whether the camera sent frames since it was attached, frames that
+ * changed if it's checked for freezes; true if it isn't attached.
+ */
+bool
+frame_watchdog_delivering(struct frame_watchdog *watchdog);
+
+/*
+ * Whether the camera failed since the last call, from the main loop.
+ * @failed_at is when: the missing frame was due, or the first repeated
+ * frame arrived. The time from there to this call is reported as the
+ * detection latency.
+ */
+enum frame_watchdog_failure
+frame_watchdog_check(struct frame_watchdog *watchdog, gint64 *failed_at);
+
+const char *
+frame_watchdog_failure_to_str(enum frame_watchdog_failure failure);
+
+/* single line, for periodic logging */
+void
+frame_watchdog_print(struct frame_watchdog *watchdog, FILE *out);
+
+/* JSON object, without a trailing newline */
+void
+frame_watchdog_write_json(struct frame_watchdog *watchdog, FILE *out);
+
+#endif
@@ -4,18 +4,43 @@
 #include <string>
 #include <iostream>
 #include <cstring>
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
+#include <climits>
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <thread>
 
 #include <signal.h>
+#include <sys/eventfd.h>
 #include <wayland-client.h>
-#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <assert.h>
 
 #include "utils.h"
+#include "pipeline.h"
+#include "still-image.h"
+#include "camera-discovery.h"
+#include "camera-monitor.h"
+#include "event-loop.h"
+#include "shm-pool.h"
+#include "video-format.h"
+#include "startup-timing.h"
+#include "frame-stats.h"
+#include "frame-watchdog.h"
+#include "mosaic.h"
+#include "snapshot.h"
+#include "record.h"
+#include "control.h"
+#include "visibility.h"
+#include "event-queue.h"
 #include "xdg-shell-client-protocol.h"
+#include "viewporter-client-protocol.h"
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
+#include "presentation-time-client-protocol.h"
 #include "AglShellGrpcClient.h"
 
 #include <gst/gst.h>
@@ -28,6 +53,15 @@
 #define gst_wl_display_handle_context_new gst_wayland_display_handle_context_new
 #endif
 
+#define APP_ID	"camera-gstreamer"
+
+/* new enough for the suspended toplevel state, if the header is */
+#ifdef XDG_TOPLEVEL_STATE_SUSPENDED_SINCE_VERSION
+#define XDG_WM_BASE_VERSION	XDG_TOPLEVEL_STATE_SUSPENDED_SINCE_VERSION
+#else
+#define XDG_WM_BASE_VERSION	1
+#endif
+
 #ifndef APP_DATA_PATH
 #define APP_DATA_PATH /usr/share/applications/data
 #endif
@@ -37,10 +71,22 @@
 #define WINDOW_WIDTH_SIZE	640
 #define WINDOW_HEIGHT_SIZE	720
 
+/* what the camera mode is picked for without CAMERA_FPS */
+#define DEFAULT_CAMERA_FPS	30
+
 #define WINDOW_WIDTH_POS_X	640
 #define WINDOW_WIDTH_POS_Y	180
 
-#define MAX_BUFFER_ALLOC	2
+#define CAMERA_RETRY_INTERVAL_US	(1000 * 1000)
+#define CAMERA_PROBE_TIMEOUT_MS		500
+#define CAMERA_RECONFIG_TIMEOUT_US	(5 * 1000 * 1000)
+/* frame intervals without a frame before the camera counts as
+ * failed, see init_watchdog() */
+#define DEFAULT_WATCHDOG_FRAMES		3
+/* a camera the watchdog keeps failing is retried less and less often,
+ * up to 2^WATCHDOG_BACKOFF_MAX retry intervals, until it ran that long */
+#define WATCHDOG_BACKOFF_MAX		5
+#define WATCHDOG_HEALTHY_US		(10 * 1000 * 1000)
 
 // C++ requires a cast and we in wayland we do the cast implictly
 #define WL_ARRAY_FOR_EACH(pos, array, type) \
@@ -58,19 +104,26 @@ struct display {
 	struct {
 		int width;
 		int height;
+		int refresh;	/* mHz */
 	} output_data;
 
 	struct xdg_wm_base *wm_base;
+	struct wp_viewporter *viewporter;
+	struct wp_presentation *presentation;
+	clockid_t presentation_clock;
 	int has_xrgb;
-};
 
-struct buffer {
-	struct wl_buffer *buffer;
-	void *shm_data;
-	int busy;
-	int width, height;
-	size_t size;    /* width * 4 * height */
-	struct wl_list buffer_link; /** window::buffer_list */
+	/* wl_display_prepare_read() was called and neither read nor
+	 * cancelled yet */
+	bool read_prepared;
+	bool read_failed;
+	/* compositor advertises zwp_linux_dmabuf_v1; waylandsink binds
+	 * its own instance, ours is only used to learn the formats */
+	bool has_dmabuf;
+	struct zwp_linux_dmabuf_v1 *dmabuf;
+
+	/* wl_shm and dmabuf formats, for picking the camera format */
+	struct compositor_formats formats;
 };
 
 struct window {
@@ -88,221 +141,380 @@ struct window {
 	bool wait_for_configure;
 
 	int fullscreen, maximized;
+	/* xdg_toplevel suspended state, the compositor hid us */
+	bool suspended;
+
+	/* CAMERA_OCCLUSION_PROBE_MS: a frame callback that didn't come back
+	 * in that time means the compositor doesn't show us */
+	struct wl_callback *frame_callback;
+	bool occluded;
+
+	/* with a viewport the background is a single black pixel
+	 * stretched by the compositor to the window size */
+	struct wp_viewport *viewport;
+	bool background_attached;
+
+	/* size the background was last drawn at */
+	int drawn_width, drawn_height;
+
+	/* number of wl_surface.commit requests, an idle window should
+	 * not add to it */
+	uint32_t commits;
+
+	/* wp_presentation feedback for our own commits, the time is on
+	 * the g_get_monotonic_time() clock */
+	gint64 first_presented_at;
+	uint32_t presented;
+	uint32_t discarded;
+
+	/* all the buffers of the window are carved out of it */
+	struct shm_pool *pool;
+};
+
 
-	struct wl_list buffer_list;
-	struct wl_callback *callback;
-	bool needs_update_buffer;
+struct bus_watch;
+
+/*
+ * One camera of the mosaic. It has a pipeline of its own, so its own
+ * streaming threads, and a queue in front of its sink: a stalled camera
+ * only freezes its own tile.
+ */
+struct mosaic_stream {
+	/* device path, or "test" */
+	const char *source;
+	struct pipeline_config config;
+
+	GstElement *pipeline;
+	struct bus_watch *bus_watch;
+	bool failed;
+	gint64 retry_at;
+
+	/* waylandsink draws into a subsurface of the window, placed at
+	 * @tile; both are protected by receiver_data.mosaic_mutex */
+	GstVideoOverlay *overlay;
+	struct mosaic_tile tile;
+
+	struct frame_stats *stats;
+	struct frame_watchdog *watchdog;
+	unsigned int watchdog_failures;
+	struct pipeline_counters last_counters;
+	gint64 requested_at;
+	std::atomic<gint64> shown_at;
+	bool shown_reported;
+
+	/* first frame after the app became visible again */
+	std::atomic<bool> resume_armed;
+	std::atomic<gint64> resumed_at;
 };
 
+/*
+ * A camera change asked for over the control socket, from the request
+ * until the camera shows a frame with it. In place means only the caps
+ * filter changed and the pipeline kept running; the sink probe then
+ * sets the atomics.
+ */
+struct camera_reconfig {
+	bool pending;
+	bool in_place;
+	/* NULL if the client hung up in the meantime */
+	struct control_client *client;
+	/* put back if the camera doesn't take the new settings */
+	struct pipeline_config previous;
+	gint64 requested_at;
+	struct event_source *timer;
+
+	std::atomic<bool> armed;
+	std::atomic<bool> caps_seen;
+	std::atomic<gint64> shown_at;
+
+	unsigned int done;
+	unsigned int failed;
+	gint64 last_us;
+	gint64 max_us;
+};
 
 struct receiver_data {
 	struct window *window;
+	struct event_loop *loop;
 
 	GstElement *pipeline;
 	GstVideoOverlay *overlay;
+	struct bus_watch *bus_watch;
+
+	struct pipeline_config config;
+	bool pipeline_failed;
+	/* pre-rolled in PAUSED, goes to PLAYING once the window is
+	 * configured */
+	bool pipeline_waits_for_window;
+
+	/* ranked V4L2 devices, config.device may point in here */
+	struct camera_device_list cameras;
+	bool camera_from_env;
+	struct camera_monitor *monitor;
+	struct event_source *monitor_source;
+
+	/* a hotplug made us look for the best camera again, in the
+	 * background, see start_camera_rediscovery() */
+	std::thread rediscovery_thread;
+	int rediscovery_fd;
+	struct event_source *rediscovery_source;
+	struct camera_device_list rediscovered;
+	bool rediscovery_again;
+
+	/* still image pipeline, kept pre-rolled in PAUSED so that
+	 * switching to it doesn't have to wait for the JPEG decoding */
+	GstElement *standby;
+	GstElement *standby_sink;
+	struct bus_watch *standby_bus_watch;
+	struct pipeline_config standby_config;
+	bool standby_failed;
+	bool on_fallback;
+
+	/* size the still image was decoded at */
+	int standby_width;
+	int standby_height;
+
+	/* window size the still image was last shown at */
+	int fallback_width;
+	int fallback_height;
+
+	/* next time we try to bring the camera back while on fallback */
+	gint64 camera_retry_at;
+	struct event_source *retry_timer;
+
+	/* monotonic timestamps (us) used to report switch latency, the
+	 * *_shown_at ones and failed_at (on errors, see bus_sync_handler())
+	 * are written from the streaming threads */
+	std::atomic<gint64> failed_at;
+	std::atomic<gint64> fallback_shown_at;
+	gint64 camera_requested_at;
+	std::atomic<gint64> camera_shown_at;
+
+	/* frames reaching the camera sink, reported every
+	 * stats_interval_s and dumped as JSON on SIGUSR1 and at exit */
+	struct frame_stats *frame_stats;
+	struct event_source *stats_timer;
+	int stats_interval_s;
+
+	/* what the last camera pipeline counted before it went away */
+	struct pipeline_counters last_counters;
+
+	/* a camera that stops delivering, or sends the same frame over
+	 * and over, without an error; NULL if CAMERA_WATCHDOG_FRAMES is 0 */
+	struct frame_watchdog_config watchdog_config;
+	struct frame_watchdog *watchdog;
+	/* in a row, see watchdog_retry_delay() */
+	unsigned int watchdog_failures;
+
+	/* CAMERA_SNAPSHOT, takes frames from the camera pipeline's tap */
+	struct snapshot *snapshot;
+	/* CAMERA_RECORD_DIR, loop recording off the same tap */
+	struct recorder *recorder;
+
+	/* DEFAULT_DEVICE_WIDTH/HEIGHT or the size control command, rather
+	 * than a camera mode picked for the output, see pick_camera_mode() */
+	bool capture_size_fixed;
+	/* frame rate the camera mode is picked for, 0 for CAMERA_FPS */
+	int camera_fps;
+
+	/* nobody sees the camera while the app is hidden, the pipelines
+	 * go to hidden_state then, see init_visibility() */
+	struct visibility *visibility;
+	GstState hidden_state;
+	bool capture_suspended;
+	/* from becoming visible again to the next camera frame */
+	gint64 visible_at;
+	std::atomic<bool> resume_armed;
+	std::atomic<gint64> resumed_at;
+	/* the shell deactivated us, see handle_app_state() */
+	bool shell_hidden;
+	int occlusion_probe_ms;
+	struct event_source *occlusion_timer;
+
+	/* events from other threads, gRPC's, see handle_queued_event() */
+	struct event_queue *events;
+
+	/* CAMERA_CONTROL_SOCKET, see handle_control_command() */
+	struct control *control;
+	struct camera_reconfig reconfig;
+
+	/* CAMERA_MOSAIC: the cameras are tiled in the window, there's no
+	 * single camera pipeline nor still image then */
+	struct mosaic_stream mosaic[MOSAIC_MAX_STREAMS];
+	int n_mosaic;
+	std::mutex mosaic_mutex;
+	/* window size the tiles were laid out for */
+	int mosaic_width;
+	int mosaic_height;
+	bool mosaic_waits_for_window;
+	/* a sink moved its subsurface, which only takes effect with the
+	 * next commit of the window */
+	std::atomic<bool> mosaic_needs_commit;
 };
 
 static int running = 1;
-static bool gst_pipeline_failed = FALSE;
-static bool fallback_gst_pipeline_tried = FALSE;
 
 static void
-redraw(void *data, struct wl_callback *callback, uint32_t time);
-
-static struct buffer *
-alloc_buffer(struct window *window, int width, int height)
+feedback_sync_output(void *data, struct wp_presentation_feedback *feedback,
+		     struct wl_output *output)
 {
-	struct buffer *buffer = static_cast<struct buffer *>(calloc(1, sizeof(*buffer)));
-
-	buffer->width = width;
-	buffer->height = height;
-	wl_list_insert(&window->buffer_list, &buffer->buffer_link);
-
-	return buffer;
+	(void) data;
+	(void) feedback;
+	(void) output;
 }
 
 static void
-destroy_buffer(struct buffer *buffer)
-{
-	if (buffer->buffer)
-		wl_buffer_destroy(buffer->buffer);
-
-	munmap(buffer->shm_data, buffer->size);
-	wl_list_remove(&buffer->buffer_link);
-	free(buffer);
-}
-
-static struct buffer *
-pick_free_buffer(struct window *window)
+feedback_presented(void *data, struct wp_presentation_feedback *feedback,
+		   uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
+		   uint32_t refresh, uint32_t seq_hi, uint32_t seq_lo,
+		   uint32_t flags)
 {
-	struct buffer *b;
-	struct buffer *buffer = NULL;
-
-	wl_list_for_each(b, &window->buffer_list, buffer_link) {
-		if (!b->busy) {
-			buffer = b;
-			break;
-		}
-	}
+	struct window *window = static_cast<struct window *>(data);
+	gint64 presented_at;
 
-	return buffer;
-}
+	// g_get_monotonic_time() is CLOCK_MONOTONIC, anything else we
+	// can only approximate with the time the event arrived
+	if (window->display->presentation_clock == CLOCK_MONOTONIC)
+		presented_at = ((((gint64) tv_sec_hi << 32) | tv_sec_lo) * G_USEC_PER_SEC) +
+			       tv_nsec / 1000;
+	else
+		presented_at = g_get_monotonic_time();
 
-static void
-prune_old_released_buffers(struct window *window)
-{
-	struct buffer *b, *b_next;
+	if (!window->first_presented_at)
+		window->first_presented_at = presented_at;
+	window->presented++;
 
-	wl_list_for_each_safe(b, b_next,
-			      &window->buffer_list, buffer_link) {
-		if (!b->busy && (b->width != window->width ||
-				 b->height != window->height))
-			destroy_buffer(b);
-	}
+	wp_presentation_feedback_destroy(feedback);
 }
 
 static void
-paint_pixels(void *image, int padding, int width, int height, uint32_t time)
+feedback_discarded(void *data, struct wp_presentation_feedback *feedback)
 {
-	memset(image, 0x00, width * height * 4);
-}
+	struct window *window = static_cast<struct window *>(data);
 
-static void
-buffer_release(void *data, struct wl_buffer *buffer)
-{
-	struct buffer *mybuf = static_cast<struct buffer *>(data);
-	mybuf->busy = 0;
+	window->discarded++;
+	wp_presentation_feedback_destroy(feedback);
 }
 
-static const struct wl_buffer_listener buffer_listener = {
-	buffer_release
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	feedback_sync_output,
+	feedback_presented,
+	feedback_discarded
 };
 
-
-static int
-create_shm_buffer(struct display *display, struct buffer *buffer,
-		  int width, int height, uint32_t format)
+static void
+window_commit(struct window *window)
 {
-	struct wl_shm_pool *pool;
-	int fd, size, stride;
-	void *data;
-
-	stride = width * 4;
-	size = stride * height;
+	struct wp_presentation *presentation = window->display->presentation;
 
-	fd = os_create_anonymous_file(size);
-	if (fd < 0) {
-		fprintf(stderr, "creating a buffer file for %d B failed: %s\n",
-				size, strerror(errno));
-		return -1;
-	}
+	// the initial commit carries no content, nothing to present
+	if (presentation && window->background_attached) {
+		struct wp_presentation_feedback *feedback =
+			wp_presentation_feedback(presentation, window->surface);
 
-	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (data == MAP_FAILED) {
-		fprintf(stderr, "mmap failed: %s\n", strerror(errno));
-		close(fd);
-		return -1;
+		wp_presentation_feedback_add_listener(feedback, &feedback_listener,
+						      window);
 	}
 
-	pool = wl_shm_create_pool(display->shm, fd, size);
-	buffer->buffer = wl_shm_pool_create_buffer(pool, 0, width,
-						   height, stride, format);
-	wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
-	wl_shm_pool_destroy(pool);
-	close(fd);
-
-	buffer->shm_data = data;
-	buffer->size = size;
-	buffer->width = width;
-	buffer->height = height;
-
-	fprintf(stdout, "Created shm buffer with width %d, height %d\n", width, height);
-
-	return 0;
+	wl_surface_commit(window->surface);
+	window->commits++;
 }
 
-static struct buffer *
-get_next_buffer(struct window *window)
+/*
+ * The background is plain black behind the video subsurface, so it only
+ * has to be drawn when the window gets its first configure or changes
+ * size. There's no frame callback, an idle window doesn't commit at all.
+ */
+static void
+redraw(struct window *window)
 {
-	struct buffer *buffer = NULL;
-	int ret = 0;
-
-	if (window->needs_update_buffer) {
-		int i;
-
-		for (i = 0; i < MAX_BUFFER_ALLOC; i++)
-			alloc_buffer(window, window->width, window->height);
-
-		window->needs_update_buffer = false;
+	struct shm_buffer *buffer;
+	int width = window->width;
+	int height = window->height;
+
+	if (window->viewport) {
+		wp_viewport_set_destination(window->viewport,
+					    window->width, window->height);
+		width = 1;
+		height = 1;
 	}
 
-	buffer = pick_free_buffer(window);
-	if (!buffer)
-		return NULL;
-
-
-	if (!buffer->buffer) {
-		ret = create_shm_buffer(window->display, buffer, window->width,
-					window->height, WL_SHM_FORMAT_XRGB8888);
-
-		if (ret < 0)
-			return NULL;
+	// with a viewport the same 1x1 buffer stays attached
+	if (!window->viewport || !window->background_attached) {
+		buffer = shm_pool_get_buffer(window->pool, width, height,
+					     WL_SHM_FORMAT_XRGB8888);
+		if (!buffer) {
+			fprintf(stderr, "Failed to create the background buffer.\n");
+			abort();
+		}
 
 		/* paint the padding */
-		memset(buffer->shm_data, 0x00, window->width * window->height * 4);
+		if (buffer->fresh)
+			memset(shm_buffer_get_data(buffer), 0x00,
+			       buffer->stride * buffer->height);
+
+		wl_surface_attach(window->surface, buffer->wl_buffer, 0, 0);
+		wl_surface_damage(window->surface, 0, 0,
+				  window->width, window->height);
+		window->background_attached = true;
 	}
 
-	return buffer;
-}
-
+	window->drawn_width = window->width;
+	window->drawn_height = window->height;
 
-static const struct wl_callback_listener frame_listener = {
-	redraw
-};
+	window_commit(window);
+}
 
 static void
-redraw(void *data, struct wl_callback *callback, uint32_t time)
+shm_format(void *data, struct wl_shm *wl_shm, uint32_t format)
 {
-	struct window *window = static_cast<struct window *>(data);
-	struct buffer *buffer;
+	struct display *d = static_cast<struct display *>(data);
 
-	prune_old_released_buffers(window);
+	if (format == WL_SHM_FORMAT_XRGB8888)
+		d->has_xrgb = true;
 
-	buffer = get_next_buffer(window);
-	if (!buffer) {
-		fprintf(stderr,
-				!callback ? "Failed to create the first buffer.\n" :
-				"Both buffers busy at redraw(). Server bug?\n");
-		abort();
-	}
+	compositor_formats_add_shm(&d->formats, format);
+}
 
-	// do the actual painting
-	paint_pixels(buffer->shm_data, 0x0, window->width, window->height, time);
+static const struct wl_shm_listener shm_listener = {
+	shm_format
+};
 
-	wl_surface_attach(window->surface, buffer->buffer, 0, 0);
-	wl_surface_damage(window->surface, 0, 0, window->width, window->height);
+static void
+presentation_clock_id(void *data, struct wp_presentation *presentation,
+		      uint32_t clk_id)
+{
+	struct display *d = static_cast<struct display *>(data);
 
-	if (callback)
-		wl_callback_destroy(callback);
+	d->presentation_clock = clk_id;
+}
 
-	window->callback = wl_surface_frame(window->surface);
-	wl_callback_add_listener(window->callback, &frame_listener, window);
-	wl_surface_commit(window->surface);
+static const struct wp_presentation_listener presentation_listener = {
+	presentation_clock_id
+};
 
-	buffer->busy = 1;
+static void
+dmabuf_format(void *data, struct zwp_linux_dmabuf_v1 *dmabuf, uint32_t format)
+{
+	// only sent by version 1 and 2, which have no modifiers
+	(void) data;
+	(void) dmabuf;
+	(void) format;
 }
 
 static void
-shm_format(void *data, struct wl_shm *wl_shm, uint32_t format)
+dmabuf_modifier(void *data, struct zwp_linux_dmabuf_v1 *dmabuf, uint32_t format,
+		uint32_t modifier_hi, uint32_t modifier_lo)
 {
 	struct display *d = static_cast<struct display *>(data);
+	uint64_t modifier = ((uint64_t) modifier_hi << 32) | modifier_lo;
 
-	if (format == WL_SHM_FORMAT_XRGB8888)
-		d->has_xrgb = true;
+	compositor_formats_add_dmabuf(&d->formats, format, modifier);
 }
 
-static const struct wl_shm_listener shm_listener = {
-	shm_format
+static const struct zwp_linux_dmabuf_v1_listener dmabuf_listener = {
+	dmabuf_format,
+	dmabuf_modifier
 };
 
 static void
@@ -341,9 +553,11 @@ display_handle_mode(void *data, struct wl_output *wl_output, uint32_t flags,
 	if (wl_output == d->wl_output && (flags & WL_OUTPUT_MODE_CURRENT)) {
 		d->output_data.width = width;
 		d->output_data.height = height;
+		d->output_data.refresh = refresh;
 
-		fprintf(stdout, "Found output with width %d and height %d\n",
-				d->output_data.width, d->output_data.height);
+		fprintf(stdout, "Found output with width %d and height %d at %d.%03d Hz\n",
+				d->output_data.width, d->output_data.height,
+				refresh / 1000, refresh % 1000);
 	}
 }
 
@@ -382,7 +596,8 @@ registry_handle_global(void *data, struct wl_registry *registry, uint32_t id,
 						    &wl_compositor_interface, 1));
 	} else if (strcmp(interface, "xdg_wm_base") == 0) {
 		d->wm_base = static_cast<struct xdg_wm_base *>(wl_registry_bind(registry,
-				id, &xdg_wm_base_interface, 1));
+				id, &xdg_wm_base_interface,
+				MIN(version, XDG_WM_BASE_VERSION)));
 		xdg_wm_base_add_listener(d->wm_base, &xdg_wm_base_listener, d);
 	} else if (strcmp(interface, "wl_shm") == 0) {
 		d->shm = static_cast<struct wl_shm *>(wl_registry_bind(registry,
@@ -392,6 +607,21 @@ registry_handle_global(void *data, struct wl_registry *registry, uint32_t id,
 		d->wl_output = static_cast<struct wl_output *>(wl_registry_bind(registry, id,
 					     &wl_output_interface, 1));
 		wl_output_add_listener(d->wl_output, &output_listener, d);
+	} else if (strcmp(interface, "zwp_linux_dmabuf_v1") == 0) {
+		d->has_dmabuf = true;
+		// version 4 replaced the modifier events with feedback objects
+		if (version >= 3) {
+			d->dmabuf = static_cast<struct zwp_linux_dmabuf_v1 *>(wl_registry_bind(registry,
+					id, &zwp_linux_dmabuf_v1_interface, 3));
+			zwp_linux_dmabuf_v1_add_listener(d->dmabuf, &dmabuf_listener, d);
+		}
+	} else if (strcmp(interface, "wp_viewporter") == 0) {
+		d->viewporter = static_cast<struct wp_viewporter *>(wl_registry_bind(registry,
+				id, &wp_viewporter_interface, 1));
+	} else if (strcmp(interface, "wp_presentation") == 0) {
+		d->presentation = static_cast<struct wp_presentation *>(wl_registry_bind(registry,
+				id, &wp_presentation_interface, 1));
+		wp_presentation_add_listener(d->presentation, &presentation_listener, d);
 	}
 }
 
@@ -409,26 +639,21 @@ static const struct wl_registry_listener registry_listener = {
 };
 
 
-static void
-error_cb(GstBus *bus, GstMessage *msg, gpointer user_data)
+/* called with mosaic_mutex held */
+static struct mosaic_stream *
+find_mosaic_stream(struct receiver_data *d, GstObject *object)
 {
-	struct receiver_data *d =
-		static_cast<struct receiver_data *>(user_data);
-
-	gchar *debug = NULL;
-	GError *err = NULL;
-
-	gst_message_parse_error(msg, &err, &debug);
+	int i;
 
-	g_print("Error: %s\n", err->message);
-	g_error_free(err);
+	for (i = 0; i < d->n_mosaic; i++) {
+		GstElement *pipeline = d->mosaic[i].pipeline;
 
-	if (debug) {
-		g_print("Debug details: %s\n", debug);
-		g_free(debug);
+		if (pipeline && (object == GST_OBJECT(pipeline) ||
+				 gst_object_has_as_ancestor(object, GST_OBJECT(pipeline))))
+			return &d->mosaic[i];
 	}
 
-	gst_element_set_state(d->pipeline, GST_STATE_NULL);
+	return NULL;
 }
 
 static GstBusSyncReply
@@ -447,6 +672,12 @@ bus_sync_handler(GstBus *bus, GstMessage *message, gpointer user_data)
 		goto drop;
 	} else if (gst_is_video_overlay_prepare_window_handle_message(message)) {
 		struct wl_surface *window_handle = d->window->surface;
+		GstVideoOverlay *overlay;
+		struct mosaic_stream *stream;
+		struct mosaic_tile rect = {
+			d->window->x, d->window->y,
+			d->window->width, d->window->height
+		};
 
 		/* GST_MESSAGE_SRC(message) will be the overlay object that we
 		 * have to use. This may be waylandsink, but it may also be
@@ -454,31 +685,45 @@ bus_sync_handler(GstBus *bus, GstMessage *message, gpointer user_data)
 		 * playbin instead of waylandsink, because playbin resets the
 		 * window handle and render_rectangle after restarting playback
 		 * and the actual window size is lost */
-		d->overlay = GST_VIDEO_OVERLAY(GST_MESSAGE_SRC(message));
+		overlay = GST_VIDEO_OVERLAY(GST_MESSAGE_SRC(message));
+
+		std::lock_guard<std::mutex> lock(d->mosaic_mutex);
+
+		// a mosaic camera only gets its tile of the window
+		stream = find_mosaic_stream(d, GST_MESSAGE_SRC(message));
+		if (stream) {
+			stream->overlay = overlay;
+			rect = stream->tile;
+			d->mosaic_needs_commit = true;
+		} else {
+			d->overlay = overlay;
+		}
 
 		g_print("setting window handle and size (%d x %d) w %d, h %d\n",
-				d->window->x, d->window->y,
-				d->window->width, d->window->height);
+				rect.x, rect.y, rect.width, rect.height);
 
-		gst_video_overlay_set_window_handle(d->overlay, (guintptr) window_handle);
-		gst_video_overlay_set_render_rectangle(d->overlay,
-						       d->window->x, d->window->y,
-						       d->window->width, d->window->height);
+		gst_video_overlay_set_window_handle(overlay, (guintptr) window_handle);
+		gst_video_overlay_set_render_rectangle(overlay, rect.x, rect.y,
+						       rect.width, rect.height);
 
 		goto drop;
 	}
 	else if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR) {
-		GError* err = NULL;
-		gchar* dbg_info = NULL;
-
-		gst_message_parse_error(message, &err, &dbg_info);
-		g_printerr("ERROR from element %s: %s code %d\n",
-			GST_OBJECT_NAME(message->src), err->message, err->code);
-		g_printerr("Debugging info: %s\n", (dbg_info) ? dbg_info : "none");
-		gst_pipeline_failed = TRUE;
-		g_error_free(err);
-		g_free(dbg_info);
-		goto drop;
+		// handled from the main loop, see handle_bus_message(), we
+		// only take the time here for the switch latency
+		if (!d->standby ||
+		    !gst_object_has_as_ancestor(GST_MESSAGE_SRC(message),
+						GST_OBJECT(d->standby)))
+			d->failed_at = g_get_monotonic_time();
+	} else if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_STATE_CHANGED &&
+		   d->standby_sink &&
+		   GST_MESSAGE_SRC(message) == GST_OBJECT(d->standby_sink)) {
+		GstState new_state;
+
+		// the pre-rolled frame is rendered as the sink reaches PLAYING
+		gst_message_parse_state_changed(message, NULL, &new_state, NULL);
+		if (new_state == GST_STATE_PLAYING)
+			d->fallback_shown_at = g_get_monotonic_time();
 	}
 
 	return GST_BUS_PASS;
@@ -495,8 +740,12 @@ handle_xdg_surface_configure(void *data, struct xdg_surface *surface, uint32_t s
 
 	xdg_surface_ack_configure(surface, serial);
 
-	if (window->wait_for_configure) {
-		redraw(window, NULL, 0);
+	if (window->wait_for_configure ||
+	    window->width != window->drawn_width ||
+	    window->height != window->drawn_height) {
+		redraw(window);
+		if (window->wait_for_configure)
+			startup_stage_end(STARTUP_WINDOW);
 		window->wait_for_configure = false;
 	}
 }
@@ -515,6 +764,7 @@ handle_xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_toplevel,
 
 	window->fullscreen = 0;
 	window->maximized = 0;
+	window->suspended = false;
 
 	// use our own macro as C++ can't typecast from (void *) directly
 	WL_ARRAY_FOR_EACH(p, states, uint32_t *) {
@@ -526,6 +776,11 @@ handle_xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_toplevel,
 		case XDG_TOPLEVEL_STATE_MAXIMIZED:
 			window->maximized = 1;
 			break;
+#ifdef XDG_TOPLEVEL_STATE_SUSPENDED_SINCE_VERSION
+		case XDG_TOPLEVEL_STATE_SUSPENDED:
+			window->suspended = true;
+			break;
+#endif
 		}
 	}
 
@@ -541,8 +796,6 @@ handle_xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_toplevel,
 		window->height = window->init_height;
 	}
 
-	window->needs_update_buffer = true;
-
 }
 
 static void
@@ -551,16 +804,33 @@ handle_xdg_toplevel_close(void *data, struct xdg_toplevel *xdg_toplevel)
 	running = 0;
 }
 
+#ifdef XDG_TOPLEVEL_STATE_SUSPENDED_SINCE_VERSION
+static void
+handle_xdg_toplevel_configure_bounds(void *data, struct xdg_toplevel *xdg_toplevel,
+				     int32_t width, int32_t height)
+{
+}
+
+static void
+handle_xdg_toplevel_wm_capabilities(void *data, struct xdg_toplevel *xdg_toplevel,
+				    struct wl_array *capabilities)
+{
+}
+#endif
+
 static const struct xdg_toplevel_listener xdg_toplevel_listener = {
 	handle_xdg_toplevel_configure,
 	handle_xdg_toplevel_close,
+#ifdef XDG_TOPLEVEL_STATE_SUSPENDED_SINCE_VERSION
+	handle_xdg_toplevel_configure_bounds,
+	handle_xdg_toplevel_wm_capabilities,
+#endif
 };
 
 static struct window *
 create_window(struct display *display, int width, int height, const char *app_id)
 {
 	struct window *window;
-	int i;
 
 	assert(display->wm_base != NULL);
 
@@ -568,8 +838,6 @@ create_window(struct display *display, int width, int height, const char *app_id
 	if (!window)
 		return NULL;
 
-	wl_list_init(&window->buffer_list);
-	window->callback = NULL;
 	window->display = display;
 	window->width = width;
 	window->height = height;
@@ -577,6 +845,22 @@ create_window(struct display *display, int width, int height, const char *app_id
 	window->init_height = height;
 	window->surface = wl_compositor_create_surface(display->wl_compositor);
 
+	if (display->viewporter)
+		window->viewport = wp_viewporter_get_viewport(display->viewporter,
+							      window->surface);
+
+	// with a viewport a single pixel is all we ever draw, otherwise
+	// make room for two window sized buffers up front
+	window->pool = shm_pool_create(display->shm,
+				       window->viewport ? 0 : 2 * width * height * 4);
+	if (!window->pool) {
+		if (window->viewport)
+			wp_viewport_destroy(window->viewport);
+		wl_surface_destroy(window->surface);
+		free(window);
+		return NULL;
+	}
+
 	if (display->wm_base) {
 		window->xdg_surface =
 			xdg_wm_base_get_xdg_surface(display->wm_base, window->surface);
@@ -592,13 +876,10 @@ create_window(struct display *display, int width, int height, const char *app_id
 
 		xdg_toplevel_set_app_id(window->xdg_toplevel, app_id);
 
-		wl_surface_commit(window->surface);
+		window_commit(window);
 		window->wait_for_configure = true;
 	}
 
-	for (i = 0; i < MAX_BUFFER_ALLOC; i++)
-		alloc_buffer(window, window->width, window->height);
-
 	return window;
 }
 
@@ -606,14 +887,10 @@ create_window(struct display *display, int width, int height, const char *app_id
 static void
 destroy_window(struct window *window)
 {
-	struct buffer *buffer, *buffer_next;
+	shm_pool_destroy(window->pool);
 
-	if (window->callback)
-		wl_callback_destroy(window->callback);
-
-	wl_list_for_each_safe(buffer, buffer_next,
-			      &window->buffer_list, buffer_link)
-		destroy_buffer(buffer);
+	if (window->frame_callback)
+		wl_callback_destroy(window->frame_callback);
 
 	if (window->xdg_toplevel)
 		xdg_toplevel_destroy(window->xdg_toplevel);
@@ -621,16 +898,237 @@ destroy_window(struct window *window)
 	if (window->xdg_surface)
 		xdg_surface_destroy(window->xdg_surface);
 
+	if (window->viewport)
+		wp_viewport_destroy(window->viewport);
+
 	wl_surface_destroy(window->surface);
 	free(window);
 }
 
 static void
-signal_int(int sig, siginfo_t *si, void *_unused)
+handle_signal(int signal_number, void *data)
 {
 	running = 0;
 }
 
+#define STATS_FILE			"camera-gstreamer-stats.json"
+#define DEFAULT_STATS_INTERVAL_S	10
+#define CONTROL_SOCKET			"camera-gstreamer.sock"
+#define SHELL_ADDRESS			"127.0.0.1:14005"
+/* the background connect gives up after that, calls still connect */
+#define SHELL_CONNECT_TIMEOUT_MS	2000
+/* app state changes come one or two at a time */
+#define EVENT_QUEUE_SIZE		64
+
+/*
+ * CAMERA_STATS_FILE, or camera-gstreamer-stats.json in XDG_RUNTIME_DIR.
+ * Returns false if there's nowhere to write to.
+ */
+static bool
+stats_file_path(char *path, size_t size)
+{
+	const char *file = getenv("CAMERA_STATS_FILE");
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+
+	if (file) {
+		snprintf(path, size, "%s", file);
+		return true;
+	}
+
+	if (!dir)
+		return false;
+
+	snprintf(path, size, "%s/%s", dir, STATS_FILE);
+	return true;
+}
+
+static void
+get_camera_counters(struct receiver_data *d, struct pipeline_counters *counters)
+{
+	if (!d->pipeline || !pipeline_get_counters(d->pipeline, counters))
+		*counters = d->last_counters;
+}
+
+/* JSON object, on one line and without a trailing newline */
+static void
+write_stats_json(struct receiver_data *d, FILE *out)
+{
+	struct window *window = d->window;
+	struct pipeline_counters counters;
+	int i;
+
+	fprintf(out, "{\"startup\": ");
+	startup_timing_write_json(out);
+	fprintf(out, ", \"window\": {\"commits\": %u, \"presented\": %u, "
+		"\"discarded\": %u", window->commits, window->presented,
+		window->discarded);
+	if (window->first_presented_at)
+		fprintf(out, ", \"first_presented_ms\": %.1f",
+			startup_timing_since_start(window->first_presented_at));
+	fprintf(out, "}, \"camera\": ");
+	frame_stats_write_json(d->frame_stats, out);
+	fprintf(out, ", \"pipeline\": ");
+	get_camera_counters(d, &counters);
+	pipeline_counters_write_json(&counters, out);
+	if (d->watchdog) {
+		fprintf(out, ", \"watchdog\": ");
+		frame_watchdog_write_json(d->watchdog, out);
+	}
+	if (d->snapshot) {
+		fprintf(out, ", \"snapshot\": ");
+		snapshot_write_json(d->snapshot, out);
+	}
+	if (d->recorder) {
+		fprintf(out, ", \"recording\": ");
+		recorder_write_json(d->recorder, out);
+	}
+	if (d->n_mosaic) {
+		fprintf(out, ", \"mosaic\": [");
+		for (i = 0; i < d->n_mosaic; i++) {
+			struct mosaic_stream *stream = &d->mosaic[i];
+
+			if (!stream->pipeline ||
+			    !pipeline_get_counters(stream->pipeline, &counters))
+				counters = stream->last_counters;
+
+			fprintf(out, "%s{\"source\": \"%s\", \"camera\": ",
+				i ? ", " : "", stream->source);
+			frame_stats_write_json(stream->stats, out);
+			fprintf(out, ", \"pipeline\": ");
+			pipeline_counters_write_json(&counters, out);
+			if (stream->watchdog) {
+				fprintf(out, ", \"watchdog\": ");
+				frame_watchdog_write_json(stream->watchdog, out);
+			}
+			fprintf(out, "}");
+		}
+		fprintf(out, "]");
+	}
+	if (d->visibility) {
+		fprintf(out, ", \"visibility\": ");
+		visibility_write_json(d->visibility, out);
+	}
+	if (d->events)
+		fprintf(out, ", \"events_dropped\": %llu",
+			(unsigned long long) event_queue_get_dropped(d->events));
+	if (d->control)
+		fprintf(out, ", \"reconfig\": {\"done\": %u, \"failed\": %u, "
+			"\"last_us\": %lld, \"max_us\": %lld}", d->reconfig.done,
+			d->reconfig.failed, (long long) d->reconfig.last_us,
+			(long long) d->reconfig.max_us);
+	fprintf(out, "}");
+}
+
+static void
+dump_stats(struct receiver_data *d)
+{
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX];
+	FILE *out;
+
+	if (!stats_file_path(path, sizeof(path))) {
+		fprintf(stderr, "Nowhere to write the stats to, set CAMERA_STATS_FILE\n");
+		return;
+	}
+
+	// readers never see a half written file
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	out = fopen(tmp_path, "w");
+	if (!out) {
+		fprintf(stderr, "Couldn't write %s: %s\n", tmp_path, strerror(errno));
+		return;
+	}
+
+	write_stats_json(d, out);
+	fprintf(out, "\n");
+
+	if (fclose(out) != 0 || rename(tmp_path, path) < 0) {
+		fprintf(stderr, "Couldn't write %s: %s\n", path, strerror(errno));
+		unlink(tmp_path);
+		return;
+	}
+
+	fprintf(stdout, "Stats written to %s\n", path);
+}
+
+static void
+handle_dump_signal(int signal_number, void *data)
+{
+	dump_stats(static_cast<struct receiver_data *>(data));
+}
+
+static void
+handle_snapshot_signal(int signal_number, void *data)
+{
+	struct receiver_data *d = static_cast<struct receiver_data *>(data);
+
+	if (!d->snapshot) {
+		fprintf(stderr, "Snapshots are off, set CAMERA_SNAPSHOT\n");
+		return;
+	}
+
+	snapshot_request(d->snapshot);
+}
+
+static void
+handle_record_signal(int signal_number, void *data)
+{
+	struct receiver_data *d = static_cast<struct receiver_data *>(data);
+
+	if (!d->recorder) {
+		fprintf(stderr, "Recording is off, set CAMERA_RECORD_DIR\n");
+		return;
+	}
+
+	if (signal_number == SIGRTMIN + 1) {
+		if (!recorder_lock_segment(d->recorder))
+			fprintf(stderr, "No segment to lock\n");
+	} else if (recorder_is_recording(d->recorder)) {
+		recorder_stop(d->recorder);
+		fprintf(stdout, "Recording stopped\n");
+	} else {
+		recorder_start(d->recorder);
+		fprintf(stdout, "Recording started\n");
+	}
+}
+
+static void
+stats_timer(void *data)
+{
+	struct receiver_data *d = static_cast<struct receiver_data *>(data);
+
+	struct pipeline_counters counters;
+	int i;
+
+	for (i = 0; i < d->n_mosaic; i++) {
+		struct mosaic_stream *stream = &d->mosaic[i];
+
+		fprintf(stdout, "camera %d (%s): ", i, stream->source);
+		frame_stats_print(stream->stats, stdout);
+		if (stream->pipeline &&
+		    pipeline_get_counters(stream->pipeline, &counters)) {
+			fprintf(stdout, "camera %d (%s): ", i, stream->source);
+			pipeline_counters_print(&counters, stdout);
+		}
+		if (stream->watchdog) {
+			fprintf(stdout, "camera %d (%s): ", i, stream->source);
+			frame_watchdog_print(stream->watchdog, stdout);
+		}
+	}
+
+	if (!d->n_mosaic)
+		frame_stats_print(d->frame_stats, stdout);
+	if (d->pipeline && pipeline_get_counters(d->pipeline, &counters))
+		pipeline_counters_print(&counters, stdout);
+	if (d->watchdog)
+		frame_watchdog_print(d->watchdog, stdout);
+	if (d->recorder)
+		recorder_print(d->recorder, stdout);
+	if (d->visibility)
+		visibility_print(d->visibility, stdout);
+	event_source_timer_update(d->stats_timer, d->stats_interval_s * 1000);
+}
+
 static struct display *
 create_display(int argc, char *argv[])
 {
@@ -645,6 +1143,7 @@ create_display(int argc, char *argv[])
 	assert(display->wl_display);
 
 	display->has_xrgb = false;
+	display->has_dmabuf = false;
 	display->wl_registry = wl_display_get_registry(display->wl_display);
 
 	wl_registry_add_listener(display->wl_registry, &registry_listener, display);
@@ -674,6 +1173,15 @@ destroy_display(struct display *display)
 	if (display->wm_base)
 		xdg_wm_base_destroy(display->wm_base);
 
+	if (display->viewporter)
+		wp_viewporter_destroy(display->viewporter);
+
+	if (display->dmabuf)
+		zwp_linux_dmabuf_v1_destroy(display->dmabuf);
+
+	if (display->presentation)
+		wp_presentation_destroy(display->presentation);
+
 	if (display->wl_compositor)
 		wl_compositor_destroy(display->wl_compositor);
 
@@ -687,161 +1195,2564 @@ destroy_display(struct display *display)
 #define xstr(a) str(a)
 #define str(a) #a
 
-GstElement* create_pipeline(int* argc, char** argv[])
+/*
+ * Pick the initial V4L2 io-mode. With DMABUF, v4l2src exports the
+ * capture buffers as dmabuf fds and waylandsink hands them straight to
+ * the compositor through linux-dmabuf, avoiding the per-frame copy into
+ * a wl_shm buffer. V4L2_IO_MODE can be used to force either path.
+ */
+static enum v4l2_io_mode
+choose_v4l2_io_mode(struct display *display)
 {
-	GError *error = NULL;
-	const char *camera_device = NULL;
-	const char *width_str = NULL;
-	const char *height_str = NULL;
-	int width;
-	int height;
-
-	// pipewire is default.
-	char *v4l2_path = getenv("ENABLE_V4L2_PATH");
-	bool v4l2 = false;
+	const char *io_mode_str = getenv("V4L2_IO_MODE");
 
-	char pipeline_str[1024];
+	if (io_mode_str) {
+		if (g_str_equal(io_mode_str, "dmabuf"))
+			return V4L2_IO_MODE_DMABUF;
+		if (g_str_equal(io_mode_str, "mmap"))
+			return V4L2_IO_MODE_MMAP;
 
-	camera_device = getenv("DEFAULT_V4L2_DEVICE");
-	if (!camera_device)
-		camera_device = get_first_camera_device();
+		fprintf(stderr, "Unknown V4L2_IO_MODE '%s', ignoring\n", io_mode_str);
+	}
 
-	width_str = getenv("DEFAULT_DEVICE_WIDTH");
-	if (!width_str)
-		width = WINDOW_WIDTH_SIZE;
-	else
-		width = atoi(width_str);
+	if (!display->has_dmabuf) {
+		fprintf(stdout, "zwp_linux_dmabuf_v1 not advertised by the compositor\n");
+		return V4L2_IO_MODE_MMAP;
+	}
 
-	height_str = getenv("DEFAULT_DEVICE_HEIGHT");
-	if (!height_str)
-		height = WINDOW_HEIGHT_SIZE;
-	else
-		height = atoi(height_str);
+	return V4L2_IO_MODE_DMABUF;
+}
 
-	if (v4l2_path == NULL)
-		v4l2 = false;
-	else if (g_str_equal(v4l2_path, "yes") || g_str_equal(v4l2_path, "true"))
-		v4l2 = true;
+/* the best capture device of d->cameras */
+static const char *
+choose_camera_device(struct receiver_data *d)
+{
+	const struct camera_device *camera;
+	int i;
 
-	memset(pipeline_str, 0, sizeof(pipeline_str));
+	for (i = 0; i < d->cameras.count; i++) {
+		const struct camera_device *device = &d->cameras.devices[i];
 
-	if (v4l2)
-		snprintf(pipeline_str, sizeof(pipeline_str), "v4l2src device=%s ! video/x-raw,width=%d,height=%d ! waylandsink",
-			camera_device, width, height);
-	else if (gst_pipeline_failed == TRUE) {
-		snprintf(pipeline_str, sizeof(pipeline_str), "filesrc location=%s/still-image.jpg ! decodebin ! videoconvert ! imagefreeze ! waylandsink",
-			xstr(APP_DATA_PATH));
-		fallback_gst_pipeline_tried = TRUE;
-	}
-	else {
-		snprintf(pipeline_str, sizeof(pipeline_str), "pipewiresrc ! waylandsink");
+		fprintf(stdout, "Found %s (%s)%s, %d formats, up to %ux%u\n",
+			device->path, device->card,
+			device->capture ? "" : " not a capture device",
+			device->n_formats, device->max_width, device->max_height);
 	}
 
-	fprintf(stdout, "Using pipeline: %s\n", pipeline_str);
+	camera = camera_device_list_first_capture(&d->cameras);
+	return camera ? camera->path : NULL;
+}
 
-	GstElement *pipeline = gst_parse_launch(pipeline_str, &error);
+static const char *
+pick_camera_device(struct receiver_data *d, struct camera_discovery *discovery)
+{
+	camera_discovery_finish(discovery, &d->cameras);
+	return choose_camera_device(d);
+}
 
-	if (error || !pipeline) {
-		fprintf(stderr, "gstreamer pipeline construction failed!\n");
-		free(argv);
-		return NULL;
+static bool
+get_camera_device(struct receiver_data *d, const char *path,
+		  struct camera_device *device)
+{
+	int i;
+
+	for (i = 0; i < d->cameras.count; i++) {
+		if (strcmp(d->cameras.devices[i].path, path) == 0) {
+			*device = d->cameras.devices[i];
+			return true;
+		}
 	}
 
-	return pipeline;
+	// DEFAULT_V4L2_DEVICE skips the discovery
+	return camera_device_probe(path, device) && device->capture;
 }
 
-int main(int argc, char* argv[])
+/*
+ * What the camera is shown at: the output, or the tile of it in a
+ * mosaic, at CAMERA_FPS but no faster than the output refreshes.
+ */
+static void
+camera_target(struct receiver_data *d, int *width, int *height, int *fps)
 {
-	int ret = 0;
-	struct sigaction sa;
-	struct receiver_data receiver_data = {};
-	struct display* display;
-	struct window* window;
-	const char* app_id = "camera-gstreamer";
-
-	// for starting the application from the beginning, with a diffrent
-	// role we need to handle that creating the main window
-	if (argc >= 2 && strcmp(argv[1], "float") == 0) {
-		GrpcClient *client = new GrpcClient();
-		client->SetAppFloat(std::string(app_id), 30, 400);
+	struct display *display = d->window->display;
+	struct mosaic_tile tiles[MOSAIC_MAX_STREAMS];
+	int refresh = display->output_data.refresh / 1000;
+
+	*width = display->output_data.width;
+	*height = display->output_data.height;
+	if (*width <= 0 || *height <= 0) {
+		*width = WINDOW_WIDTH_SIZE;
+		*height = WINDOW_HEIGHT_SIZE;
 	}
 
-	sa.sa_sigaction = signal_int;
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = SA_RESETHAND | SA_SIGINFO;
-	sigaction(SIGINT, &sa, NULL);
+	if (d->n_mosaic) {
+		mosaic_layout(d->n_mosaic, 0, 0, *width, *height, tiles);
+		*width = tiles[0].width;
+		*height = tiles[0].height;
+	}
 
-	int gargc = 2;
-	char** gargv = static_cast<char**>(calloc(2, sizeof(char*)));
+	if (d->camera_fps > 0)
+		*fps = d->camera_fps;
+	else if (getenv("CAMERA_FPS"))
+		*fps = atoi(getenv("CAMERA_FPS"));
+	else
+		*fps = DEFAULT_CAMERA_FPS;
 
-	gargv[0] = strdup(argv[0]);
-	gargv[1] = strdup("--gst-debug-level=2");
+	if (refresh > 0 && (*fps <= 0 || *fps > refresh))
+		*fps = refresh;
+	if (*fps <= 0)
+		*fps = DEFAULT_CAMERA_FPS;
+}
 
-	setbuf(stdout, NULL);
+/*
+ * Capture in the mode the frames are shown at, as far as the camera
+ * has one: anything bigger is scaled down by the compositor through
+ * waylandsink's wp_viewport, so it's only bandwidth wasted, and nothing
+ * gets scaled in software.
+ */
+static void
+pick_camera_mode(struct receiver_data *d, struct pipeline_config *config,
+		 const struct camera_device *device, uint32_t format)
+{
+	struct camera_mode mode;
+	int width, height, fps;
+	char fourcc[5];
 
-	gst_init(&gargc, &gargv);
+	camera_target(d, &width, &height, &fps);
 
-	receiver_data.pipeline = create_pipeline(&gargc, &gargv);
+	if (!camera_device_pick_mode(device, format, width, height, fps, &mode)) {
+		fprintf(stdout, "Camera modes unknown, leaving the size to caps negotiation\n");
+		return;
+	}
 
-	if (!receiver_data.pipeline)
-		return EXIT_FAILURE;
+	config->width = mode.width;
+	config->height = mode.height;
+	config->framerate_num = mode.fps_num;
+	config->framerate_den = mode.fps_den;
 
-	display = create_display(argc, argv);
-	if (!display)
-		return -1;
+	fprintf(stdout, "Using camera mode %s %ux%u at %u/%u fps for %dx%d at %d fps\n",
+		video_format_fourcc_str(mode.format, fourcc), mode.width,
+		mode.height, mode.fps_num, mode.fps_den, width, height, fps);
+}
 
-	// we use the role to set a correspondence between the top level
-	// surface and our application, with the previous call letting the
-	// compositor know that we're one and the same
-	window = create_window(display, WINDOW_WIDTH_SIZE, WINDOW_HEIGHT_SIZE, app_id);
+/*
+ * Ask the camera for a format the compositor takes as is, so neither
+ * waylandsink nor the compositor have to convert. A videoconvert is
+ * only added when there's no such format; its conversions are
+ * SIMD-accelerated through ORC. The mode is picked for the output
+ * unless the size is fixed.
+ */
+static void
+negotiate_camera_format(struct receiver_data *d, struct pipeline_config *config)
+{
+	struct display *display = d->window->display;
+	struct camera_device device;
+	struct video_format_choice choice;
+	char fourcc[5];
+	int i;
 
-	if (!window) {
-		free(gargv);
-		return EXIT_FAILURE;
+	config->format = NULL;
+	config->add_convert = false;
+	if (!d->capture_size_fixed) {
+		config->width = config->height = 0;
+		config->framerate_num = config->framerate_den = 0;
 	}
 
-	window->display = display;
-	receiver_data.window = window;
-
-	/* Initialise damage to full surface, so the padding gets painted */
-	wl_surface_damage(window->surface, 0, 0,
-			  window->width, window->height);
+	if (!config->device || !get_camera_device(d, config->device, &device)) {
+		fprintf(stdout, "Camera formats unknown, leaving the format to caps negotiation\n");
+		return;
+	}
 
-	if (!window->wait_for_configure) {
-		redraw(window, NULL, 0);
+	fprintf(stdout, "Camera %s formats:", device.path);
+	for (i = 0; i < device.n_formats; i++)
+		fprintf(stdout, " %s", video_format_fourcc_str(device.formats[i], fourcc));
+	fprintf(stdout, "\n");
+
+	if (video_format_negotiate(&display->formats, device.formats,
+				   device.n_formats,
+				   config->io_mode == V4L2_IO_MODE_DMABUF,
+				   &choice)) {
+		config->format = choice.gst_format;
+		fprintf(stdout, "Using camera format %s, shown without conversion%s\n",
+			choice.gst_format,
+			choice.dmabuf ? " through linux-dmabuf" : "");
+	} else if (choice.gst_format) {
+		// the mode has to be one of that raw format, not e.g. an
+		// MJPG-only size the video/x-raw caps can't negotiate
+		config->format = choice.gst_format;
+		config->add_convert = true;
+		fprintf(stdout, "No camera format the compositor supports, "
+			"converting from %s\n", choice.gst_format);
+	} else {
+		config->add_convert = true;
+		fprintf(stdout, "No raw camera format we know of, converting "
+			"whatever the caps negotiation gives\n");
 	}
 
-	GstBus *bus = gst_element_get_bus(receiver_data.pipeline);
-	gst_bus_add_signal_watch(bus);
+	// without a known raw format any mode could be a compressed one
+	if (!d->capture_size_fixed && choice.v4l2_format)
+		pick_camera_mode(d, config, &device, choice.v4l2_format);
+}
 
-	g_signal_connect(bus, "message::error", G_CALLBACK(error_cb), &receiver_data);
-	gst_bus_set_sync_handler(bus, bus_sync_handler, &receiver_data, NULL);
+/*
+ * CAMERA_LATENCY_MODE=low trades frames for latency: the newest frame
+ * is shown and the ones the compositor can't keep up with are dropped,
+ * see PIPELINE_LATENCY_LOW. CAMERA_QUEUE_SIZE and CAMERA_MAX_LATENESS_MS
+ * tune it.
+ */
+static void
+init_latency_mode(struct pipeline_config *config)
+{
+	const char *mode = getenv("CAMERA_LATENCY_MODE");
+
+	if (!mode || g_str_equal(mode, "default"))
+		return;
+
+	if (!g_str_equal(mode, "low")) {
+		fprintf(stderr, "Unknown CAMERA_LATENCY_MODE %s, using default\n", mode);
+		return;
+	}
+
+	config->latency = PIPELINE_LATENCY_LOW;
+	if (getenv("CAMERA_QUEUE_SIZE"))
+		config->queue_size = atoi(getenv("CAMERA_QUEUE_SIZE"));
+	if (getenv("CAMERA_MAX_LATENESS_MS"))
+		config->max_lateness_ms = atoi(getenv("CAMERA_MAX_LATENESS_MS"));
+
+	fprintf(stdout, "Low latency mode, frames that can't be shown in time are dropped\n");
+}
+
+/*
+ * DEFAULT_DEVICE_WIDTH and DEFAULT_DEVICE_HEIGHT fix the capture size,
+ * the window size stands in for the one that isn't set. Returns false
+ * if neither is, the mode is picked from the camera's then.
+ */
+static bool
+init_capture_size(struct pipeline_config *config)
+{
+	const char *width_str = getenv("DEFAULT_DEVICE_WIDTH");
+	const char *height_str = getenv("DEFAULT_DEVICE_HEIGHT");
+
+	if (!width_str && !height_str)
+		return false;
+
+	if (!width_str)
+		config->width = WINDOW_WIDTH_SIZE;
+	else
+		config->width = atoi(width_str);
+
+	if (!height_str)
+		config->height = WINDOW_HEIGHT_SIZE;
+	else
+		config->height = atoi(height_str);
+
+	return true;
+}
+
+/*
+ * CAMERA_SNAPSHOT=jpeg or png taps the camera pipeline; SIGUSR2 then
+ * writes the newest frame to CAMERA_SNAPSHOT_DIR, or XDG_RUNTIME_DIR.
+ * CAMERA_SNAPSHOT_RING is how many frames the tap holds on to.
+ */
+static void
+init_snapshot(struct receiver_data *d)
+{
+	const char *format_str = getenv("CAMERA_SNAPSHOT");
+	const char *dir = getenv("CAMERA_SNAPSHOT_DIR");
+	enum snapshot_format format;
+
+	if (!format_str)
+		return;
+
+	if (g_str_equal(format_str, "png")) {
+		format = SNAPSHOT_FORMAT_PNG;
+	} else if (g_str_equal(format_str, "jpeg") || g_str_equal(format_str, "jpg")) {
+		format = SNAPSHOT_FORMAT_JPEG;
+	} else {
+		fprintf(stderr, "Unknown CAMERA_SNAPSHOT format %s, use jpeg or png\n",
+			format_str);
+		return;
+	}
+
+	if (!dir)
+		dir = getenv("XDG_RUNTIME_DIR");
+	if (!dir) {
+		fprintf(stderr, "Nowhere to write snapshots to, set CAMERA_SNAPSHOT_DIR\n");
+		return;
+	}
+
+	d->config.add_snapshot_tap = true;
+	if (getenv("CAMERA_SNAPSHOT_RING"))
+		d->config.snapshot_ring = atoi(getenv("CAMERA_SNAPSHOT_RING"));
+
+	d->snapshot = snapshot_create(dir, format, stdout);
+	fprintf(stdout, "Snapshots on SIGUSR2, written to %s\n", dir);
+}
+
+/*
+ * CAMERA_RECORD_DIR taps the camera pipeline and records it there, in
+ * CAMERA_RECORD_SEGMENT_S long segments of which the newest
+ * CAMERA_RECORD_SEGMENTS are kept, at CAMERA_RECORD_BITRATE kbit/s.
+ * Recording starts right away unless CAMERA_RECORD=off; SIGRTMIN
+ * toggles it and SIGRTMIN+1 locks the segment being written.
+ */
+static void
+init_recording(struct receiver_data *d)
+{
+	const char *dir = getenv("CAMERA_RECORD_DIR");
+	const char *record = getenv("CAMERA_RECORD");
+	int max_segments = 0;
+
+	if (!dir)
+		return;
+
+	if (getenv("CAMERA_RECORD_SEGMENTS"))
+		max_segments = atoi(getenv("CAMERA_RECORD_SEGMENTS"));
+	d->recorder = recorder_create(d->loop, dir, max_segments, stdout);
+
+	d->config.add_record_tap = true;
+	d->config.record_location = recorder_location(d->recorder);
+	if (getenv("CAMERA_RECORD_SEGMENT_S"))
+		d->config.record_segment_s = atoi(getenv("CAMERA_RECORD_SEGMENT_S"));
+	if (getenv("CAMERA_RECORD_BITRATE"))
+		d->config.record_bitrate_kbps = atoi(getenv("CAMERA_RECORD_BITRATE"));
+
+	if (!record || !g_str_equal(record, "off"))
+		recorder_start(d->recorder);
+	fprintf(stdout, "Recording to %s, SIGRTMIN starts and stops it, "
+		"SIGRTMIN+1 locks the current segment\n", dir);
+}
+
+/*
+ * @discovery is only set if DEFAULT_V4L2_DEVICE isn't, it gets
+ * consumed here.
+ */
+static void
+init_pipeline_config(struct receiver_data *d, struct camera_discovery *discovery)
+{
+	static char still_image_path[PATH_MAX];
+	struct pipeline_config *config = &d->config;
+	struct display *display = d->window->display;
+	const char *camera_device = NULL;
+
+	// pipewire is default.
+	char *v4l2_path = getenv("ENABLE_V4L2_PATH");
+	bool v4l2 = false;
+
+	camera_device = getenv("DEFAULT_V4L2_DEVICE");
+	d->camera_from_env = camera_device != NULL;
+	if (!camera_device)
+		camera_device = pick_camera_device(d, discovery);
+
+	if (v4l2_path == NULL)
+		v4l2 = false;
+	else if (g_str_equal(v4l2_path, "yes") || g_str_equal(v4l2_path, "true"))
+		v4l2 = true;
+
+	snprintf(still_image_path, sizeof(still_image_path),
+		 "%s/still-image.jpg", xstr(APP_DATA_PATH));
+
+	memset(config, 0, sizeof(*config));
+	config->location = still_image_path;
+	init_latency_mode(config);
+
+	if (!v4l2) {
+		config->source = PIPELINE_SOURCE_PIPEWIRE;
+		return;
+	}
+
+	config->source = PIPELINE_SOURCE_V4L2;
+	config->device = camera_device;
+	config->io_mode = choose_v4l2_io_mode(display);
+	d->capture_size_fixed = init_capture_size(config);
+
+	negotiate_camera_format(d, config);
+}
+
+/*
+ * A DMABUF camera that failed before showing a single frame is retried
+ * with MMAP. Returns false if there's nothing left to try.
+ */
+static bool
+degrade_pipeline_config(struct receiver_data *d, struct pipeline_config *config)
+{
+	// either the driver can't export dmabufs or the compositor refused
+	// to import them; retry the camera with MMAP before giving up on it
+	if (config->source == PIPELINE_SOURCE_V4L2 &&
+	    config->io_mode == V4L2_IO_MODE_DMABUF) {
+		fprintf(stderr, "DMABUF capture path failed, falling back to MMAP\n");
+		config->io_mode = V4L2_IO_MODE_MMAP;
+		negotiate_camera_format(d, config);
+		return true;
+	}
+
+	return false;
+}
+
+static void
+setup_pipeline_bus(struct receiver_data *d, GstElement *pipeline)
+{
+	GstBus *bus = gst_element_get_bus(pipeline);
+
+	gst_bus_set_sync_handler(bus, bus_sync_handler, d, NULL);
 	gst_object_unref(bus);
+}
+
+/*
+ * Messages the sync handler lets through are queued on the bus, whose
+ * fd becomes readable; the main loop picks them up from here.
+ */
+struct bus_watch {
+	struct receiver_data *d;
+	GstElement *pipeline;
+	GstBus *bus;
+	struct event_source *source;
+};
+
+static void
+handle_bus_message(struct receiver_data *d, GstElement *pipeline,
+		   GstMessage *message)
+{
+	GError *err = NULL;
+	gchar *dbg_info = NULL;
+	int i;
+
+	if (GST_MESSAGE_TYPE(message) != GST_MESSAGE_ERROR)
+		return;
+
+	gst_message_parse_error(message, &err, &dbg_info);
+	g_printerr("ERROR from element %s: %s code %d\n",
+		GST_OBJECT_NAME(message->src), err->message, err->code);
+	g_printerr("Debugging info: %s\n", (dbg_info) ? dbg_info : "none");
+	g_error_free(err);
+	g_free(dbg_info);
+
+	if (pipeline == d->standby) {
+		d->standby_failed = true;
+		return;
+	}
+
+	for (i = 0; i < d->n_mosaic; i++) {
+		if (pipeline == d->mosaic[i].pipeline) {
+			d->mosaic[i].failed = true;
+			return;
+		}
+	}
+
+	d->pipeline_failed = true;
+}
+
+static void
+bus_watch_handle_data(int fd, uint32_t mask, void *data)
+{
+	struct bus_watch *watch = static_cast<struct bus_watch *>(data);
+	GstMessage *message;
+
+	while ((message = gst_bus_pop(watch->bus)) != NULL) {
+		handle_bus_message(watch->d, watch->pipeline, message);
+		gst_message_unref(message);
+	}
+}
+
+static struct bus_watch *
+bus_watch_create(struct receiver_data *d, GstElement *pipeline)
+{
+	struct bus_watch *watch;
+	GPollFD pollfd;
+
+	watch = static_cast<struct bus_watch *>(calloc(1, sizeof(*watch)));
+	watch->d = d;
+	watch->pipeline = pipeline;
+	watch->bus = gst_element_get_bus(pipeline);
+
+	gst_bus_get_pollfd(watch->bus, &pollfd);
+	watch->source = event_loop_add_fd(d->loop, pollfd.fd, EVENT_READABLE,
+					  bus_watch_handle_data, watch);
+
+	return watch;
+}
+
+static void
+bus_watch_destroy(struct bus_watch *watch)
+{
+	if (!watch)
+		return;
+
+	if (watch->source)
+		event_source_remove(watch->source);
+
+	gst_bus_set_flushing(watch->bus, TRUE);
+	gst_object_unref(watch->bus);
+	free(watch);
+}
+
+static void
+camera_retry_timer(void *data)
+{
+	// nothing to do, update_pipelines() runs after every dispatch
+	(void) data;
+}
+
+static void
+schedule_camera_retry(struct receiver_data *d, gint64 delay_us)
+{
+	d->camera_retry_at = g_get_monotonic_time() + delay_us;
+
+	// a zero delay would disarm the timer
+	event_source_timer_update(d->retry_timer, MAX(1, delay_us / 1000));
+}
+
+static GstElement *
+create_pipeline(struct receiver_data *d, struct pipeline_config *config)
+{
+	char pipeline_str[1024];
+	GstElement *pipeline;
+
+	while (true) {
+		pipeline_config_describe(config, pipeline_str, sizeof(pipeline_str));
+		fprintf(stdout, "Using pipeline: %s\n", pipeline_str);
+
+		if (config->source == PIPELINE_SOURCE_V4L2)
+			fprintf(stdout, "Using %s V4L2 capture path\n",
+				config->io_mode == V4L2_IO_MODE_DMABUF ?
+				"zero-copy DMABUF" : "MMAP");
+
+		pipeline = pipeline_build(config);
+		if (pipeline) {
+			setup_pipeline_bus(d, pipeline);
+			if (pipeline_validate(pipeline))
+				return pipeline;
+
+			gst_object_unref(pipeline);
+		}
+
+		fprintf(stderr, "gstreamer pipeline construction failed!\n");
+		if (!degrade_pipeline_config(d, config))
+			return NULL;
+	}
+}
+
+static void
+add_sink_probe(GstElement *pipeline, GstPadProbeCallback probe, gpointer data)
+{
+	GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+	GstPad *pad = gst_element_get_static_pad(sink, "sink");
+
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, probe, data, NULL);
+
+	gst_object_unref(pad);
+	gst_object_unref(sink);
+}
+
+static GstPadProbeReturn
+camera_first_buffer_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct receiver_data *d = static_cast<struct receiver_data *>(user_data);
+	GstElement *sink = GST_ELEMENT(GST_PAD_PARENT(pad));
+
+	d->camera_shown_at = g_get_monotonic_time();
+
+	// wake up the main loop, which might be waiting for this to
+	// take the still image down
+	gst_element_post_message(sink,
+		gst_message_new_application(GST_OBJECT(sink),
+			gst_structure_new_empty("camera-first-frame")));
+
+	return GST_PAD_PROBE_REMOVE;
+}
+
+static void
+add_frame_stats(struct frame_stats *stats, GstPad *pad, GstBuffer *buffer)
+{
+	GstElement *sink = GST_ELEMENT(GST_PAD_PARENT(pad));
+	GstClock *clock = gst_element_get_clock(sink);
+	gint64 latency = -1;
+	int64_t sequence = -1;
+
+	// live sources stamp each buffer with the running time it was
+	// captured at, the distance to the running time now is how long
+	// it took to get here
+	if (clock && GST_BUFFER_PTS_IS_VALID(buffer)) {
+		GstClockTime now = gst_clock_get_time(clock) -
+				   gst_element_get_base_time(sink);
+
+		if (now >= GST_BUFFER_PTS(buffer))
+			latency = (now - GST_BUFFER_PTS(buffer)) / GST_USECOND;
+	}
+
+	if (clock)
+		gst_object_unref(clock);
+
+	// v4l2src puts the driver's frame sequence number in there
+	if (GST_BUFFER_OFFSET_IS_VALID(buffer))
+		sequence = GST_BUFFER_OFFSET(buffer);
+
+	frame_stats_add(stats, sequence, latency);
+}
+
+static GstPadProbeReturn
+camera_frame_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct receiver_data *d = static_cast<struct receiver_data *>(user_data);
+	GstElement *sink = GST_ELEMENT(GST_PAD_PARENT(pad));
+
+	if (d->resume_armed && d->resume_armed.exchange(false)) {
+		d->resumed_at = g_get_monotonic_time();
+
+		// wake up the main loop to report it
+		gst_element_post_message(sink,
+			gst_message_new_application(GST_OBJECT(sink),
+				gst_structure_new_empty("camera-resumed")));
+	}
+
+	add_frame_stats(d->frame_stats, pad, GST_PAD_PROBE_INFO_BUFFER(info));
+
+	return GST_PAD_PROBE_OK;
+}
+
+/*
+ * Ends an in place reconfiguration: the first buffer after the new caps
+ * has reached the sink.
+ */
+static GstPadProbeReturn
+camera_reconfig_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct receiver_data *d = static_cast<struct receiver_data *>(user_data);
+	struct camera_reconfig *reconfig = &d->reconfig;
+	GstElement *sink;
+
+	if (!reconfig->armed)
+		return GST_PAD_PROBE_OK;
+
+	if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+		if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) == GST_EVENT_CAPS)
+			reconfig->caps_seen = true;
+		return GST_PAD_PROBE_OK;
+	}
+
+	if (!reconfig->caps_seen)
+		return GST_PAD_PROBE_OK;
+
+	reconfig->shown_at = g_get_monotonic_time();
+	reconfig->armed = false;
+
+	sink = GST_ELEMENT(GST_PAD_PARENT(pad));
+	gst_element_post_message(sink,
+		gst_message_new_application(GST_OBJECT(sink),
+			gst_structure_new_empty("camera-reconfigured")));
+
+	return GST_PAD_PROBE_OK;
+}
+
+static void
+add_reconfig_probe(struct receiver_data *d)
+{
+	GstElement *sink = gst_bin_get_by_name(GST_BIN(d->pipeline), "sink");
+	GstPad *pad = gst_element_get_static_pad(sink, "sink");
+
+	gst_pad_add_probe(pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER |
+						  GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+			  camera_reconfig_probe, d, NULL);
+
+	gst_object_unref(pad);
+	gst_object_unref(sink);
+}
+
+/* CAMERA_RETRY_INTERVAL_US, doubled for each watchdog failure in a row */
+static gint64
+watchdog_retry_delay(unsigned int failures)
+{
+	unsigned int shift = failures ? failures - 1 : 0;
+
+	return (gint64) CAMERA_RETRY_INTERVAL_US << MIN(shift, WATCHDOG_BACKOFF_MAX);
+}
+
+/*
+ * Only live sources deliver frames at a steady rate, and a test pattern
+ * repeats the same frame on purpose.
+ */
+static void
+attach_watchdog(struct frame_watchdog *watchdog, GstElement *pipeline,
+		const struct pipeline_config *config)
+{
+	switch (config->source) {
+	case PIPELINE_SOURCE_V4L2:
+	case PIPELINE_SOURCE_PIPEWIRE:
+		frame_watchdog_attach(watchdog, pipeline, true);
+		break;
+	case PIPELINE_SOURCE_TEST:
+		frame_watchdog_attach(watchdog, pipeline, false);
+		break;
+	default:
+		// an image is pushed once
+		frame_watchdog_detach(watchdog);
+		break;
+	}
+}
+
+static bool
+start_camera_pipeline(struct receiver_data *d)
+{
+	d->pipeline = create_pipeline(d, &d->config);
+	if (!d->pipeline)
+		return false;
+
+	d->camera_shown_at = 0;
+	add_sink_probe(d->pipeline, camera_first_buffer_probe, d);
+	add_sink_probe(d->pipeline, camera_frame_probe, d);
+	if (d->control)
+		add_reconfig_probe(d);
+	if (d->watchdog)
+		attach_watchdog(d->watchdog, d->pipeline, &d->config);
+
+	if (d->snapshot) {
+		GstElement *appsink = gst_bin_get_by_name(GST_BIN(d->pipeline),
+							  "snapshot");
+
+		snapshot_set_sink(d->snapshot, appsink);
+		gst_object_unref(appsink);
+	}
+	if (d->recorder)
+		recorder_set_pipeline(d->recorder, d->pipeline, &d->config);
+	d->bus_watch = bus_watch_create(d, d->pipeline);
+
+	d->camera_requested_at = g_get_monotonic_time();
+
+	// at startup the source can already negotiate and allocate its
+	// buffers while the window waits for the compositor
+	d->pipeline_waits_for_window = d->window->wait_for_configure;
+	gst_element_set_state(d->pipeline, d->pipeline_waits_for_window ?
+			      GST_STATE_PAUSED : GST_STATE_PLAYING);
+
+	return true;
+}
+
+static void
+stop_camera_pipeline(struct receiver_data *d)
+{
+	if (!d->pipeline)
+		return;
+
+	d->pipeline_waits_for_window = false;
+	bus_watch_destroy(d->bus_watch);
+	d->bus_watch = NULL;
+	if (d->watchdog)
+		frame_watchdog_detach(d->watchdog);
+
+	pipeline_get_counters(d->pipeline, &d->last_counters);
+	if (d->snapshot)
+		snapshot_set_sink(d->snapshot, NULL);
+
+	gst_element_set_state(d->pipeline, GST_STATE_NULL);
+	if (d->recorder)
+		recorder_set_pipeline(d->recorder, NULL, NULL);
+	gst_object_unref(d->pipeline);
+	d->pipeline = NULL;
+}
+
+/*
+ * Pre-roll the still image in the background: once in PAUSED the frame
+ * sits in the sink, which doesn't show it until we go to PLAYING. Going
+ * through READY also unmaps whatever the sink had on screen. The frame
+ * comes decoded from the still image cache, so this is cheap.
+ */
+static void
+preroll_standby_pipeline(struct receiver_data *d)
+{
+	gst_element_set_state(d->standby, GST_STATE_READY);
+	gst_element_set_state(d->standby, GST_STATE_PAUSED);
+
+	if (!still_image_push(d->standby, d->standby_config.still_image))
+		fprintf(stderr, "Failed to queue the still image\n");
+}
+
+/*
+ * The still image is decoded at the size it's shown at, so that the sink
+ * doesn't have to scale it: the output, or the window until we know that.
+ */
+static void
+standby_target(struct receiver_data *d, int *width, int *height)
+{
+	struct display *display = d->window->display;
+
+	*width = display->output_data.width;
+	*height = display->output_data.height;
+	if (*width <= 0 || *height <= 0) {
+		*width = d->window->width;
+		*height = d->window->height;
+	}
+}
+
+static void
+create_standby_pipeline(struct receiver_data *d)
+{
+	GstSample *still_image;
+	int width, height;
+
+	standby_target(d, &width, &height);
+	still_image = still_image_get(d->config.location, width, height);
+	if (!still_image) {
+		fprintf(stderr, "No fallback pipeline available\n");
+		return;
+	}
+
+	d->standby_config = {};
+	d->standby_config.source = PIPELINE_SOURCE_STILL_IMAGE;
+	d->standby_config.still_image = still_image;
+
+	d->standby = create_pipeline(d, &d->standby_config);
+	if (!d->standby) {
+		fprintf(stderr, "No fallback pipeline available\n");
+		return;
+	}
+
+	d->standby_width = width;
+	d->standby_height = height;
+	d->standby_sink = gst_bin_get_by_name(GST_BIN(d->standby), "sink");
+	g_object_set(d->standby_sink, "show-preroll-frame", FALSE, NULL);
+	d->standby_bus_watch = bus_watch_create(d, d->standby);
+
+	preroll_standby_pipeline(d);
+}
+
+static void
+destroy_standby_pipeline(struct receiver_data *d)
+{
+	if (!d->standby)
+		return;
+
+	bus_watch_destroy(d->standby_bus_watch);
+	d->standby_bus_watch = NULL;
+
+	gst_element_set_state(d->standby, GST_STATE_NULL);
+	gst_object_unref(d->standby_sink);
+	gst_object_unref(d->standby);
+	d->standby_sink = NULL;
+	d->standby = NULL;
+}
+
+/*
+ * A new output mode gets the still image decoded again at its size, see
+ * still_image_get(). The one on screen stays until the camera is back,
+ * the sink scales it meanwhile.
+ */
+static void
+update_standby_size(struct receiver_data *d)
+{
+	struct display *display = d->window->display;
+	int width = display->output_data.width;
+	int height = display->output_data.height;
+
+	// the window size only stands in until the output mode is known
+	if (d->on_fallback || width <= 0 || height <= 0 ||
+	    (width == d->standby_width && height == d->standby_height))
+		return;
+
+	fprintf(stdout, "Output is now %dx%d, redoing the still image\n",
+		width, height);
+	// the cache lets go of the old frame, the pipeline has to go first
+	destroy_standby_pipeline(d);
+	create_standby_pipeline(d);
+}
+
+/*
+ * The still image is pushed only once; when the window changes size we
+ * just ask the sink to redraw the frame it already has.
+ */
+static void
+update_fallback_geometry(struct receiver_data *d)
+{
+	struct window *window = d->window;
+	GstVideoOverlay *overlay;
+
+	if (window->width == d->fallback_width &&
+	    window->height == d->fallback_height)
+		return;
+
+	d->fallback_width = window->width;
+	d->fallback_height = window->height;
+
+	overlay = GST_VIDEO_OVERLAY(d->standby_sink);
+	gst_video_overlay_set_render_rectangle(overlay, window->x, window->y,
+					       window->width, window->height);
+	gst_video_overlay_expose(overlay);
+}
+
+static bool
+camera_device_present(struct receiver_data *d)
+{
+	if (d->config.source != PIPELINE_SOURCE_V4L2)
+		return true;
+
+	return d->config.device && access(d->config.device, F_OK) == 0;
+}
+
+static void
+switch_to_fallback(struct receiver_data *d)
+{
+	bool camera_seen = d->camera_shown_at != 0;
+
+	if (!d->on_fallback && d->standby) {
+		fprintf(stdout, "Camera pipeline failed, switching to the still image\n");
+		d->fallback_shown_at = 0;
+		d->fallback_width = d->window->width;
+		d->fallback_height = d->window->height;
+		gst_element_set_state(d->standby, GST_STATE_PLAYING);
+	}
+
+	d->on_fallback = true;
+	stop_camera_pipeline(d);
+
+	if (!camera_seen && camera_device_present(d) &&
+	    degrade_pipeline_config(d, &d->config))
+		schedule_camera_retry(d, 0);
+	else
+		schedule_camera_retry(d, CAMERA_RETRY_INTERVAL_US);
+}
+
+static void
+switch_to_camera(struct receiver_data *d)
+{
+	fprintf(stdout, "Camera is back, switched from the still image in %.1f ms\n",
+		(d->camera_shown_at - d->camera_requested_at) / 1000.0);
+
+	d->on_fallback = false;
+	if (d->standby)
+		preroll_standby_pipeline(d);
+}
+
+/*
+ * Lay the tiles out for the current window size and move the sinks we
+ * already have; the subsurfaces only move with our next commit.
+ */
+static void
+layout_mosaic(struct receiver_data *d)
+{
+	struct window *window = d->window;
+	struct mosaic_tile tiles[MOSAIC_MAX_STREAMS];
+	int i;
+
+	mosaic_layout(d->n_mosaic, window->x, window->y,
+		      window->width, window->height, tiles);
+
+	std::lock_guard<std::mutex> lock(d->mosaic_mutex);
+
+	for (i = 0; i < d->n_mosaic; i++) {
+		struct mosaic_stream *stream = &d->mosaic[i];
+
+		stream->tile = tiles[i];
+		if (stream->overlay)
+			gst_video_overlay_set_render_rectangle(stream->overlay,
+							       tiles[i].x, tiles[i].y,
+							       tiles[i].width,
+							       tiles[i].height);
+	}
+
+	d->mosaic_width = window->width;
+	d->mosaic_height = window->height;
+	d->mosaic_needs_commit = true;
+}
+
+static GstPadProbeReturn
+mosaic_frame_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	struct mosaic_stream *stream = static_cast<struct mosaic_stream *>(user_data);
+	GstElement *sink = GST_ELEMENT(GST_PAD_PARENT(pad));
+
+	if (!stream->shown_at) {
+		stream->shown_at = g_get_monotonic_time();
+
+		// wake up the main loop to report it
+		gst_element_post_message(sink,
+			gst_message_new_application(GST_OBJECT(sink),
+				gst_structure_new_empty("mosaic-first-frame")));
+	}
+
+	if (stream->resume_armed && stream->resume_armed.exchange(false)) {
+		stream->resumed_at = g_get_monotonic_time();
+		gst_element_post_message(sink,
+			gst_message_new_application(GST_OBJECT(sink),
+				gst_structure_new_empty("camera-resumed")));
+	}
+
+	add_frame_stats(stream->stats, pad, GST_PAD_PROBE_INFO_BUFFER(info));
+
+	return GST_PAD_PROBE_OK;
+}
+
+static bool
+mosaic_source_present(struct mosaic_stream *stream)
+{
+	if (stream->config.source != PIPELINE_SOURCE_V4L2)
+		return true;
+
+	return access(stream->config.device, F_OK) == 0;
+}
+
+static bool
+start_mosaic_stream(struct receiver_data *d, struct mosaic_stream *stream)
+{
+	GstElement *pipeline;
+
+	pipeline = create_pipeline(d, &stream->config);
+	if (!pipeline)
+		return false;
+
+	{
+		std::lock_guard<std::mutex> lock(d->mosaic_mutex);
+		stream->pipeline = pipeline;
+	}
+
+	stream->failed = false;
+	stream->shown_at = 0;
+	stream->shown_reported = false;
+	frame_stats_reset(stream->stats);
+	add_sink_probe(pipeline, mosaic_frame_probe, stream);
+	if (stream->watchdog)
+		attach_watchdog(stream->watchdog, pipeline, &stream->config);
+	stream->bus_watch = bus_watch_create(d, pipeline);
+
+	stream->requested_at = g_get_monotonic_time();
+	gst_element_set_state(pipeline, d->mosaic_waits_for_window ?
+			      GST_STATE_PAUSED : GST_STATE_PLAYING);
+
+	return true;
+}
+
+static void
+stop_mosaic_stream(struct receiver_data *d, struct mosaic_stream *stream)
+{
+	GstElement *pipeline = stream->pipeline;
+
+	if (!pipeline)
+		return;
+
+	bus_watch_destroy(stream->bus_watch);
+	stream->bus_watch = NULL;
+	stream->resume_armed = false;
+	if (stream->watchdog)
+		frame_watchdog_detach(stream->watchdog);
+
+	pipeline_get_counters(pipeline, &stream->last_counters);
+	gst_element_set_state(pipeline, GST_STATE_NULL);
+
+	{
+		std::lock_guard<std::mutex> lock(d->mosaic_mutex);
+		stream->pipeline = NULL;
+		stream->overlay = NULL;
+	}
+
+	gst_object_unref(pipeline);
+}
+
+/*
+ * CAMERA_MOSAIC lists the cameras, see mosaic_parse_sources(). Each one
+ * is set up like the single camera, plus a queue so that its source and
+ * sink run in threads of their own.
+ */
+static bool
+init_mosaic(struct receiver_data *d, const char *list)
+{
+	static char sources_str[PATH_MAX];
+	const char *sources[MOSAIC_MAX_STREAMS];
+	int i;
+
+	snprintf(sources_str, sizeof(sources_str), "%s", list);
+	d->n_mosaic = mosaic_parse_sources(sources_str, sources);
+	if (d->n_mosaic == 0) {
+		fprintf(stderr, "CAMERA_MOSAIC doesn't list any camera\n");
+		return false;
+	}
+
+	for (i = 0; i < d->n_mosaic; i++) {
+		struct mosaic_stream *stream = &d->mosaic[i];
+		struct pipeline_config *config = &stream->config;
+
+		stream->source = sources[i];
+		stream->stats = frame_stats_create();
+
+		memset(config, 0, sizeof(*config));
+		init_latency_mode(config);
+		config->add_queue = true;
+		d->capture_size_fixed = init_capture_size(config);
+
+		if (g_str_equal(stream->source, "test")) {
+			int fps;
+
+			config->source = PIPELINE_SOURCE_TEST;
+			if (!d->capture_size_fixed)
+				camera_target(d, &config->width, &config->height, &fps);
+			continue;
+		}
+
+		config->source = PIPELINE_SOURCE_V4L2;
+		config->device = stream->source;
+		config->io_mode = choose_v4l2_io_mode(d->window->display);
+		negotiate_camera_format(d, config);
+	}
+
+	fprintf(stdout, "Mosaic of %d cameras\n", d->n_mosaic);
+	return true;
+}
+
+/*
+ * Returns true if at least one camera started, the others are retried
+ * from update_mosaic().
+ */
+static bool
+start_mosaic(struct receiver_data *d)
+{
+	bool started = false;
+	int i;
+
+	layout_mosaic(d);
+	d->mosaic_waits_for_window = d->window->wait_for_configure;
+
+	for (i = 0; i < d->n_mosaic; i++) {
+		struct mosaic_stream *stream = &d->mosaic[i];
+
+		if (start_mosaic_stream(d, stream))
+			started = true;
+		else
+			stream->retry_at = g_get_monotonic_time() + CAMERA_RETRY_INTERVAL_US;
+	}
+
+	return started;
+}
+
+static void
+destroy_mosaic(struct receiver_data *d)
+{
+	int i;
+
+	for (i = 0; i < d->n_mosaic; i++) {
+		frame_stats_destroy(d->mosaic[i].stats);
+		if (d->mosaic[i].watchdog)
+			frame_watchdog_destroy(d->mosaic[i].watchdog);
+	}
+}
+
+/*
+ * The mosaic counterpart of update_pipelines(): cameras that fail are
+ * restarted every CAMERA_RETRY_INTERVAL_US on their own, the other
+ * tiles keep going.
+ */
+static void
+update_mosaic(struct receiver_data *d)
+{
+	struct window *window = d->window;
+	gint64 now = g_get_monotonic_time();
+	gint64 next_retry = 0;
+	int i;
+
+	if (d->mosaic_waits_for_window && !window->wait_for_configure &&
+	    !d->capture_suspended) {
+		d->mosaic_waits_for_window = false;
+		for (i = 0; i < d->n_mosaic; i++)
+			if (d->mosaic[i].pipeline)
+				gst_element_set_state(d->mosaic[i].pipeline,
+						      GST_STATE_PLAYING);
+	}
+
+	if (window->width != d->mosaic_width || window->height != d->mosaic_height)
+		layout_mosaic(d);
+
+	for (i = 0; i < d->n_mosaic; i++) {
+		struct mosaic_stream *stream = &d->mosaic[i];
+		enum frame_watchdog_failure failure;
+		gint64 failed_at;
+
+		// paused cameras send nothing
+		if (stream->watchdog && d->capture_suspended) {
+			frame_watchdog_reset(stream->watchdog);
+		} else if (stream->watchdog && stream->pipeline &&
+			   (failure = frame_watchdog_check(stream->watchdog, &failed_at))) {
+			fprintf(stdout, "Mosaic camera %d (%s) %s, detected in %.1f ms\n",
+				i, stream->source, frame_watchdog_failure_to_str(failure),
+				(g_get_monotonic_time() - failed_at) / 1000.0);
+			stream->failed = true;
+			stream->watchdog_failures++;
+		} else if (stream->watchdog_failures && stream->pipeline &&
+			   stream->shown_at &&
+			   now - stream->shown_at >= WATCHDOG_HEALTHY_US) {
+			stream->watchdog_failures = 0;
+		}
+
+		if (stream->failed) {
+			fprintf(stdout, "Mosaic camera %d (%s) failed, retrying\n",
+				i, stream->source);
+			stop_mosaic_stream(d, stream);
+			stream->failed = false;
+			stream->retry_at = now +
+				watchdog_retry_delay(stream->watchdog_failures);
+		}
+
+		if (!stream->pipeline && !d->capture_suspended &&
+		    now >= stream->retry_at) {
+			if (!mosaic_source_present(stream) ||
+			    !start_mosaic_stream(d, stream))
+				stream->retry_at = now + CAMERA_RETRY_INTERVAL_US;
+		}
+
+		if (!stream->pipeline &&
+		    (!next_retry || stream->retry_at < next_retry))
+			next_retry = stream->retry_at;
+
+		if (stream->shown_at && !stream->shown_reported) {
+			stream->shown_reported = true;
+			fprintf(stdout, "Mosaic camera %d (%s) showed its first frame "
+				"after %.1f ms\n", i, stream->source,
+				(stream->shown_at - stream->requested_at) / 1000.0);
+
+			if (!startup_stage_done(STARTUP_FIRST_FRAME)) {
+				startup_stage_end_at(STARTUP_FIRST_FRAME, stream->shown_at);
+				startup_timing_print(stdout);
+			}
+		}
+	}
+
+	if (!window->wait_for_configure && d->mosaic_needs_commit.exchange(false))
+		window_commit(window);
+
+	if (next_retry)
+		event_source_timer_update(d->retry_timer,
+					  MAX(1, (next_retry - now) / 1000));
+}
+
+static bool
+same_string(const char *a, const char *b)
+{
+	return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+/* everything but the caps filter is the same */
+static bool
+same_camera(const struct pipeline_config *a, const struct pipeline_config *b)
+{
+	return a->source == b->source && same_string(a->device, b->device) &&
+	       a->io_mode == b->io_mode && same_string(a->format, b->format) &&
+	       a->add_convert == b->add_convert;
+}
+
+static bool
+same_camera_settings(const struct pipeline_config *a,
+		     const struct pipeline_config *b)
+{
+	return same_camera(a, b) && a->width == b->width &&
+	       a->height == b->height && a->framerate_num == b->framerate_num &&
+	       a->framerate_den == b->framerate_den;
+}
+
+static void
+reconfig_finish(struct receiver_data *d, bool ok)
+{
+	struct camera_reconfig *reconfig = &d->reconfig;
+	gint64 shown_at = reconfig->in_place ? reconfig->shown_at.load() :
+					       d->camera_shown_at.load();
+	gint64 latency = shown_at - reconfig->requested_at;
+
+	reconfig->pending = false;
+	reconfig->armed = false;
+	event_source_timer_update(reconfig->timer, 0);
+
+	if (!ok) {
+		reconfig->failed++;
+		d->config = reconfig->previous;
+		fprintf(stderr, "Camera didn't take the new settings, going back\n");
+		if (reconfig->client)
+			control_reply(reconfig->client, "error the camera didn't "
+				      "take it, back to the previous settings");
+		reconfig->client = NULL;
+		return;
+	}
+
+	reconfig->done++;
+	reconfig->last_us = latency;
+	if (latency > reconfig->max_us)
+		reconfig->max_us = latency;
+
+	fprintf(stdout, "Camera reconfigured %s in %.1f ms\n",
+		reconfig->in_place ? "in place" : "with a new pipeline",
+		latency / 1000.0);
+	if (reconfig->client)
+		control_reply(reconfig->client, "ok %s in %.1f ms",
+			      reconfig->in_place ? "in-place" : "rebuilt",
+			      latency / 1000.0);
+	reconfig->client = NULL;
+}
+
+/*
+ * The new settings failed: bring the camera back the way it was, or
+ * the still image if that doesn't work either.
+ */
+static void
+reconfig_revert(struct receiver_data *d)
+{
+	reconfig_finish(d, false);
+
+	stop_camera_pipeline(d);
+	if (!start_camera_pipeline(d)) {
+		d->failed_at = g_get_monotonic_time();
+		switch_to_fallback(d);
+	}
+}
+
+static void
+reconfig_timer(void *data)
+{
+	// nothing to do, update_pipelines() runs after every dispatch
+	(void) data;
+}
+
+static void
+update_reconfig(struct receiver_data *d, gint64 now)
+{
+	struct camera_reconfig *reconfig = &d->reconfig;
+
+	if (reconfig->in_place ? reconfig->shown_at != 0 :
+				 d->pipeline && d->camera_shown_at != 0)
+		reconfig_finish(d, true);
+	else if (now - reconfig->requested_at >= CAMERA_RECONFIG_TIMEOUT_US)
+		reconfig_revert(d);
+}
+
+/*
+ * Only a different size or framerate keeps the pipeline: the caps filter
+ * is updated and the source renegotiates. Anything else, or a pipeline
+ * without a caps filter, gets a new pipeline, which still leaves the
+ * window, the still image and the rest alone.
+ */
+static void
+reconfigure_camera(struct receiver_data *d, struct control_client *client,
+		   const struct pipeline_config *config)
+{
+	struct camera_reconfig *reconfig = &d->reconfig;
+
+	if (reconfig->pending) {
+		control_reply(client, "error busy with the previous change");
+		return;
+	}
+
+	reconfig->pending = true;
+	reconfig->client = client;
+	reconfig->previous = d->config;
+	reconfig->requested_at = g_get_monotonic_time();
+	reconfig->in_place = d->pipeline && !d->on_fallback &&
+			     !d->pipeline_waits_for_window &&
+			     same_camera(config, &d->config);
+	event_source_timer_update(reconfig->timer,
+				  CAMERA_RECONFIG_TIMEOUT_US / 1000);
+
+	d->config = *config;
+
+	if (reconfig->in_place) {
+		reconfig->caps_seen = false;
+		reconfig->shown_at = 0;
+		reconfig->armed = true;
+		if (pipeline_update_caps(d->pipeline, &d->config))
+			return;
+
+		reconfig->armed = false;
+		reconfig->in_place = false;
+	}
+
+	stop_camera_pipeline(d);
+	if (!start_camera_pipeline(d))
+		reconfig_revert(d);
+}
+
+static void
+set_v4l2_source(struct receiver_data *d, struct pipeline_config *config,
+		const char *device)
+{
+	config->source = PIPELINE_SOURCE_V4L2;
+	config->device = device;
+	config->io_mode = choose_v4l2_io_mode(d->window->display);
+	if (d->capture_size_fixed && (config->width <= 0 || config->height <= 0))
+		init_capture_size(config);
+
+	negotiate_camera_format(d, config);
+}
+
+static void
+reply_stats(struct receiver_data *d, struct control_client *client)
+{
+	char *json = NULL;
+	size_t size = 0;
+	FILE *out;
+
+	out = open_memstream(&json, &size);
+	if (!out) {
+		control_reply(client, "error %s", strerror(errno));
+		return;
+	}
+
+	write_stats_json(d, out);
+	fclose(out);
+	control_reply(client, "%s", json);
+	free(json);
+}
+
+static void
+handle_record_command(struct receiver_data *d, struct control_client *client,
+		      const char *action)
+{
+	if (!d->recorder) {
+		control_reply(client, "error recording is off, set CAMERA_RECORD_DIR");
+	} else if (g_str_equal(action, "start")) {
+		recorder_start(d->recorder);
+		control_reply(client, "ok");
+	} else if (g_str_equal(action, "stop")) {
+		recorder_stop(d->recorder);
+		control_reply(client, "ok");
+	} else if (g_str_equal(action, "lock")) {
+		if (recorder_lock_segment(d->recorder))
+			control_reply(client, "ok");
+		else
+			control_reply(client, "error no segment to lock");
+	} else {
+		control_reply(client, "error record start, stop or lock");
+	}
+}
+
+/*
+ *   size WxH                      capture size
+ *   framerate N[/D]               capture framerate, 0 for any
+ *   device /dev/videoN            capture from another V4L2 device
+ *   source v4l2|pipewire|test     switch the source
+ *   stats                         the JSON stats, on one line
+ *   snapshot                      same as SIGUSR2
+ *   record start|stop|lock        same as SIGRTMIN and SIGRTMIN+1
+ *
+ * Camera changes are answered once the camera shows a frame with them,
+ * with how long that took.
+ */
+static void
+handle_control_command(struct control_client *client, int argc, char **argv,
+		       void *data)
+{
+	struct receiver_data *d = static_cast<struct receiver_data *>(data);
+	struct pipeline_config config = d->config;
+	const char *command = argv[0];
+	const struct camera_device *camera;
+
+	if (g_str_equal(command, "stats")) {
+		reply_stats(d, client);
+		return;
+	}
+
+	if (g_str_equal(command, "snapshot")) {
+		if (!d->snapshot) {
+			control_reply(client, "error snapshots are off, set CAMERA_SNAPSHOT");
+			return;
+		}
+		snapshot_request(d->snapshot);
+		control_reply(client, "ok");
+		return;
+	}
+
+	if (g_str_equal(command, "record") && argc == 2) {
+		handle_record_command(d, client, argv[1]);
+		return;
+	}
+
+	if (d->n_mosaic) {
+		control_reply(client, "error %s: not with CAMERA_MOSAIC", command);
+		return;
+	}
+
+	if (g_str_equal(command, "size") && argc == 2) {
+		if (sscanf(argv[1], "%dx%d", &config.width, &config.height) != 2 ||
+		    config.width <= 0 || config.height <= 0) {
+			control_reply(client, "error size WxH");
+			return;
+		}
+		// sticks with later device changes too
+		d->capture_size_fixed = true;
+	} else if (g_str_equal(command, "framerate") && argc == 2) {
+		config.framerate_den = 1;
+		if (sscanf(argv[1], "%d/%d", &config.framerate_num,
+			   &config.framerate_den) < 1 ||
+		    config.framerate_num < 0 || config.framerate_den <= 0) {
+			control_reply(client, "error framerate N[/D]");
+			return;
+		}
+		if (config.framerate_num == 0)
+			config.framerate_den = 0;
+		d->camera_fps = config.framerate_den ?
+			(config.framerate_num + config.framerate_den / 2) / config.framerate_den : 0;
+	} else if (g_str_equal(command, "device") && argc == 2) {
+		if (access(argv[1], F_OK) < 0) {
+			control_reply(client, "error %s: %s", argv[1], strerror(errno));
+			return;
+		}
+		// config.device has to outlive any pipeline built from it
+		set_v4l2_source(d, &config, g_intern_string(argv[1]));
+	} else if (g_str_equal(command, "source") && argc == 2 &&
+		   g_str_equal(argv[1], "v4l2")) {
+		camera = camera_device_list_first_capture(&d->cameras);
+		if (config.source == PIPELINE_SOURCE_V4L2) {
+			// already is
+		} else if (config.device) {
+			set_v4l2_source(d, &config, config.device);
+		} else if (camera) {
+			set_v4l2_source(d, &config, camera->path);
+		} else {
+			control_reply(client, "error no V4L2 camera known, use device");
+			return;
+		}
+	} else if (g_str_equal(command, "source") && argc == 2 &&
+		   (g_str_equal(argv[1], "pipewire") || g_str_equal(argv[1], "test"))) {
+		config.source = g_str_equal(argv[1], "test") ? PIPELINE_SOURCE_TEST :
+							       PIPELINE_SOURCE_PIPEWIRE;
+		config.format = NULL;
+		config.add_convert = false;
+	} else {
+		control_reply(client, "error unknown command; size WxH, framerate "
+			      "N[/D], device PATH, source v4l2|pipewire|test, "
+			      "stats, snapshot, record start|stop|lock");
+		return;
+	}
+
+	if (same_camera_settings(&config, &d->config)) {
+		control_reply(client, "ok unchanged");
+		return;
+	}
+
+	reconfigure_camera(d, client, &config);
+}
+
+static void
+handle_control_hangup(struct control_client *client, void *data)
+{
+	struct receiver_data *d = static_cast<struct receiver_data *>(data);
+
+	if (d->reconfig.client == client)
+		d->reconfig.client = NULL;
+}
+
+/*
+ * CAMERA_CONTROL_SOCKET, or camera-gstreamer.sock in XDG_RUNTIME_DIR,
+ * takes commands while running, see handle_control_command(). "off"
+ * turns it off.
+ */
+static void
+init_control(struct receiver_data *d)
+{
+	const char *path = getenv("CAMERA_CONTROL_SOCKET");
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	char default_path[PATH_MAX];
+
+	if (path && g_str_equal(path, "off"))
+		return;
+
+	if (!path) {
+		if (!dir)
+			return;
+		snprintf(default_path, sizeof(default_path), "%s/%s", dir,
+			 CONTROL_SOCKET);
+		path = default_path;
+	}
+
+	d->control = control_create(d->loop, path, handle_control_command,
+				    handle_control_hangup, d);
+	if (!d->control)
+		return;
+
+	d->reconfig.timer = event_loop_add_timer(d->loop, reconfig_timer, d);
+	fprintf(stdout, "Control socket at %s\n", path);
+}
+
+static void
+suspend_capture(struct receiver_data *d)
+{
+	int i;
+
+	if (d->hidden_state == GST_STATE_PLAYING)
+		return;
+
+	// a recording has to go on whether anyone watches or not
+	if (d->recorder && recorder_is_recording(d->recorder)) {
+		fprintf(stdout, "App hidden, the camera keeps running for the recording\n");
+		return;
+	}
+
+	fprintf(stdout, "App hidden, camera to %s\n",
+		gst_element_state_get_name(d->hidden_state));
+
+	d->capture_suspended = true;
+	d->visible_at = 0;
+	d->resume_armed = false;
+
+	// the ones still waiting for the window stay in PAUSED anyway
+	if (d->pipeline && !d->pipeline_waits_for_window)
+		gst_element_set_state(d->pipeline, d->hidden_state);
+
+	for (i = 0; i < d->n_mosaic; i++) {
+		struct mosaic_stream *stream = &d->mosaic[i];
+
+		stream->resume_armed = false;
+		if (stream->pipeline && !d->mosaic_waits_for_window)
+			gst_element_set_state(stream->pipeline, d->hidden_state);
+	}
+}
+
+static void
+resume_capture(struct receiver_data *d)
+{
+	int i;
+
+	if (!d->capture_suspended)
+		return;
+
+	d->capture_suspended = false;
+	d->visible_at = g_get_monotonic_time();
+
+	if (!d->n_mosaic) {
+		d->resumed_at = 0;
+		d->resume_armed = true;
+	}
+
+	if (d->pipeline && !d->pipeline_waits_for_window)
+		gst_element_set_state(d->pipeline, GST_STATE_PLAYING);
+
+	// cameras that went away in the meantime are retried right away
+	if (d->on_fallback && !d->pipeline)
+		schedule_camera_retry(d, 0);
+
+	for (i = 0; i < d->n_mosaic; i++) {
+		struct mosaic_stream *stream = &d->mosaic[i];
+
+		stream->resumed_at = 0;
+		stream->resume_armed = stream->pipeline != NULL;
+		stream->retry_at = 0;
+		if (stream->pipeline && !d->mosaic_waits_for_window)
+			gst_element_set_state(stream->pipeline, GST_STATE_PLAYING);
+	}
+}
+
+/* 0 until the camera, or every camera of the mosaic, is back */
+static gint64
+capture_resumed_at(struct receiver_data *d)
+{
+	gint64 resumed_at = 0;
+	int i;
+
+	if (!d->n_mosaic)
+		return d->resume_armed ? 0 : d->resumed_at.load();
+
+	for (i = 0; i < d->n_mosaic; i++) {
+		struct mosaic_stream *stream = &d->mosaic[i];
+
+		if (stream->resume_armed)
+			return 0;
+		resumed_at = MAX(resumed_at, stream->resumed_at.load());
+	}
+
+	// none of them came back, there's nothing to time
+	if (!resumed_at)
+		d->visible_at = 0;
+
+	return resumed_at;
+}
+
+/*
+ * Suspends the camera when the app gets hidden, for any of the
+ * visibility_reason, and resumes it once it's visible again.
+ */
+static void
+update_visibility(struct receiver_data *d)
+{
+	struct window *window = d->window;
+	bool changed = false;
+	gint64 resumed_at;
+
+	changed |= visibility_set(d->visibility, VISIBILITY_SHELL, d->shell_hidden);
+	changed |= visibility_set(d->visibility, VISIBILITY_SUSPENDED, window->suspended);
+	changed |= visibility_set(d->visibility, VISIBILITY_OCCLUDED, window->occluded);
+
+	if (changed && visibility_is_hidden(d->visibility))
+		suspend_capture(d);
+	else if (changed)
+		resume_capture(d);
+
+	if (d->visible_at && (resumed_at = capture_resumed_at(d))) {
+		fprintf(stdout, "App visible, camera resumed in %.1f ms\n",
+			(resumed_at - d->visible_at) / 1000.0);
+		visibility_resumed(d->visibility, d->visible_at, resumed_at);
+		d->visible_at = 0;
+	}
+}
+
+static void
+frame_callback_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	struct window *window = static_cast<struct window *>(data);
+
+	wl_callback_destroy(callback);
+	window->frame_callback = NULL;
+	window->occluded = false;
+}
+
+static const struct wl_callback_listener frame_callback_listener = {
+	frame_callback_done,
+};
+
+/*
+ * Every occlusion_probe_ms ask for a frame callback, with an otherwise
+ * empty commit. The compositor only sends it when it draws us, so one
+ * that doesn't come back by the next probe means we're not shown.
+ */
+static void
+occlusion_timer(void *data)
+{
+	struct receiver_data *d = static_cast<struct receiver_data *>(data);
+	struct window *window = d->window;
+
+	if (window->frame_callback) {
+		window->occluded = true;
+	} else if (!window->wait_for_configure) {
+		window->frame_callback = wl_surface_frame(window->surface);
+		wl_callback_add_listener(window->frame_callback,
+					 &frame_callback_listener, window);
+		window_commit(window);
+	}
+
+	event_source_timer_update(d->occlusion_timer, d->occlusion_probe_ms);
+}
+
+/*
+ * Runs on a gRPC thread, all it does is queue the event for the main
+ * loop; the app_id is copied into the record, so nothing is allocated.
+ */
+static void
+queue_app_state(const agl_shell_ipc::AppStateResponse &app_state, void *data)
+{
+	struct receiver_data *d = static_cast<struct receiver_data *>(data);
+	const std::string &app_id = app_state.app_id();
+	struct queued_event event;
+
+	event.type = QUEUED_EVENT_APP_STATE;
+	event.value = app_state.state();
+	queued_event_set_name(&event, app_id.data(), app_id.size());
+
+	if (!event_queue_push(d->events, &event))
+		fprintf(stderr, "Event queue full, app state of %s dropped\n",
+			event.name);
+}
+
+static void
+handle_app_state(struct receiver_data *d, const char *app_id, int state)
+{
+	if (!g_str_equal(app_id, APP_ID))
+		return;
+
+	// update_visibility() acts on it after the dispatch
+	if (state == APP_STATE_ACTIVATED)
+		d->shell_hidden = false;
+	else if (state == APP_STATE_DEACTIVATED)
+		d->shell_hidden = true;
+}
+
+static void
+handle_queued_event(const struct queued_event *event, void *data)
+{
+	struct receiver_data *d = static_cast<struct receiver_data *>(data);
+
+	switch (event->type) {
+	case QUEUED_EVENT_APP_STATE:
+		handle_app_state(d, event->name, event->value);
+		break;
+	}
+}
+
+/*
+ * Nobody sees the camera while the shell has deactivated us, the
+ * compositor suspended the toplevel or, with CAMERA_OCCLUSION_PROBE_MS,
+ * stopped sending frame callbacks. CAMERA_HIDDEN_STATE is where the
+ * pipelines go then: paused (the default) resumes fastest, ready also
+ * stops the camera streaming, playing keeps it running.
+ */
+static void
+init_visibility(struct receiver_data *d, GrpcClient *client)
+{
+	const char *state = getenv("CAMERA_HIDDEN_STATE");
+
+	d->hidden_state = GST_STATE_PAUSED;
+	if (state && g_str_equal(state, "ready"))
+		d->hidden_state = GST_STATE_READY;
+	else if (state && g_str_equal(state, "playing"))
+		d->hidden_state = GST_STATE_PLAYING;
+	else if (state && !g_str_equal(state, "paused"))
+		fprintf(stderr, "Unknown CAMERA_HIDDEN_STATE %s, using paused\n", state);
+
+	d->visibility = visibility_create();
+
+	d->events = event_queue_create(d->loop, EVENT_QUEUE_SIZE,
+				       handle_queued_event, d);
+	if (d->events)
+		client->AppStatusState(queue_app_state, d);
+	else
+		fprintf(stderr, "Not following the shell app state\n");
+
+	if (getenv("CAMERA_OCCLUSION_PROBE_MS"))
+		d->occlusion_probe_ms = atoi(getenv("CAMERA_OCCLUSION_PROBE_MS"));
+	if (d->occlusion_probe_ms > 0) {
+		d->occlusion_timer = event_loop_add_timer(d->loop, occlusion_timer, d);
+		event_source_timer_update(d->occlusion_timer, d->occlusion_probe_ms);
+	}
+}
+
+static void
+destroy_visibility(struct receiver_data *d, GrpcClient *client)
+{
+	if (!d->visibility)
+		return;
+
+	// nothing may be pushed past this point
+	client->StopAppStatusState();
+
+	if (d->events)
+		event_queue_destroy(d->events);
+	if (d->occlusion_timer)
+		event_source_remove(d->occlusion_timer);
+
+	visibility_destroy(d->visibility);
+	d->visibility = NULL;
+}
+
+/*
+ * CAMERA_WATCHDOG_FRAMES is how many frame intervals may go by without
+ * a frame (3 by default, 0 turns the watchdog off), CAMERA_FREEZE_FRAMES
+ * how many identical frames in a row make a frozen camera (0 by default,
+ * not checked: a dark or static scene can look frozen). Either way the
+ * camera goes as if it had failed.
+ */
+static void
+init_watchdog(struct receiver_data *d)
+{
+	struct frame_watchdog_config *config = &d->watchdog_config;
+	int i;
+
+	config->stall_frames = DEFAULT_WATCHDOG_FRAMES;
+	config->freeze_frames = 0;
+	if (getenv("CAMERA_WATCHDOG_FRAMES"))
+		config->stall_frames = atoi(getenv("CAMERA_WATCHDOG_FRAMES"));
+	if (getenv("CAMERA_FREEZE_FRAMES"))
+		config->freeze_frames = atoi(getenv("CAMERA_FREEZE_FRAMES"));
+	if (config->stall_frames <= 0)
+		return;
+
+	if (!d->n_mosaic)
+		d->watchdog = frame_watchdog_create(d->loop, config);
+	for (i = 0; i < d->n_mosaic; i++)
+		d->mosaic[i].watchdog = frame_watchdog_create(d->loop, config);
+}
+
+/*
+ * Called from the main loop after every dispatch: moves between the
+ * camera and the pre-rolled still image and reports how long each
+ * switch took.
+ */
+static void
+update_pipelines(struct receiver_data *d)
+{
+	gint64 now = g_get_monotonic_time();
+	enum frame_watchdog_failure failure;
+	gint64 failed_at;
+
+	if (d->visibility)
+		update_visibility(d);
+
+	if (d->n_mosaic) {
+		update_mosaic(d);
+		return;
+	}
+
+	if (d->standby_failed) {
+		fprintf(stderr, "Fallback pipeline failed, disabling it\n");
+		destroy_standby_pipeline(d);
+		d->standby_failed = false;
+	}
+
+	if (d->standby)
+		update_standby_size(d);
+
+	if (d->pipeline_failed) {
+		d->pipeline_failed = false;
+		if (d->reconfig.pending)
+			reconfig_revert(d);
+		else
+			switch_to_fallback(d);
+	}
+
+	// a paused camera sends nothing, and one taking new settings may
+	// take a while to restart; the reconfiguration has its own timeout
+	if (d->watchdog && (d->capture_suspended || d->reconfig.pending)) {
+		frame_watchdog_reset(d->watchdog);
+	} else if (d->watchdog && d->pipeline &&
+		   (failure = frame_watchdog_check(d->watchdog, &failed_at))) {
+		fprintf(stdout, "Camera %s, detected in %.1f ms\n",
+			frame_watchdog_failure_to_str(failure),
+			(g_get_monotonic_time() - failed_at) / 1000.0);
+		// the switch to the still image is timed from the failure
+		if (!d->on_fallback)
+			d->failed_at = failed_at;
+		switch_to_fallback(d);
+		// one that comes back no better is given more time each go
+		schedule_camera_retry(d, watchdog_retry_delay(++d->watchdog_failures));
+	} else if (d->watchdog_failures && !d->on_fallback && d->camera_shown_at &&
+		   now - d->camera_shown_at >= WATCHDOG_HEALTHY_US) {
+		d->watchdog_failures = 0;
+	}
+
+	if (d->reconfig.pending)
+		update_reconfig(d, now);
+
+	if (d->pipeline_waits_for_window && !d->window->wait_for_configure &&
+	    !d->capture_suspended) {
+		d->pipeline_waits_for_window = false;
+		gst_element_set_state(d->pipeline, GST_STATE_PLAYING);
+	}
+
+	if (!startup_stage_done(STARTUP_FIRST_FRAME)) {
+		if (!d->on_fallback && d->camera_shown_at) {
+			startup_stage_end_at(STARTUP_FIRST_FRAME, d->camera_shown_at);
+			startup_timing_print(stdout);
+		} else if (d->on_fallback && d->fallback_shown_at) {
+			fprintf(stdout, "First frame is the still image\n");
+			startup_stage_end_at(STARTUP_FIRST_FRAME, d->fallback_shown_at);
+			startup_timing_print(stdout);
+		}
+	}
+
+	// an error may come in from a streaming thread at any time
+	if (d->on_fallback && d->fallback_shown_at &&
+	    (failed_at = d->failed_at.exchange(0)))
+		fprintf(stdout, "Switched to the still image in %.1f ms\n",
+			(d->fallback_shown_at - failed_at) / 1000.0);
+
+	if (d->on_fallback && d->standby)
+		update_fallback_geometry(d);
+
+	// a missing node will be reported by the camera monitor when it
+	// comes back, no point in trying before that
+	if (d->on_fallback && !d->pipeline && !d->capture_suspended &&
+	    now >= d->camera_retry_at && camera_device_present(d)) {
+		if (!start_camera_pipeline(d))
+			schedule_camera_retry(d, CAMERA_RETRY_INTERVAL_US);
+	}
+
+	// keep the still image on screen until the camera really delivers,
+	// frames that change if it's checked for freezes
+	if (d->on_fallback && d->pipeline && d->camera_shown_at &&
+	    (!d->watchdog || frame_watchdog_delivering(d->watchdog)))
+		switch_to_camera(d);
+}
+
+/*
+ * Called by the camera monitor for /dev/videoN nodes. Losing the node we
+ * capture from switches to the still image right away, without waiting
+ * for the pipeline to error out; a new node makes us retry the camera.
+ */
+static void
+mosaic_hotplug(struct receiver_data *d, const char *path, bool added)
+{
+	int i;
+
+	for (i = 0; i < d->n_mosaic; i++) {
+		struct mosaic_stream *stream = &d->mosaic[i];
+
+		if (stream->config.source != PIPELINE_SOURCE_V4L2 ||
+		    strcmp(path, stream->config.device) != 0)
+			continue;
+
+		if (!added && stream->pipeline) {
+			fprintf(stdout, "Mosaic camera %d (%s) was removed\n",
+				i, stream->source);
+			stream->failed = true;
+		} else if (added && !stream->pipeline) {
+			stream->retry_at = 0;
+		}
+	}
+}
+
+/* waits for the thread, it's done or about to be */
+static void
+end_camera_rediscovery(struct receiver_data *d)
+{
+	if (!d->rediscovery_source)
+		return;
+
+	d->rediscovery_thread.join();
+	event_source_remove(d->rediscovery_source);
+	close(d->rediscovery_fd);
+	d->rediscovery_source = NULL;
+}
+
+static void
+start_camera_rediscovery(struct receiver_data *d);
+
+static void
+rediscovery_handle_data(int fd, uint32_t mask, void *data)
+{
+	struct receiver_data *d = static_cast<struct receiver_data *>(data);
+	const char *device;
+
+	end_camera_rediscovery(d);
+
+	// more nodes came and went while probing
+	if (d->rediscovery_again) {
+		start_camera_rediscovery(d);
+		return;
+	}
+
+	// the camera came back or got replaced meanwhile
+	if (!d->on_fallback || camera_device_present(d))
+		return;
+
+	// the list config.device pointed into is rewritten here
+	d->cameras = d->rediscovered;
+	device = choose_camera_device(d);
+	d->config.device = device;
+	if (!device)
+		return;
+
+	// a different camera, start over with the best capture path
+	d->config.io_mode = choose_v4l2_io_mode(d->window->display);
+	negotiate_camera_format(d, &d->config);
+
+	fprintf(stdout, "Retrying the camera with %s\n", device);
+	schedule_camera_retry(d, 0);
+}
 
-	gst_element_set_state(receiver_data.pipeline, GST_STATE_PLAYING);
-	fprintf(stdout, "gstreamer pipeline running\n");
+/*
+ * Probing the nodes can take up to CAMERA_PROBE_TIMEOUT_MS, so it runs
+ * on a thread of its own that wakes the loop through an eventfd once
+ * the list is in d->rediscovered. Hotplugs in the meantime make it
+ * start over when it's done.
+ */
+static void
+start_camera_rediscovery(struct receiver_data *d)
+{
+	int fd;
+
+	if (d->rediscovery_source) {
+		d->rediscovery_again = true;
+		return;
+	}
+
+	fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't create the rediscovery eventfd: %s\n",
+			strerror(errno));
+		return;
+	}
+
+	d->rediscovery_source = event_loop_add_fd(d->loop, fd, EVENT_READABLE,
+						  rediscovery_handle_data, d);
+	if (!d->rediscovery_source) {
+		close(fd);
+		return;
+	}
+
+	d->rediscovery_fd = fd;
+	d->rediscovery_again = false;
+	d->rediscovery_thread = std::thread([d, fd]() {
+		struct camera_discovery *discovery;
+		uint64_t done = 1;
+
+		discovery = camera_discovery_start(CAMERA_PROBE_TIMEOUT_MS);
+		camera_discovery_finish(discovery, &d->rediscovered);
+
+		if (write(fd, &done, sizeof(done)) < 0)
+			fprintf(stderr, "Couldn't wake up the event loop: %s\n",
+				strerror(errno));
+	});
+}
+
+static void
+camera_hotplug(const char *path, bool added, void *data)
+{
+	struct receiver_data *d = static_cast<struct receiver_data *>(data);
+
+	if (d->n_mosaic) {
+		mosaic_hotplug(d, path, added);
+		return;
+	}
+
+	if (d->config.source != PIPELINE_SOURCE_V4L2)
+		return;
+
+	if (!added) {
+		if (!d->on_fallback && d->config.device &&
+		    strcmp(path, d->config.device) == 0) {
+			fprintf(stdout, "Camera %s was removed\n", path);
+			d->failed_at = g_get_monotonic_time();
+			switch_to_fallback(d);
+		}
+		return;
+	}
+
+	if (!d->on_fallback)
+		return;
+
+	// the device we had went away, see if there's a new best one; the
+	// camera is retried once that's known
+	if (!d->camera_from_env && !camera_device_present(d)) {
+		fprintf(stdout, "Video node %s appeared, looking for the best camera\n",
+			path);
+		start_camera_rediscovery(d);
+		return;
+	}
+
+	fprintf(stdout, "Video node %s appeared, retrying the camera\n", path);
+	schedule_camera_retry(d, 0);
+}
+
+static void
+camera_monitor_handle_data(int fd, uint32_t mask, void *data)
+{
+	camera_monitor_dispatch(static_cast<struct camera_monitor *>(data));
+}
+
+static void
+display_handle_data(int fd, uint32_t mask, void *data)
+{
+	struct display *display = static_cast<struct display *>(data);
+
+	if (!display->read_prepared)
+		return;
+
+	display->read_prepared = false;
+
+	if (mask & EVENT_READABLE) {
+		if (wl_display_read_events(display->wl_display) < 0)
+			display->read_failed = true;
+	} else {
+		wl_display_cancel_read(display->wl_display);
+		if (mask & (EVENT_HANGUP | EVENT_ERROR))
+			display->read_failed = true;
+	}
+}
+
+/*
+ * Sleep until something happens on any of the sources of the loop:
+ * the Wayland connection, the GStreamer buses, signals, hotplug and
+ * timers, then dispatch it. Returns -1 if the Wayland connection broke.
+ */
+static int
+dispatch_events(struct receiver_data *d)
+{
+	struct display *display = d->window->display;
+	struct wl_display *wl_display = display->wl_display;
+	int ret;
+
+	while (wl_display_prepare_read(wl_display) != 0)
+		wl_display_dispatch_pending(wl_display);
+
+	wl_display_flush(wl_display);
+	display->read_prepared = true;
+
+	ret = event_loop_dispatch(d->loop, -1);
+
+	// woken up by something else than the Wayland fd
+	if (display->read_prepared) {
+		wl_display_cancel_read(wl_display);
+		display->read_prepared = false;
+	}
+
+	if (ret < 0 || display->read_failed)
+		return -1;
+
+	return wl_display_dispatch_pending(wl_display);
+}
+
+/* "X,Y" or "WxH" in @arg, if there's one */
+static bool
+parse_pair(int argc, char *argv[], int i, const char *format, int *a, int *b)
+{
+	return i < argc && sscanf(argv[i], format, a, b) == 2;
+}
+
+/*
+ * Where the shell should put the window, from the command line, e.g.
+ * `camera-gstreamer float 30,400 scale 640x480 activate HDMI-A-1`:
+ *
+ *   float [X,Y]      float, at 30,400 unless given
+ *   normal           back in the shell's layout
+ *   fullscreen
+ *   position X,Y
+ *   scale WxH
+ *   output NAME      start on that output
+ *   activate [NAME]  show up once placed, on NAME if given
+ *
+ * All of it goes to the shell as one batch. Returns false on anything
+ * else.
+ */
+static bool
+parse_layout_args(int argc, char *argv[], LayoutTransaction *layout)
+{
+	int i, a, b;
+
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+
+		if (g_str_equal(arg, "float")) {
+			if (parse_pair(argc, argv, i + 1, "%d,%d", &a, &b))
+				i++;
+			else
+				a = 30, b = 400;
+			layout->Float(a, b);
+		} else if (g_str_equal(arg, "normal")) {
+			layout->Normal();
+		} else if (g_str_equal(arg, "fullscreen")) {
+			layout->Fullscreen();
+		} else if (g_str_equal(arg, "position") &&
+			   parse_pair(argc, argv, i + 1, "%d,%d", &a, &b)) {
+			layout->Position(a, b);
+			i++;
+		} else if (g_str_equal(arg, "scale") &&
+			   parse_pair(argc, argv, i + 1, "%dx%d", &a, &b)) {
+			layout->Scale(a, b);
+			i++;
+		} else if (g_str_equal(arg, "output") && i + 1 < argc) {
+			layout->Output(argv[++i]);
+		} else if (g_str_equal(arg, "activate")) {
+			// a following keyword isn't an output name
+			if (i + 1 < argc && !strchr(argv[i + 1], ',') &&
+			    !g_str_equal(argv[i + 1], "float") &&
+			    !g_str_equal(argv[i + 1], "normal") &&
+			    !g_str_equal(argv[i + 1], "fullscreen") &&
+			    !g_str_equal(argv[i + 1], "position") &&
+			    !g_str_equal(argv[i + 1], "scale") &&
+			    !g_str_equal(argv[i + 1], "output"))
+				layout->Activate(argv[++i]);
+			else
+				layout->Activate("");
+		} else {
+			fprintf(stderr, "Unknown argument %s\n", arg);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * CAMERA_SHELL_ADDRESS is where the shell's gRPC server listens,
+ * host:port or unix:/path, which spares the loopback TCP stack.
+ * CAMERA_SHELL_KEEPALIVE_MS sets the keepalive ping interval, 0 turns
+ * the pings off.
+ */
+static GrpcClient *
+create_shell_client(void)
+{
+	const char *address = getenv("CAMERA_SHELL_ADDRESS");
+	int keepalive_ms = GRPC_DEFAULT_KEEPALIVE_MS;
+
+	if (getenv("CAMERA_SHELL_KEEPALIVE_MS"))
+		keepalive_ms = atoi(getenv("CAMERA_SHELL_KEEPALIVE_MS"));
+
+	return new GrpcClient(address ? address : SHELL_ADDRESS,
+			      GRPC_DEFAULT_DEADLINE_MS, keepalive_ms);
+}
+
+int main(int argc, char* argv[])
+{
+	int ret = 0;
+	sigset_t signal_mask;
+	gint64 loop_started_at;
+	uint32_t loop_commits;
+	double run_time;
+	struct shm_pool_stats pool_stats;
+	struct receiver_data receiver_data = {};
+	struct display* display;
+	struct window* window;
+	GrpcClient *client;
+	std::future<bool> shell_connected;
+	LayoutTransaction layout(APP_ID);
+	std::future<grpc::Status> layout_set;
+	struct camera_discovery *discovery = NULL;
+	int gargc = 2;
+	char **gargv = NULL;
+	std::thread gst_init_thread;
+	bool camera_started;
+	const char *mosaic_list = getenv("CAMERA_MOSAIC");
+
+	startup_timing_init();
+
+	// signals are read from a signalfd in the main loop, they have to
+	// be blocked before any thread starts so that all of them inherit
+	// the mask, gRPC included
+	sigemptyset(&signal_mask);
+	sigaddset(&signal_mask, SIGINT);
+	sigaddset(&signal_mask, SIGTERM);
+	sigaddset(&signal_mask, SIGUSR1);
+	sigaddset(&signal_mask, SIGUSR2);
+	sigaddset(&signal_mask, SIGRTMIN);
+	sigaddset(&signal_mask, SIGRTMIN + 1);
+	sigprocmask(SIG_BLOCK, &signal_mask, NULL);
+
+	// the shell channel connects in the background from the start, so
+	// none of the calls below pays for it
+	startup_stage_begin(STARTUP_SHELL_CONNECT);
+	client = create_shell_client();
+	shell_connected = std::async(std::launch::async, [client]() {
+		if (!client->WaitForConnected(SHELL_CONNECT_TIMEOUT_MS))
+			return false;
+		startup_stage_end(STARTUP_SHELL_CONNECT);
+		return true;
+	});
+
+	// for starting the application from the beginning, with a diffrent
+	// role we need to handle that creating the main window; the calls
+	// run while we set up the rest and are waited for before the window
+	// gets created
+	if (!parse_layout_args(argc, argv, &layout)) {
+		fprintf(stderr, "usage: %s [float [X,Y]] [normal] [fullscreen] "
+			"[position X,Y] [scale WxH] [output NAME] [activate [NAME]]\n",
+			argv[0]);
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+	if (layout.Calls()) {
+		startup_stage_begin(STARTUP_SHELL_LAYOUT);
+		layout_set = client->ApplyLayoutAsync(layout);
+	}
+
+	// probing the video nodes runs in the background while GStreamer
+	// and the Wayland connection come up
+	if (!getenv("DEFAULT_V4L2_DEVICE") && !mosaic_list) {
+		startup_stage_begin(STARTUP_DISCOVERY);
+		discovery = camera_discovery_start(CAMERA_PROBE_TIMEOUT_MS);
+	}
+
+	gargv = static_cast<char**>(calloc(2, sizeof(char*)));
+
+	gargv[0] = strdup(argv[0]);
+	gargv[1] = strdup("--gst-debug-level=2");
+
+	setbuf(stdout, NULL);
+
+	// the plugin registry scan doesn't need anything from us, nothing
+	// GStreamer related may be touched until the thread is joined
+	startup_stage_begin(STARTUP_GST_INIT);
+	gst_init_thread = std::thread([&gargc, &gargv]() {
+		gst_init(&gargc, &gargv);
+		startup_stage_end(STARTUP_GST_INIT);
+	});
+
+	// the display is needed first to learn if we can import dmabufs
+	startup_stage_begin(STARTUP_WAYLAND);
+	display = create_display(argc, argv);
+	if (!display) {
+		ret = -1;
+		goto out;
+	}
+	startup_stage_end(STARTUP_WAYLAND);
+
+	// bounded by the gRPC deadline, for all the calls together
+	if (layout_set.valid()) {
+		if (!layout_set.get().ok())
+			fprintf(stderr, "Couldn't get the shell to place the window\n");
+		startup_stage_end(STARTUP_SHELL_LAYOUT);
+	}
+
+	// we use the role to set a correspondence between the top level
+	// surface and our application, with the previous call letting the
+	// compositor know that we're one and the same; the first configure
+	// arrives once we're in the main loop
+	startup_stage_begin(STARTUP_WINDOW);
+	window = create_window(display, WINDOW_WIDTH_SIZE, WINDOW_HEIGHT_SIZE, APP_ID);
+
+	if (!window) {
+		ret = EXIT_FAILURE;
+		goto out_display;
+	}
+
+	window->display = display;
+	receiver_data.window = window;
+
+	receiver_data.loop = event_loop_create();
+	if (!receiver_data.loop) {
+		ret = EXIT_FAILURE;
+		goto out_window;
+	}
+
+	event_loop_add_fd(receiver_data.loop, wl_display_get_fd(display->wl_display),
+			  EVENT_READABLE, display_handle_data, display);
+	event_loop_add_signal(receiver_data.loop, SIGINT, handle_signal, NULL);
+	event_loop_add_signal(receiver_data.loop, SIGTERM, handle_signal, NULL);
+	event_loop_add_signal(receiver_data.loop, SIGUSR1, handle_dump_signal,
+			      &receiver_data);
+	event_loop_add_signal(receiver_data.loop, SIGUSR2, handle_snapshot_signal,
+			      &receiver_data);
+	event_loop_add_signal(receiver_data.loop, SIGRTMIN, handle_record_signal,
+			      &receiver_data);
+	event_loop_add_signal(receiver_data.loop, SIGRTMIN + 1, handle_record_signal,
+			      &receiver_data);
+
+	receiver_data.frame_stats = frame_stats_create();
+	receiver_data.stats_interval_s = DEFAULT_STATS_INTERVAL_S;
+	if (getenv("CAMERA_STATS_INTERVAL"))
+		receiver_data.stats_interval_s = atoi(getenv("CAMERA_STATS_INTERVAL"));
+	if (receiver_data.stats_interval_s > 0) {
+		receiver_data.stats_timer = event_loop_add_timer(receiver_data.loop,
+								 stats_timer,
+								 &receiver_data);
+		event_source_timer_update(receiver_data.stats_timer,
+					  receiver_data.stats_interval_s * 1000);
+	}
+	receiver_data.retry_timer = event_loop_add_timer(receiver_data.loop,
+							 camera_retry_timer,
+							 &receiver_data);
+
+	startup_stage_begin(STARTUP_CONFIG);
+	if (mosaic_list) {
+		if (!init_mosaic(&receiver_data, mosaic_list)) {
+			ret = EXIT_FAILURE;
+			goto out_receiver;
+		}
+	} else {
+		init_pipeline_config(&receiver_data, discovery);
+	}
+	if (discovery) {
+		// finished by picking the camera
+		startup_stage_end(STARTUP_DISCOVERY);
+		discovery = NULL;
+	}
+	startup_stage_end(STARTUP_CONFIG);
+
+	gst_init_thread.join();
+
+	if (!receiver_data.n_mosaic) {
+		init_snapshot(&receiver_data);
+		init_recording(&receiver_data);
+	}
+	init_control(&receiver_data);
+	init_watchdog(&receiver_data);
+
+	// the shell reports when another app takes our place
+	init_visibility(&receiver_data, client);
+
+	/* Initialise damage to full surface, so the padding gets painted */
+	wl_surface_damage(window->surface, 0, 0,
+			  window->width, window->height);
+
+	if (!window->wait_for_configure) {
+		redraw(window);
+	}
+
+	// waylandsink asks for the display handle while the pipeline gets
+	// validated, so this needs the window to be in place; the camera
+	// goes first, the still image is only needed if it fails
+	startup_stage_begin(STARTUP_PIPELINE);
+	if (receiver_data.n_mosaic)
+		camera_started = start_mosaic(&receiver_data);
+	else
+		camera_started = start_camera_pipeline(&receiver_data);
+	startup_stage_end(STARTUP_PIPELINE);
+	startup_stage_begin(STARTUP_FIRST_FRAME);
+
+	// the mosaic leaves the tile of a missing camera black
+	if (!receiver_data.n_mosaic) {
+		startup_stage_begin(STARTUP_STANDBY);
+		create_standby_pipeline(&receiver_data);
+		startup_stage_end(STARTUP_STANDBY);
+	}
+
+	if (camera_started) {
+		fprintf(stdout, "gstreamer pipeline running\n");
+	} else if (receiver_data.n_mosaic) {
+		fprintf(stdout, "None of the mosaic cameras started yet, retrying\n");
+	} else if (receiver_data.standby) {
+		receiver_data.failed_at = g_get_monotonic_time();
+		switch_to_fallback(&receiver_data);
+	} else {
+		ret = EXIT_FAILURE;
+		goto out_receiver;
+	}
+
+	// the control socket can switch to a V4L2 camera later on
+	if (receiver_data.config.source == PIPELINE_SOURCE_V4L2 ||
+	    receiver_data.n_mosaic || receiver_data.control)
+		receiver_data.monitor = camera_monitor_create(camera_hotplug,
+							      &receiver_data);
+	if (receiver_data.monitor)
+		receiver_data.monitor_source =
+			event_loop_add_fd(receiver_data.loop,
+					  camera_monitor_get_fd(receiver_data.monitor),
+					  EVENT_READABLE, camera_monitor_handle_data,
+					  receiver_data.monitor);
 
 	// run the application
+	loop_started_at = g_get_monotonic_time();
+	loop_commits = window->commits;
+
 	while (running && ret != -1) {
-		ret = wl_display_dispatch(display->wl_display);
-		if (gst_pipeline_failed && fallback_gst_pipeline_tried == FALSE) {
-			gst_element_set_state(receiver_data.pipeline, GST_STATE_NULL);
-			gst_object_unref(receiver_data.pipeline);
-			/* retry with fallback pipeline */
-			receiver_data.pipeline = create_pipeline(&gargc, &gargv);
-			GstBus *bus = gst_element_get_bus(receiver_data.pipeline);
-			gst_bus_add_signal_watch(bus);
-			g_signal_connect(bus, "message::error", G_CALLBACK(error_cb), &receiver_data);
-			gst_bus_set_sync_handler(bus, bus_sync_handler, &receiver_data, NULL);
-			gst_object_unref(bus);
-			gst_element_set_state(receiver_data.pipeline, GST_STATE_PLAYING);
-		}
+		ret = dispatch_events(&receiver_data);
+		update_pipelines(&receiver_data);
 	}
-	gst_element_set_state(receiver_data.pipeline, GST_STATE_NULL);
-	gst_object_unref(receiver_data.pipeline);
 
+	run_time = (g_get_monotonic_time() - loop_started_at) / 1000000.0;
+	fprintf(stdout, "Window committed %u times in %.1f s (%.2f/s)\n",
+		window->commits - loop_commits, run_time,
+		run_time > 0 ? (window->commits - loop_commits) / run_time : 0);
+
+	shm_pool_get_stats(window->pool, &pool_stats);
+	fprintf(stdout, "shm pool: %zu B, %u files, %u resizes, %u maps, "
+		"%u buffers created, %u reused, %u destroyed\n",
+		pool_stats.size, pool_stats.files_created,
+		pool_stats.file_resizes, pool_stats.maps,
+		pool_stats.buffers_created, pool_stats.buffers_reused,
+		pool_stats.buffers_destroyed);
+
+	if (receiver_data.monitor) {
+		event_source_remove(receiver_data.monitor_source);
+		camera_monitor_destroy(receiver_data.monitor);
+	}
+	end_camera_rediscovery(&receiver_data);
+
+	stop_camera_pipeline(&receiver_data);
+	destroy_standby_pipeline(&receiver_data);
+	for (int i = 0; i < receiver_data.n_mosaic; i++)
+		stop_mosaic_stream(&receiver_data, &receiver_data.mosaic[i]);
+
+	dump_stats(&receiver_data);
+out_receiver:
+	destroy_visibility(&receiver_data, client);
+	frame_stats_destroy(receiver_data.frame_stats);
+	if (receiver_data.watchdog)
+		frame_watchdog_destroy(receiver_data.watchdog);
+	destroy_mosaic(&receiver_data);
+	if (receiver_data.snapshot)
+		snapshot_destroy(receiver_data.snapshot);
+	if (receiver_data.recorder)
+		recorder_destroy(receiver_data.recorder);
+	if (receiver_data.control)
+		control_destroy(receiver_data.control);
+
+	event_loop_destroy(receiver_data.loop);
+out_window:
 	destroy_window(window);
+out_display:
 	destroy_display(display);
+out:
+	// the error paths may leave these behind
+	if (gst_init_thread.joinable())
+		gst_init_thread.join();
+	if (discovery)
+		camera_discovery_finish(discovery, &receiver_data.cameras);
+	if (layout_set.valid())
+		layout_set.wait();
+
+	// the connect wait still uses the client, it mustn't hold up the
+	// exit for the whole timeout
+	client->StopAppStatusState();
+	client->CancelWaitForConnected();
+	shell_connected.wait();
+	delete client;
 	free(gargv);
 
 	return ret;
@@ -0,0 +1,54 @@
+#include <cstdio>
+#include <cstring>
+
+#include "mosaic.h"
+
+int
+mosaic_parse_sources(char *list, const char *sources[MOSAIC_MAX_STREAMS])
+{
+	char *saveptr = NULL;
+	char *source;
+	int count = 0;
+
+	for (source = strtok_r(list, ",", &saveptr); source;
+	     source = strtok_r(NULL, ",", &saveptr)) {
+		if (count == MOSAIC_MAX_STREAMS) {
+			fprintf(stderr, "Only %d cameras fit in the mosaic, ignoring %s\n",
+				MOSAIC_MAX_STREAMS, source);
+			continue;
+		}
+
+		sources[count++] = source;
+	}
+
+	return count;
+}
+
+void
+mosaic_layout(int count, int x, int y, int width, int height,
+	      struct mosaic_tile *tiles)
+{
+	int columns = 1;
+	int rows;
+	int i;
+
+	if (count <= 0)
+		return;
+
+	while (columns * columns < count)
+		columns++;
+	rows = (count + columns - 1) / columns;
+
+	// the last column and row take the rounding leftovers
+	for (i = 0; i < count; i++) {
+		int column = i % columns;
+		int row = i / columns;
+		int left = column * width / columns;
+		int top = row * height / rows;
+
+		tiles[i].x = x + left;
+		tiles[i].y = y + top;
+		tiles[i].width = (column + 1) * width / columns - left;
+		tiles[i].height = (row + 1) * height / rows - top;
+	}
+}
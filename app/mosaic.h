@@ -0,0 +1,28 @@
+#ifndef __MOSAIC_H
+#define __MOSAIC_H
+
+/* surround view, e.g. front, rear and both sides */
+#define MOSAIC_MAX_STREAMS	4
+
+struct mosaic_tile {
+	int x, y;
+	int width, height;
+};
+
+/*
+ * Splits @list, comma separated V4L2 device paths or "test" for a
+ * videotestsrc, into @sources. The strings point into @list, which gets
+ * modified. Returns how many there are, extra ones are ignored.
+ */
+int
+mosaic_parse_sources(char *list, const char *sources[MOSAIC_MAX_STREAMS]);
+
+/*
+ * Splits the @width x @height area at @x, @y into a grid of @count
+ * tiles, as square as it gets, filled row by row.
+ */
+void
+mosaic_layout(int count, int x, int y, int width, int height,
+	      struct mosaic_tile *tiles);
+
+#endif
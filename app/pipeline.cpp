@@ -0,0 +1,877 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdarg>
+
+#include <atomic>
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+#include "pipeline.h"
+
+#define PIPELINE_MAX_ELEMENTS	8
+
+#define PIPELINE_PROBES_KEY	"camera-pipeline-probes"
+
+/* counted by pad probes, the rest comes from the elements themselves */
+struct pipeline_probes {
+	std::atomic<guint64> captured;
+	std::atomic<guint64> queue_in;
+	std::atomic<guint64> queue_out;
+};
+
+const char *
+pipeline_source_type_to_str(enum pipeline_source_type source)
+{
+	switch (source) {
+	case PIPELINE_SOURCE_V4L2:
+		return "v4l2";
+	case PIPELINE_SOURCE_STILL_IMAGE:
+		return "still-image";
+	case PIPELINE_SOURCE_IMAGE_FILE:
+		return "image-file";
+	case PIPELINE_SOURCE_TEST:
+		return "test";
+	case PIPELINE_SOURCE_PIPEWIRE:
+	default:
+		return "pipewire";
+	}
+}
+
+const char *
+v4l2_io_mode_to_str(enum v4l2_io_mode mode)
+{
+	switch (mode) {
+	case V4L2_IO_MODE_DMABUF:
+		return "dmabuf";
+	case V4L2_IO_MODE_MMAP:
+	default:
+		return "mmap";
+	}
+}
+
+static const char *
+pipeline_sink_name(const struct pipeline_config *config)
+{
+	return config->sink ? config->sink : "waylandsink";
+}
+
+static bool
+pipeline_has_size(const struct pipeline_config *config)
+{
+	return config->width > 0 && config->height > 0;
+}
+
+static bool
+pipeline_has_framerate(const struct pipeline_config *config)
+{
+	return config->framerate_num > 0 && config->framerate_den > 0;
+}
+
+static bool
+pipeline_has_caps_filter(const struct pipeline_config *config)
+{
+	return pipeline_has_size(config) || pipeline_has_framerate(config) ||
+	       config->format;
+}
+
+static bool
+pipeline_has_convert(const struct pipeline_config *config)
+{
+	return config->source == PIPELINE_SOURCE_IMAGE_FILE;
+}
+
+static bool
+pipeline_has_queue(const struct pipeline_config *config)
+{
+	return config->add_queue || config->latency == PIPELINE_LATENCY_LOW;
+}
+
+static int
+pipeline_queue_size(const struct pipeline_config *config)
+{
+	return config->queue_size > 0 ? config->queue_size :
+					PIPELINE_LOW_LATENCY_QUEUE_SIZE;
+}
+
+static int
+pipeline_snapshot_ring(const struct pipeline_config *config)
+{
+	return config->snapshot_ring > 0 ? config->snapshot_ring :
+					   PIPELINE_SNAPSHOT_RING_SIZE;
+}
+
+static int
+pipeline_record_segment_s(const struct pipeline_config *config)
+{
+	return config->record_segment_s > 0 ? config->record_segment_s :
+					      PIPELINE_RECORD_SEGMENT_S;
+}
+
+static int
+pipeline_record_bitrate(const struct pipeline_config *config)
+{
+	return config->record_bitrate_kbps > 0 ? config->record_bitrate_kbps :
+						 PIPELINE_RECORD_BITRATE_KBPS;
+}
+
+/* x264enc if we have it, openh264enc otherwise, NULL if neither */
+static const char *
+pipeline_record_encoder(void)
+{
+	static const char *encoders[] = { "x264enc", "openh264enc" };
+	GstElementFactory *factory;
+
+	for (const char *name : encoders) {
+		factory = gst_element_factory_find(name);
+		if (factory) {
+			gst_object_unref(factory);
+			return name;
+		}
+	}
+
+	return NULL;
+}
+
+static bool
+pipeline_has_record_branch(const struct pipeline_config *config)
+{
+	return config->add_record_tap && pipeline_record_encoder();
+}
+
+static bool
+pipeline_has_tee(const struct pipeline_config *config)
+{
+	return config->add_snapshot_tap || pipeline_has_record_branch(config);
+}
+
+static int
+pipeline_max_lateness_ms(const struct pipeline_config *config)
+{
+	return config->max_lateness_ms > 0 ? config->max_lateness_ms :
+					     PIPELINE_LOW_LATENCY_MAX_LATENESS_MS;
+}
+
+static void
+str_append(char *str, size_t size, const char *fmt, ...)
+{
+	size_t len = strlen(str);
+	va_list args;
+
+	if (len >= size - 1)
+		return;
+
+	va_start(args, fmt);
+	vsnprintf(str + len, size - len, fmt, args);
+	va_end(args);
+}
+
+/*
+ * Print the pipeline in gst-launch syntax, only used for logging.
+ */
+void
+pipeline_config_describe(const struct pipeline_config *config,
+			 char *str, size_t size)
+{
+	if (size == 0)
+		return;
+
+	str[0] = '\0';
+
+	switch (config->source) {
+	case PIPELINE_SOURCE_V4L2:
+		str_append(str, size, "v4l2src device=%s io-mode=%s",
+			   config->device, v4l2_io_mode_to_str(config->io_mode));
+		break;
+	case PIPELINE_SOURCE_STILL_IMAGE: {
+		gchar *caps = gst_caps_to_string(gst_sample_get_caps(config->still_image));
+
+		str_append(str, size, "appsrc caps=%s", caps);
+		g_free(caps);
+		break;
+	}
+	case PIPELINE_SOURCE_IMAGE_FILE:
+		str_append(str, size, "filesrc location=%s ! decodebin ! "
+			   "videoconvert ! videoscale", config->location);
+		break;
+	case PIPELINE_SOURCE_TEST:
+		str_append(str, size, "videotestsrc is-live=true");
+		break;
+	case PIPELINE_SOURCE_PIPEWIRE:
+		str_append(str, size, "pipewiresrc");
+		break;
+	}
+
+	if (pipeline_has_caps_filter(config)) {
+		str_append(str, size, " ! video/x-raw");
+		if (config->format)
+			str_append(str, size, ",format=%s", config->format);
+		if (pipeline_has_size(config))
+			str_append(str, size, ",width=%d,height=%d",
+				   config->width, config->height);
+		if (pipeline_has_framerate(config))
+			str_append(str, size, ",framerate=%d/%d",
+				   config->framerate_num, config->framerate_den);
+	}
+	if (pipeline_has_tee(config))
+		str_append(str, size, " ! tee name=t");
+	if (config->latency == PIPELINE_LATENCY_LOW)
+		str_append(str, size, " ! queue max-size-buffers=%d "
+			   "max-size-bytes=0 max-size-time=0 leaky=downstream",
+			   pipeline_queue_size(config));
+	else if (config->add_queue)
+		str_append(str, size, " ! queue");
+	if (config->add_convert && !pipeline_has_convert(config))
+		str_append(str, size, " ! videoconvert");
+
+	str_append(str, size, " ! %s", pipeline_sink_name(config));
+	if (config->latency == PIPELINE_LATENCY_LOW)
+		str_append(str, size, " qos=true max-lateness=%lld",
+			   (long long) pipeline_max_lateness_ms(config) * GST_MSECOND);
+
+	if (config->add_snapshot_tap)
+		str_append(str, size, " t. ! queue leaky=downstream "
+			   "max-size-buffers=1 ! appsink max-buffers=%d drop=true "
+			   "sync=false async=false",
+			   pipeline_snapshot_ring(config));
+	if (pipeline_has_record_branch(config)) {
+		str_append(str, size, " t. ! valve drop=true ! appsink "
+			   "max-buffers=1 drop=true sync=false async=false; "
+			   "appsrc format=time ! videoconvert ! %s ! h264parse ! "
+			   "splitmuxsink muxer-factory=mpegtsmux max-size-time=%lld",
+			   pipeline_record_encoder(),
+			   (long long) pipeline_record_segment_s(config) * GST_SECOND);
+		if (config->record_location)
+			str_append(str, size, " location=%s", config->record_location);
+	}
+}
+
+static GstElement *
+pipeline_add_element(GstElement *pipeline, const char *factory, const char *name)
+{
+	GstElement *element = gst_element_factory_make(factory, name);
+
+	if (!element) {
+		fprintf(stderr, "gstreamer element '%s' is not available\n", factory);
+		return NULL;
+	}
+
+	gst_bin_add(GST_BIN(pipeline), element);
+	return element;
+}
+
+static void
+decodebin_pad_added(GstElement *decodebin, GstPad *pad, gpointer data)
+{
+	GstElement *next = GST_ELEMENT(data);
+	GstPad *sink_pad;
+	GstCaps *caps;
+	bool is_video;
+
+	caps = gst_pad_get_current_caps(pad);
+	if (!caps)
+		caps = gst_pad_query_caps(pad, NULL);
+
+	is_video = g_str_has_prefix(gst_structure_get_name(gst_caps_get_structure(caps, 0)),
+				    "video/");
+	gst_caps_unref(caps);
+
+	if (!is_video)
+		return;
+
+	sink_pad = gst_element_get_static_pad(next, "sink");
+	if (!gst_pad_is_linked(sink_pad) &&
+	    gst_pad_link(pad, sink_pad) != GST_PAD_LINK_OK)
+		fprintf(stderr, "failed to link %s to %s\n",
+			GST_ELEMENT_NAME(decodebin), GST_ELEMENT_NAME(next));
+
+	gst_object_unref(sink_pad);
+}
+
+static GstCaps *
+pipeline_caps_new(const struct pipeline_config *config)
+{
+	GstCaps *caps = gst_caps_new_empty_simple("video/x-raw");
+
+	if (config->format)
+		gst_caps_set_simple(caps, "format", G_TYPE_STRING,
+				    config->format, NULL);
+	if (pipeline_has_size(config))
+		gst_caps_set_simple(caps,
+				    "width", G_TYPE_INT, config->width,
+				    "height", G_TYPE_INT, config->height,
+				    NULL);
+	if (pipeline_has_framerate(config))
+		gst_caps_set_simple(caps, "framerate", GST_TYPE_FRACTION,
+				    config->framerate_num, config->framerate_den,
+				    NULL);
+
+	return caps;
+}
+
+static GstPadProbeReturn
+count_buffer_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+	std::atomic<guint64> *count = static_cast<std::atomic<guint64> *>(data);
+
+	(*count)++;
+	return GST_PAD_PROBE_OK;
+}
+
+static void
+add_count_probe(GstElement *pipeline, const char *name, const char *pad_name,
+		std::atomic<guint64> *count)
+{
+	GstElement *element = gst_bin_get_by_name(GST_BIN(pipeline), name);
+	GstPad *pad;
+
+	if (!element)
+		return;
+
+	pad = gst_element_get_static_pad(element, pad_name);
+	if (pad) {
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER,
+				  count_buffer_probe, count, NULL);
+		gst_object_unref(pad);
+	}
+
+	gst_object_unref(element);
+}
+
+static void
+pipeline_probes_free(gpointer data)
+{
+	delete static_cast<struct pipeline_probes *>(data);
+}
+
+static void
+pipeline_add_probes(GstElement *pipeline)
+{
+	struct pipeline_probes *probes = new pipeline_probes();
+
+	add_count_probe(pipeline, "source", "src", &probes->captured);
+	add_count_probe(pipeline, "queue", "sink", &probes->queue_in);
+	add_count_probe(pipeline, "queue", "src", &probes->queue_out);
+
+	g_object_set_data_full(G_OBJECT(pipeline), PIPELINE_PROBES_KEY,
+			       probes, pipeline_probes_free);
+}
+
+static GstPadProbeReturn
+drop_allocation_query_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+	GstQuery *query = GST_PAD_PROBE_INFO_QUERY(info);
+
+	if (GST_QUERY_TYPE(query) == GST_QUERY_ALLOCATION)
+		return GST_PAD_PROBE_DROP;
+
+	return GST_PAD_PROBE_OK;
+}
+
+/*
+ * The branches off the tee hold on to capture buffers for longer than the
+ * display path does, so once the sink has answered the allocation query
+ * we ask the source for that many more, or it runs out and stalls. With
+ * no pool in the answer the source sizes its own from the minimum too.
+ */
+static GstPadProbeReturn
+reserve_buffers_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+	GstQuery *query = GST_PAD_PROBE_INFO_QUERY(info);
+	guint reserved = GPOINTER_TO_UINT(data);
+	GstBufferPool *pool;
+	GstVideoInfo vinfo;
+	GstCaps *caps;
+	guint size, min, max;
+
+	if (!(GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_PULL) ||
+	    GST_QUERY_TYPE(query) != GST_QUERY_ALLOCATION)
+		return GST_PAD_PROBE_OK;
+
+	if (gst_query_get_n_allocation_pools(query) > 0) {
+		gst_query_parse_nth_allocation_pool(query, 0, &pool, &size, &min, &max);
+		min += reserved;
+		if (max != 0 && max < min)
+			max = min;
+		gst_query_set_nth_allocation_pool(query, 0, pool, size, min, max);
+		if (pool)
+			gst_object_unref(pool);
+		return GST_PAD_PROBE_OK;
+	}
+
+	gst_query_parse_allocation(query, &caps, NULL);
+	if (caps && gst_video_info_from_caps(&vinfo, caps))
+		gst_query_add_allocation_pool(query, NULL, GST_VIDEO_INFO_SIZE(&vinfo),
+					      reserved, 0);
+
+	return GST_PAD_PROBE_OK;
+}
+
+/*
+ * The tee branch that feeds snapshot.h. The queue leaks, and the appsink
+ * drops the oldest frame and neither syncs nor pre-rolls, so nothing on
+ * this side ever holds up the sink.
+ */
+static bool
+pipeline_add_snapshot_branch(GstElement *pipeline, GstElement *tee,
+			     const struct pipeline_config *config)
+{
+	GstElement *queue;
+	GstElement *appsink;
+	GstPad *pad;
+
+	queue = pipeline_add_element(pipeline, "queue", "snapshot-queue");
+	appsink = pipeline_add_element(pipeline, "appsink", "snapshot");
+	if (!queue || !appsink)
+		return false;
+
+	g_object_set(queue,
+		     "max-size-buffers", (guint) 1,
+		     "max-size-bytes", (guint) 0,
+		     "max-size-time", (guint64) 0, NULL);
+	gst_util_set_object_arg(G_OBJECT(queue), "leaky", "downstream");
+
+	g_object_set(appsink,
+		     "max-buffers", (guint) pipeline_snapshot_ring(config),
+		     "drop", TRUE, "sync", FALSE, "async", FALSE,
+		     "enable-last-sample", FALSE, NULL);
+
+	// tee ignores a branch that fails the allocation query, so the
+	// sink's answer goes upstream; the buffers this branch holds are
+	// added to it in reserve_buffers_probe()
+	pad = gst_element_get_static_pad(queue, "sink");
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM,
+			  drop_allocation_query_probe, NULL, NULL);
+	gst_object_unref(pad);
+
+	if (!gst_element_link_many(tee, queue, appsink, NULL)) {
+		fprintf(stderr, "failed to link the snapshot branch\n");
+		return false;
+	}
+
+	return true;
+}
+
+static void
+pipeline_set_encoder(GstElement *encoder, const char *factory,
+		     const struct pipeline_config *config)
+{
+	guint bitrate = pipeline_record_bitrate(config);
+
+	if (strcmp(factory, "x264enc") == 0) {
+		g_object_set(encoder, "bitrate", bitrate, NULL);
+		gst_util_set_object_arg(G_OBJECT(encoder), "tune", "zerolatency");
+		gst_util_set_object_arg(G_OBJECT(encoder), "speed-preset",
+					"ultrafast");
+	} else {
+		g_object_set(encoder, "bitrate", bitrate * 1000, NULL);
+	}
+}
+
+/*
+ * The tee branch that feeds record.h. The valve drops frames while
+ * recording is stopped, and the appsink hands the rest over to the
+ * pipeline pipeline_build_record() makes, which encodes them in its own
+ * threads; whatever goes wrong over there never flows back up the tee.
+ */
+static bool
+pipeline_add_record_branch(GstElement *pipeline, GstElement *tee)
+{
+	GstElement *valve;
+	GstElement *appsink;
+	GstPad *pad;
+
+	valve = pipeline_add_element(pipeline, "valve", "record-valve");
+	appsink = pipeline_add_element(pipeline, "appsink", "record-sink");
+	if (!valve || !appsink)
+		return false;
+
+	g_object_set(valve, "drop", TRUE, NULL);
+
+	g_object_set(appsink,
+		     "max-buffers", (guint) 1,
+		     "drop", TRUE, "sync", FALSE, "async", FALSE,
+		     "enable-last-sample", FALSE, NULL);
+
+	// as for the snapshot branch, the sink's answer goes upstream
+	pad = gst_element_get_static_pad(valve, "sink");
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM,
+			  drop_allocation_query_probe, NULL, NULL);
+	gst_object_unref(pad);
+
+	if (!gst_element_link_many(tee, valve, appsink, NULL)) {
+		fprintf(stderr, "failed to link the record branch\n");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * appsrc ! videoconvert ! H.264 encoder ! h264parse ! splitmuxsink, fed
+ * by the "record-sink" appsink of a pipeline_build() pipeline. The
+ * appsrc isn't live: the frames keep the timestamps the camera gave
+ * them and nothing in here waits for the clock. splitmuxsink asks the
+ * encoder for a key frame at each segment boundary; MPEG-TS needs no
+ * finishing touches, so a segment cut short by a crash or a stop is
+ * still playable.
+ */
+GstElement *
+pipeline_build_record(const struct pipeline_config *config)
+{
+	const char *encoder_name = pipeline_record_encoder();
+	GstElement *pipeline;
+	GstElement *appsrc;
+	GstElement *convert;
+	GstElement *encoder;
+	GstElement *parse;
+	GstElement *splitmux;
+
+	if (!encoder_name)
+		return NULL;
+
+	pipeline = gst_pipeline_new("record-pipeline");
+
+	appsrc = pipeline_add_element(pipeline, "appsrc", "record-src");
+	convert = pipeline_add_element(pipeline, "videoconvert", "record-convert");
+	encoder = pipeline_add_element(pipeline, encoder_name, "record-encoder");
+	parse = pipeline_add_element(pipeline, "h264parse", "record-parse");
+	splitmux = pipeline_add_element(pipeline, "splitmuxsink", "record");
+	if (!appsrc || !convert || !encoder || !parse || !splitmux)
+		goto err;
+
+	g_object_set(appsrc, "format", GST_FORMAT_TIME, NULL);
+
+	pipeline_set_encoder(encoder, encoder_name, config);
+
+	g_object_set(splitmux,
+		     "location", config->record_location,
+		     "max-size-time",
+		     (guint64) pipeline_record_segment_s(config) * GST_SECOND,
+		     "send-keyframe-requests", TRUE,
+		     "muxer-factory", "mpegtsmux", NULL);
+
+	if (!gst_element_link_many(appsrc, convert, encoder, parse, splitmux,
+				   NULL)) {
+		fprintf(stderr, "failed to link the record pipeline\n");
+		goto err;
+	}
+
+	return pipeline;
+
+err:
+	gst_object_unref(pipeline);
+	return NULL;
+}
+
+/*
+ * Creates and links the elements described by @config. Elements get
+ * fixed names ("source", "caps", "tee", "queue", "convert", "sink",
+ * "snapshot-queue", "snapshot" for the snapshot branch and
+ * "record-valve", "record-sink" for the record branch) so callers can
+ * look them up with gst_bin_get_by_name().
+ */
+GstElement *
+pipeline_build(const struct pipeline_config *config)
+{
+	GstElement *elements[PIPELINE_MAX_ELEMENTS];
+	GstElement *pipeline;
+	GstElement *element;
+	GstElement *tee = NULL;
+	GstPad *pad;
+	guint reserved = 0;
+	int dynamic_link = -1;
+	int n = 0;
+	int i;
+
+	pipeline = gst_pipeline_new("camera-pipeline");
+
+	switch (config->source) {
+	case PIPELINE_SOURCE_V4L2:
+		element = pipeline_add_element(pipeline, "v4l2src", "source");
+		if (!element)
+			goto err;
+
+		g_object_set(element, "device", config->device, NULL);
+		// with dmabuf the negotiated caps still stay in system
+		// memory: v4l2src doesn't advertise memory:DMABuf, waylandsink
+		// instead checks each buffer for dmabuf-backed memory and
+		// imports it through linux-dmabuf
+		gst_util_set_object_arg(G_OBJECT(element), "io-mode",
+					v4l2_io_mode_to_str(config->io_mode));
+		elements[n++] = element;
+		break;
+	case PIPELINE_SOURCE_PIPEWIRE:
+		element = pipeline_add_element(pipeline, "pipewiresrc", "source");
+		if (!element)
+			goto err;
+
+		elements[n++] = element;
+		break;
+	case PIPELINE_SOURCE_TEST:
+		element = pipeline_add_element(pipeline, "videotestsrc", "source");
+		if (!element)
+			goto err;
+
+		g_object_set(element, "is-live", TRUE, NULL);
+		elements[n++] = element;
+		break;
+	case PIPELINE_SOURCE_STILL_IMAGE:
+		element = pipeline_add_element(pipeline, "appsrc", "source");
+		if (!element)
+			goto err;
+
+		g_object_set(element,
+			     "caps", gst_sample_get_caps(config->still_image),
+			     "format", GST_FORMAT_TIME, NULL);
+		elements[n++] = element;
+		break;
+	case PIPELINE_SOURCE_IMAGE_FILE:
+		element = pipeline_add_element(pipeline, "filesrc", "source");
+		if (!element)
+			goto err;
+
+		g_object_set(element, "location", config->location, NULL);
+		elements[n++] = element;
+
+		element = pipeline_add_element(pipeline, "decodebin", "decode");
+		if (!element)
+			goto err;
+
+		// decodebin only exposes its source pad once it has
+		// found out what the file is
+		dynamic_link = n;
+		elements[n++] = element;
+
+		element = pipeline_add_element(pipeline, "videoconvert", "convert");
+		if (!element)
+			goto err;
+		elements[n++] = element;
+
+		element = pipeline_add_element(pipeline, "videoscale", "scale");
+		if (!element)
+			goto err;
+		elements[n++] = element;
+		break;
+	}
+
+	if (pipeline_has_caps_filter(config)) {
+		GstCaps *caps;
+
+		element = pipeline_add_element(pipeline, "capsfilter", "caps");
+		if (!element)
+			goto err;
+
+		caps = pipeline_caps_new(config);
+		g_object_set(element, "caps", caps, NULL);
+		gst_caps_unref(caps);
+		elements[n++] = element;
+	}
+
+	if (config->add_record_tap && !pipeline_record_encoder())
+		fprintf(stderr, "no H.264 encoder (x264enc, openh264enc), "
+			"not recording\n");
+
+	// recording and snapshots see every frame the source delivers,
+	// whatever the display path ahead drops
+	if (pipeline_has_tee(config)) {
+		element = pipeline_add_element(pipeline, "tee", "tee");
+		if (!element)
+			goto err;
+		tee = element;
+		elements[n++] = element;
+
+		// the leaky queue, the appsink ring and the frame being
+		// encoded, see snapshot.h
+		if (config->add_snapshot_tap)
+			reserved += pipeline_snapshot_ring(config) + 2;
+		if (pipeline_has_record_branch(config))
+			reserved += PIPELINE_RECORD_HELD_BUFFERS;
+
+		pad = gst_element_get_static_pad(tee, "sink");
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM,
+				  reserve_buffers_probe, GUINT_TO_POINTER(reserved),
+				  NULL);
+		gst_object_unref(pad);
+	}
+
+	if (pipeline_has_queue(config)) {
+		element = pipeline_add_element(pipeline, "queue", "queue");
+		if (!element)
+			goto err;
+
+		// a slow compositor then costs us frames rather than
+		// holding up the driver, which would drop them in the
+		// kernel and let the latency grow
+		if (config->latency == PIPELINE_LATENCY_LOW) {
+			g_object_set(element,
+				     "max-size-buffers", (guint) pipeline_queue_size(config),
+				     "max-size-bytes", (guint) 0,
+				     "max-size-time", (guint64) 0, NULL);
+			gst_util_set_object_arg(G_OBJECT(element), "leaky", "downstream");
+		}
+		elements[n++] = element;
+	}
+
+	if (config->add_convert && !pipeline_has_convert(config)) {
+		element = pipeline_add_element(pipeline, "videoconvert", "convert");
+		if (!element)
+			goto err;
+		elements[n++] = element;
+	}
+
+	element = pipeline_add_element(pipeline, pipeline_sink_name(config), "sink");
+	if (!element)
+		goto err;
+
+	if (config->latency == PIPELINE_LATENCY_LOW)
+		g_object_set(element, "qos", TRUE,
+			     "max-lateness",
+			     (gint64) pipeline_max_lateness_ms(config) * GST_MSECOND,
+			     NULL);
+	elements[n++] = element;
+
+	for (i = 0; i < n - 1; i++) {
+		if (i == dynamic_link) {
+			g_signal_connect(elements[i], "pad-added",
+					 G_CALLBACK(decodebin_pad_added), elements[i + 1]);
+			continue;
+		}
+
+		if (!gst_element_link(elements[i], elements[i + 1])) {
+			fprintf(stderr, "failed to link %s to %s\n",
+				GST_ELEMENT_NAME(elements[i]),
+				GST_ELEMENT_NAME(elements[i + 1]));
+			goto err;
+		}
+	}
+
+	if (config->add_snapshot_tap &&
+	    !pipeline_add_snapshot_branch(pipeline, tee, config))
+		goto err;
+
+	if (pipeline_has_record_branch(config) &&
+	    !pipeline_add_record_branch(pipeline, tee))
+		goto err;
+
+	pipeline_add_probes(pipeline);
+
+	return pipeline;
+
+err:
+	gst_object_unref(pipeline);
+	return NULL;
+}
+
+/*
+ * Bring the pipeline to READY, which makes the source open its device
+ * and the sink connect to the display, so that a broken configuration
+ * is caught before we ask for PLAYING. The bus handlers have to be
+ * installed already as waylandsink asks for the display handle here.
+ */
+bool
+pipeline_validate(GstElement *pipeline)
+{
+	GstStateChangeReturn ret;
+
+	ret = gst_element_set_state(pipeline, GST_STATE_READY);
+	if (ret == GST_STATE_CHANGE_FAILURE) {
+		fprintf(stderr, "gstreamer pipeline failed to reach READY\n");
+		gst_element_set_state(pipeline, GST_STATE_NULL);
+		return false;
+	}
+
+	return true;
+}
+
+bool
+pipeline_update_caps(GstElement *pipeline, const struct pipeline_config *config)
+{
+	GstElement *element;
+	GstCaps *caps;
+
+	if (!pipeline_has_caps_filter(config))
+		return false;
+
+	element = gst_bin_get_by_name(GST_BIN(pipeline), "caps");
+	if (!element)
+		return false;
+
+	// capsfilter sends a reconfigure event upstream, on which the
+	// source negotiates the new caps before its next buffer
+	caps = pipeline_caps_new(config);
+	g_object_set(element, "caps", caps, NULL);
+	gst_caps_unref(caps);
+	gst_object_unref(element);
+
+	return true;
+}
+
+bool
+pipeline_get_counters(GstElement *pipeline, struct pipeline_counters *counters)
+{
+	struct pipeline_probes *probes;
+	GstElement *element;
+
+	memset(counters, 0, sizeof(*counters));
+
+	probes = static_cast<struct pipeline_probes *>(
+		g_object_get_data(G_OBJECT(pipeline), PIPELINE_PROBES_KEY));
+	if (!probes)
+		return false;
+
+	counters->captured = probes->captured;
+
+	// whatever went in and neither came out nor is still waiting
+	// in there got leaked
+	element = gst_bin_get_by_name(GST_BIN(pipeline), "queue");
+	if (element) {
+		guint64 in = probes->queue_in;
+		guint64 out = probes->queue_out;
+		guint level = 0;
+
+		g_object_get(element, "current-level-buffers", &level, NULL);
+		if (in > out + level)
+			counters->queue_dropped = in - out - level;
+		gst_object_unref(element);
+	}
+
+	element = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+	if (element) {
+		GstStructure *stats = NULL;
+
+		g_object_get(element, "stats", &stats, NULL);
+		if (stats) {
+			gst_structure_get_uint64(stats, "dropped",
+						 &counters->late_dropped);
+			gst_structure_get_uint64(stats, "rendered",
+						 &counters->presented);
+			gst_structure_free(stats);
+		}
+		gst_object_unref(element);
+	}
+
+	return true;
+}
+
+void
+pipeline_counters_print(const struct pipeline_counters *counters, FILE *out)
+{
+	fprintf(out, "captured %llu, dropped at the queue %llu, dropped late %llu, "
+		"presented %llu\n",
+		(unsigned long long) counters->captured,
+		(unsigned long long) counters->queue_dropped,
+		(unsigned long long) counters->late_dropped,
+		(unsigned long long) counters->presented);
+}
+
+void
+pipeline_counters_write_json(const struct pipeline_counters *counters, FILE *out)
+{
+	fprintf(out, "{\"captured\": %llu, \"queue_dropped\": %llu, "
+		"\"late_dropped\": %llu, \"presented\": %llu}",
+		(unsigned long long) counters->captured,
+		(unsigned long long) counters->queue_dropped,
+		(unsigned long long) counters->late_dropped,
+		(unsigned long long) counters->presented);
+}
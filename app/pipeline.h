@@ -0,0 +1,160 @@
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include <cstddef>
+#include <cstdio>
+
+#include <gst/gst.h>
+
+enum pipeline_source_type {
+	PIPELINE_SOURCE_PIPEWIRE,
+	PIPELINE_SOURCE_V4L2,
+	PIPELINE_SOURCE_STILL_IMAGE,
+	PIPELINE_SOURCE_IMAGE_FILE,
+	PIPELINE_SOURCE_TEST,
+};
+
+enum v4l2_io_mode {
+	V4L2_IO_MODE_MMAP,
+	V4L2_IO_MODE_DMABUF,
+};
+
+enum pipeline_latency {
+	/* the sink pulls frames as fast as it can and the source waits */
+	PIPELINE_LATENCY_DEFAULT,
+	/* always show the newest frame, dropping the ones that can't keep up */
+	PIPELINE_LATENCY_LOW,
+};
+
+#define PIPELINE_LOW_LATENCY_QUEUE_SIZE		1
+#define PIPELINE_LOW_LATENCY_MAX_LATENESS_MS	10
+
+#define PIPELINE_SNAPSHOT_RING_SIZE		2
+
+#define PIPELINE_RECORD_SEGMENT_S		60
+#define PIPELINE_RECORD_BITRATE_KBPS		2000
+/* capture buffers the record pipeline may hold, one waiting in its
+ * appsrc and one being encoded, see record.h */
+#define PIPELINE_RECORD_HELD_BUFFERS		2
+
+/*
+ * Describes a source ! [capsfilter] ! [tee] ! [queue] ! [videoconvert] ! sink
+ * chain. Strings are not copied, they have to outlive pipeline_build().
+ */
+struct pipeline_config {
+	enum pipeline_source_type source;
+
+	/* PIPELINE_SOURCE_V4L2 */
+	const char *device;
+	enum v4l2_io_mode io_mode;
+
+	/* PIPELINE_SOURCE_IMAGE_FILE */
+	const char *location;
+
+	/* PIPELINE_SOURCE_STILL_IMAGE, an already decoded frame that is
+	 * pushed through an appsrc, see still-image.h */
+	GstSample *still_image;
+
+	/* a caps filter is added if both width and height, the
+	 * framerate or the format are set */
+	int width;
+	int height;
+	int framerate_num;
+	int framerate_den;
+	const char *format;
+
+	bool add_queue;
+	bool add_convert;
+
+	/* PIPELINE_LATENCY_LOW implies a queue, which holds at most
+	 * @queue_size frames and drops the oldest one when full, and has the
+	 * sink drop frames more than @max_lateness_ms late. 0 picks the
+	 * PIPELINE_LOW_LATENCY_* defaults. */
+	enum pipeline_latency latency;
+	int queue_size;
+	int max_lateness_ms;
+
+	/* a tee right after the source feeds a leaky queue ! appsink
+	 * branch named "snapshot", whose appsink keeps the last
+	 * @snapshot_ring frames by reference (0 picks
+	 * PIPELINE_SNAPSHOT_RING_SIZE), see snapshot.h. The source is
+	 * asked for that many more buffers, plus the two the queue and the
+	 * snapshot being encoded hold on to. */
+	bool add_snapshot_tap;
+	int snapshot_ring;
+
+	/* the same tee feeds valve ! appsink, named "record-valve" and
+	 * "record-sink", which hands the frames over to the pipeline made by
+	 * pipeline_build_record(). The valve starts closed, see record.h.
+	 * Without an encoder plugin the branch is left out. */
+	bool add_record_tap;
+	const char *record_location;
+	int record_segment_s;
+	int record_bitrate_kbps;
+
+	/* defaults to waylandsink */
+	const char *sink;
+};
+
+const char *
+pipeline_source_type_to_str(enum pipeline_source_type source);
+
+const char *
+v4l2_io_mode_to_str(enum v4l2_io_mode mode);
+
+void
+pipeline_config_describe(const struct pipeline_config *config,
+			 char *str, size_t size);
+
+GstElement *
+pipeline_build(const struct pipeline_config *config);
+
+/*
+ * The pipeline the record branch of @config feeds: appsrc ! videoconvert
+ * ! H.264 encoder ! h264parse ! splitmuxsink, named "record-src",
+ * "record-encoder" and "record", which cuts MPEG-TS segments of
+ * @record_segment_s to @record_location, a printf pattern for the
+ * segment index. 0 picks the PIPELINE_RECORD_* defaults. NULL without an
+ * encoder plugin.
+ */
+GstElement *
+pipeline_build_record(const struct pipeline_config *config);
+
+bool
+pipeline_validate(GstElement *pipeline);
+
+/*
+ * Give the caps filter of a running pipeline the size, framerate and
+ * format of @config; the source renegotiates without the pipeline being
+ * torn down. Returns false if there is no caps filter to update, either
+ * in @pipeline or in @config.
+ */
+bool
+pipeline_update_caps(GstElement *pipeline, const struct pipeline_config *config);
+
+struct pipeline_counters {
+	/* buffers out of the source */
+	guint64 captured;
+	/* thrown away by the low latency queue to make room */
+	guint64 queue_dropped;
+	/* thrown away by the sink for being too late */
+	guint64 late_dropped;
+	/* handed over to the display by the sink */
+	guint64 presented;
+};
+
+/*
+ * Frame counters of a pipeline made by pipeline_build(), safe to call
+ * while it's streaming.
+ */
+bool
+pipeline_get_counters(GstElement *pipeline, struct pipeline_counters *counters);
+
+void
+pipeline_counters_print(const struct pipeline_counters *counters, FILE *out);
+
+/* JSON object, without a trailing newline */
+void
+pipeline_counters_write_json(const struct pipeline_counters *counters, FILE *out);
+
+#endif
@@ -0,0 +1,567 @@
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/video/video.h>
+
+#include "record.h"
+
+struct recorder {
+	char dir[PATH_MAX];
+	char location[PATH_MAX];
+	int max_segments;
+	FILE *log;
+	struct event_loop *loop;
+
+	/* the camera pipeline and its record branch */
+	GstElement *pipeline;
+	GstElement *valve;
+	GstElement *appsink;
+
+	/* the record pipeline, back in NULL after an error until the next
+	 * recorder_start() */
+	GstElement *record;
+	GstElement *appsrc;
+	GstElement *splitmux;
+	GstPad *encoder_pad;
+	gulong probe_id;
+	GstBus *bus;
+	struct event_source *bus_source;
+	bool failed;
+
+	bool recording;
+	unsigned int next_index;
+
+	/* the segment being written to, empty if none, and where it went
+	 * if it got locked */
+	char current[PATH_MAX];
+	char current_locked[PATH_MAX];
+	/* closed and unlocked segments, oldest first */
+	std::deque<std::string> segments;
+
+	std::atomic<guint64> frames_encoded;
+	std::atomic<guint64> frames_dropped;
+	guint64 frames_at_start;
+	gint64 started_at;
+	gint64 stopped_at;
+
+	GstClockTime closed_at;
+	gint64 rotation_total;
+	unsigned int rotations;
+
+	guint64 bytes_closed;
+	struct record_stats stats;
+};
+
+static guint64
+file_size(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return 0;
+
+	return st.st_size;
+}
+
+static bool
+parse_index(const char *name, const char *prefix, unsigned int *index)
+{
+	size_t len = strlen(prefix);
+	char *end;
+
+	if (strncmp(name, prefix, len) != 0)
+		return false;
+
+	*index = strtoul(name + len, &end, 10);
+	return end != name + len && strcmp(end, ".ts") == 0;
+}
+
+/* drop the oldest segments beyond max_segments */
+static void
+recorder_trim(struct recorder *recorder)
+{
+	while (recorder->segments.size() > (size_t) recorder->max_segments) {
+		const char *path = recorder->segments.front().c_str();
+
+		if (unlink(path) < 0 && errno != ENOENT)
+			fprintf(stderr, "Couldn't delete %s: %s\n", path, strerror(errno));
+		else
+			recorder->stats.segments_deleted++;
+		recorder->segments.pop_front();
+	}
+}
+
+/*
+ * Segments left behind by an earlier run go first, and the index carries
+ * on from theirs so nothing gets overwritten.
+ */
+static void
+recorder_scan(struct recorder *recorder)
+{
+	std::vector<unsigned int> found;
+	struct dirent *entry;
+	unsigned int index;
+	char path[PATH_MAX];
+	DIR *dir;
+
+	dir = opendir(recorder->dir);
+	if (!dir) {
+		fprintf(stderr, "Couldn't open %s: %s\n", recorder->dir, strerror(errno));
+		return;
+	}
+
+	while ((entry = readdir(dir))) {
+		if (parse_index(entry->d_name, "segment-", &index))
+			found.push_back(index);
+		else if (!parse_index(entry->d_name, "locked-", &index))
+			continue;
+
+		recorder->next_index = std::max(recorder->next_index, index + 1);
+	}
+	closedir(dir);
+
+	std::sort(found.begin(), found.end());
+	for (unsigned int i : found) {
+		snprintf(path, sizeof(path), "%s/segment-%08u.ts", recorder->dir, i);
+		recorder->segments.push_back(path);
+	}
+	recorder_trim(recorder);
+}
+
+struct recorder *
+recorder_create(struct event_loop *loop, const char *dir, int max_segments,
+		FILE *log)
+{
+	struct recorder *recorder = new struct recorder();
+
+	snprintf(recorder->dir, sizeof(recorder->dir), "%s", dir);
+	snprintf(recorder->location, sizeof(recorder->location),
+		 "%s/segment-%%08u.ts", dir);
+	recorder->max_segments = max_segments > 0 ? max_segments :
+						    RECORD_DEFAULT_SEGMENTS;
+	recorder->log = log;
+	recorder->loop = loop;
+	recorder->closed_at = GST_CLOCK_TIME_NONE;
+
+	recorder_scan(recorder);
+
+	return recorder;
+}
+
+void
+recorder_destroy(struct recorder *recorder)
+{
+	recorder_set_pipeline(recorder, NULL, NULL);
+	delete recorder;
+}
+
+const char *
+recorder_location(struct recorder *recorder)
+{
+	return recorder->location;
+}
+
+static GstPadProbeReturn
+encoded_frame_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+	struct recorder *recorder = static_cast<struct recorder *>(data);
+
+	recorder->frames_encoded++;
+	return GST_PAD_PROBE_OK;
+}
+
+static void
+segment_opened(struct recorder *recorder, const char *location,
+	       GstClockTime timestamp)
+{
+	const char *name = strrchr(location, '/');
+	unsigned int index;
+	gint64 rotation;
+
+	snprintf(recorder->current, sizeof(recorder->current), "%s", location);
+	recorder->current_locked[0] = '\0';
+
+	if (parse_index(name ? name + 1 : location, "segment-", &index))
+		recorder->next_index = index + 1;
+
+	// both come from the message timestamps, so how late the main loop
+	// got to the messages doesn't count
+	if (GST_CLOCK_TIME_IS_VALID(recorder->closed_at) &&
+	    GST_CLOCK_TIME_IS_VALID(timestamp) && timestamp >= recorder->closed_at) {
+		rotation = GST_TIME_AS_USECONDS(timestamp - recorder->closed_at);
+		recorder->rotation_total += rotation;
+		recorder->rotations++;
+		if (rotation > recorder->stats.rotation_max)
+			recorder->stats.rotation_max = rotation;
+	}
+	recorder->closed_at = GST_CLOCK_TIME_NONE;
+
+	if (recorder->log)
+		fprintf(recorder->log, "Recording to %s\n", location);
+}
+
+static void
+segment_closed(struct recorder *recorder, const char *location,
+	       GstClockTime timestamp)
+{
+	bool locked = recorder->current_locked[0] &&
+		      strcmp(location, recorder->current) == 0;
+	const char *path = locked ? recorder->current_locked : location;
+	guint64 size = file_size(path);
+
+	recorder->closed_at = timestamp;
+	recorder->bytes_closed += size;
+	recorder->stats.segments_closed++;
+
+	if (recorder->log)
+		fprintf(recorder->log, "Segment %s closed, %.1f MiB\n", path,
+			size / (1024.0 * 1024.0));
+
+	if (strcmp(location, recorder->current) == 0) {
+		recorder->current[0] = '\0';
+		recorder->current_locked[0] = '\0';
+	}
+
+	if (!locked) {
+		recorder->segments.push_back(location);
+		recorder_trim(recorder);
+	}
+}
+
+/*
+ * Runs in the camera's streaming thread. The appsrc queue holds one frame
+ * at most and the encoder is busy with another, see
+ * PIPELINE_RECORD_HELD_BUFFERS; anything beyond that is dropped here
+ * rather than held up, and whatever the record pipeline returns, the
+ * camera goes on.
+ */
+static GstFlowReturn
+record_new_sample(GstAppSink *appsink, gpointer data)
+{
+	struct recorder *recorder = static_cast<struct recorder *>(data);
+	GstAppSrc *appsrc = GST_APP_SRC(recorder->appsrc);
+	GstSample *sample = gst_app_sink_pull_sample(appsink);
+
+	if (!sample)
+		return GST_FLOW_OK;
+
+	if (gst_app_src_get_current_level_bytes(appsrc) > 0)
+		recorder->frames_dropped++;
+	else
+		gst_app_src_push_sample(appsrc, sample);
+	gst_sample_unref(sample);
+
+	return GST_FLOW_OK;
+}
+
+static void
+recorder_play(struct recorder *recorder)
+{
+	g_object_set(recorder->splitmux, "start-index",
+		     (gint) recorder->next_index, NULL);
+	gst_element_set_state(recorder->record, GST_STATE_PLAYING);
+	recorder->failed = false;
+}
+
+/*
+ * A full disk or a broken encoder stops the recording, not the camera.
+ * The record pipeline goes back to NULL, so the next recorder_start()
+ * gets a fresh encoder and a new segment.
+ */
+static void
+recorder_fail(struct recorder *recorder, GstMessage *message)
+{
+	GError *err = NULL;
+
+	gst_message_parse_error(message, &err, NULL);
+	fprintf(stderr, "Recording failed in %s: %s, stopping it\n",
+		GST_OBJECT_NAME(GST_MESSAGE_SRC(message)), err->message);
+	g_error_free(err);
+
+	recorder_stop(recorder);
+	gst_element_set_state(recorder->record, GST_STATE_NULL);
+	recorder->failed = true;
+
+	// no closed message comes for the segment that was open
+	if (recorder->current[0])
+		segment_closed(recorder, recorder->current, GST_CLOCK_TIME_NONE);
+}
+
+static void
+recorder_handle_message(struct recorder *recorder, GstMessage *message)
+{
+	const GstStructure *structure;
+	const char *location;
+
+	if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR) {
+		if (!recorder->failed)
+			recorder_fail(recorder, message);
+		return;
+	}
+
+	if (GST_MESSAGE_TYPE(message) != GST_MESSAGE_ELEMENT ||
+	    GST_MESSAGE_SRC(message) != GST_OBJECT(recorder->splitmux))
+		return;
+
+	structure = gst_message_get_structure(message);
+	location = gst_structure_get_string(structure, "location");
+	if (!location)
+		return;
+
+	if (gst_structure_has_name(structure, "splitmuxsink-fragment-opened"))
+		segment_opened(recorder, location, GST_MESSAGE_TIMESTAMP(message));
+	else if (gst_structure_has_name(structure, "splitmuxsink-fragment-closed"))
+		segment_closed(recorder, location, GST_MESSAGE_TIMESTAMP(message));
+}
+
+static void
+record_bus_handle_data(int fd, uint32_t mask, void *data)
+{
+	struct recorder *recorder = static_cast<struct recorder *>(data);
+	GstMessage *message;
+
+	while ((message = gst_bus_pop(recorder->bus)) != NULL) {
+		recorder_handle_message(recorder, message);
+		gst_message_unref(message);
+	}
+}
+
+static void
+recorder_release(struct recorder *recorder)
+{
+	event_source_remove(recorder->bus_source);
+	recorder->bus_source = NULL;
+
+	gst_element_set_state(recorder->record, GST_STATE_NULL);
+	gst_pad_remove_probe(recorder->encoder_pad, recorder->probe_id);
+
+	gst_object_unref(recorder->bus);
+	gst_object_unref(recorder->encoder_pad);
+	gst_object_unref(recorder->splitmux);
+	gst_object_unref(recorder->appsrc);
+	gst_object_unref(recorder->record);
+	gst_object_unref(recorder->appsink);
+	gst_object_unref(recorder->valve);
+	gst_object_unref(recorder->pipeline);
+	recorder->bus = NULL;
+	recorder->encoder_pad = NULL;
+	recorder->splitmux = NULL;
+	recorder->appsrc = NULL;
+	recorder->record = NULL;
+	recorder->appsink = NULL;
+	recorder->valve = NULL;
+	recorder->pipeline = NULL;
+
+	// the messages for the last segment went with the bus
+	if (recorder->current[0])
+		segment_closed(recorder, recorder->current, GST_CLOCK_TIME_NONE);
+}
+
+void
+recorder_set_pipeline(struct recorder *recorder, GstElement *pipeline,
+		      const struct pipeline_config *config)
+{
+	GstAppSinkCallbacks callbacks = {};
+	GstElement *encoder;
+	GPollFD pollfd;
+
+	if (recorder->pipeline)
+		recorder_release(recorder);
+
+	if (!pipeline)
+		return;
+
+	recorder->valve = gst_bin_get_by_name(GST_BIN(pipeline), "record-valve");
+	recorder->appsink = gst_bin_get_by_name(GST_BIN(pipeline), "record-sink");
+	recorder->record = recorder->valve && recorder->appsink ?
+			   pipeline_build_record(config) : NULL;
+	if (!recorder->record) {
+		// no encoder, pipeline_build() already said so
+		g_clear_object(&recorder->valve);
+		g_clear_object(&recorder->appsink);
+		return;
+	}
+
+	recorder->pipeline = GST_ELEMENT(gst_object_ref(pipeline));
+	recorder->appsrc = gst_bin_get_by_name(GST_BIN(recorder->record), "record-src");
+	recorder->splitmux = gst_bin_get_by_name(GST_BIN(recorder->record), "record");
+
+	encoder = gst_bin_get_by_name(GST_BIN(recorder->record), "record-encoder");
+	recorder->encoder_pad = gst_element_get_static_pad(encoder, "src");
+	recorder->probe_id = gst_pad_add_probe(recorder->encoder_pad,
+					       GST_PAD_PROBE_TYPE_BUFFER,
+					       encoded_frame_probe, recorder, NULL);
+	gst_object_unref(encoder);
+
+	recorder->bus = gst_element_get_bus(recorder->record);
+	gst_bus_get_pollfd(recorder->bus, &pollfd);
+	recorder->bus_source = event_loop_add_fd(recorder->loop, pollfd.fd,
+						 EVENT_READABLE,
+						 record_bus_handle_data, recorder);
+
+	callbacks.new_sample = record_new_sample;
+	gst_app_sink_set_callbacks(GST_APP_SINK(recorder->appsink), &callbacks,
+				   recorder, NULL);
+
+	g_object_set(recorder->valve, "drop", !recorder->recording, NULL);
+	recorder_play(recorder);
+}
+
+void
+recorder_start(struct recorder *recorder)
+{
+	if (recorder->recording)
+		return;
+
+	recorder->recording = true;
+	recorder->started_at = g_get_monotonic_time();
+	recorder->frames_at_start = recorder->frames_encoded;
+
+	if (!recorder->valve)
+		return;
+
+	if (recorder->failed)
+		recorder_play(recorder);
+	g_object_set(recorder->valve, "drop", FALSE, NULL);
+
+	// what comes next doesn't belong in the segment left open by the
+	// stop, and has to start on a key frame to be playable by itself
+	if (recorder->current[0])
+		g_signal_emit_by_name(recorder->splitmux, "split-now");
+	gst_pad_send_event(recorder->encoder_pad,
+			   gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE,
+								       TRUE, 0));
+}
+
+/*
+ * The encoder goes idle and the open segment, playable as it is, stays
+ * open until recording starts again or the pipeline goes away.
+ */
+void
+recorder_stop(struct recorder *recorder)
+{
+	if (!recorder->recording)
+		return;
+
+	recorder->recording = false;
+	recorder->stopped_at = g_get_monotonic_time();
+
+	if (recorder->valve)
+		g_object_set(recorder->valve, "drop", TRUE, NULL);
+}
+
+bool
+recorder_is_recording(struct recorder *recorder)
+{
+	return recorder->recording;
+}
+
+/*
+ * The muxer keeps writing to the renamed file through the descriptor it
+ * has open, and the closed message still names the old path.
+ */
+bool
+recorder_lock_segment(struct recorder *recorder)
+{
+	const char *name;
+	char locked[PATH_MAX];
+
+	if (!recorder->current[0])
+		return false;
+	if (recorder->current_locked[0])
+		return true;
+
+	name = strrchr(recorder->current, '/');
+	name = name ? name + 1 : recorder->current;
+	snprintf(locked, sizeof(locked), "%s/locked-%s", recorder->dir,
+		 name + strlen("segment-"));
+
+	if (rename(recorder->current, locked) < 0) {
+		fprintf(stderr, "Couldn't lock %s: %s\n", recorder->current,
+			strerror(errno));
+		return false;
+	}
+
+	snprintf(recorder->current_locked, sizeof(recorder->current_locked),
+		 "%s", locked);
+	recorder->stats.segments_locked++;
+
+	if (recorder->log)
+		fprintf(recorder->log, "Segment locked as %s\n", locked);
+
+	return true;
+}
+
+void
+recorder_get_stats(struct recorder *recorder, struct record_stats *stats)
+{
+	gint64 until = recorder->recording ? g_get_monotonic_time() :
+					     recorder->stopped_at;
+	guint64 frames = recorder->frames_encoded - recorder->frames_at_start;
+
+	*stats = recorder->stats;
+	stats->recording = recorder->recording;
+	stats->frames_encoded = recorder->frames_encoded;
+	stats->frames_dropped = recorder->frames_dropped;
+	if (recorder->started_at && until > recorder->started_at)
+		stats->encode_fps = frames * 1e6 / (until - recorder->started_at);
+
+	stats->bytes_written = recorder->bytes_closed;
+	if (recorder->current[0])
+		stats->bytes_written += file_size(recorder->current_locked[0] ?
+						  recorder->current_locked :
+						  recorder->current);
+
+	if (recorder->rotations)
+		stats->rotation_mean = recorder->rotation_total / recorder->rotations;
+}
+
+void
+recorder_print(struct recorder *recorder, FILE *out)
+{
+	struct record_stats s;
+
+	recorder_get_stats(recorder, &s);
+
+	fprintf(out, "recording %s, %.1f fps encoded, %llu dropped, "
+		"%.1f MiB written, %u segments (%u deleted, %u locked), "
+		"rotation %.1f ms (max %.1f)\n", s.recording ? "on" : "off",
+		s.encode_fps, (unsigned long long) s.frames_dropped,
+		s.bytes_written / (1024.0 * 1024.0), s.segments_closed,
+		s.segments_deleted, s.segments_locked, s.rotation_mean / 1000.0,
+		s.rotation_max / 1000.0);
+}
+
+void
+recorder_write_json(struct recorder *recorder, FILE *out)
+{
+	struct record_stats s;
+
+	recorder_get_stats(recorder, &s);
+
+	fprintf(out, "{\"recording\": %s, \"frames_encoded\": %llu, "
+		"\"encode_fps\": %.2f, \"frames_dropped\": %llu, "
+		"\"bytes_written\": %llu, "
+		"\"segments\": {\"closed\": %u, \"deleted\": %u, \"locked\": %u}, "
+		"\"rotation_us\": {\"mean\": %lld, \"max\": %lld}}",
+		s.recording ? "true" : "false",
+		(unsigned long long) s.frames_encoded, s.encode_fps,
+		(unsigned long long) s.frames_dropped,
+		(unsigned long long) s.bytes_written, s.segments_closed,
+		s.segments_deleted, s.segments_locked,
+		(long long) s.rotation_mean, (long long) s.rotation_max);
+}
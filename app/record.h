@@ -0,0 +1,93 @@
+#ifndef __RECORD_H
+#define __RECORD_H
+
+#include <cstdio>
+
+#include <gst/gst.h>
+
+#include "event-loop.h"
+#include "pipeline.h"
+
+#define RECORD_DEFAULT_SEGMENTS		10
+
+struct record_stats {
+	bool recording;
+
+	/* out of the encoder, and per second while recording */
+	guint64 frames_encoded;
+	double encode_fps;
+	/* left out because the encoder hadn't taken the previous one yet */
+	guint64 frames_dropped;
+
+	/* into segment files, including the ones deleted since */
+	guint64 bytes_written;
+
+	unsigned int segments_closed;
+	unsigned int segments_deleted;
+	unsigned int segments_locked;
+
+	/* from one segment being closed to the next being opened, us */
+	gint64 rotation_mean;
+	gint64 rotation_max;
+};
+
+struct recorder;
+
+/*
+ * Keeps the newest @max_segments segment-<n>.ts files in @dir and
+ * deletes older ones, starting with the ones an earlier run left
+ * behind. Locked segments are renamed to locked-<n>.ts and never
+ * deleted. Each segment is reported on @log, if not NULL. The messages
+ * of the record pipeline are handled from @loop.
+ */
+struct recorder *
+recorder_create(struct event_loop *loop, const char *dir, int max_segments,
+		FILE *log);
+
+void
+recorder_destroy(struct recorder *recorder);
+
+/* pattern for pipeline_config.record_location, lives as long as @recorder */
+const char *
+recorder_location(struct recorder *recorder);
+
+/*
+ * Drive the record branch of @pipeline, built from @config with
+ * add_record_tap, which has to be in READY at most, and the record
+ * pipeline it feeds. NULL once the pipeline is in NULL, before it goes
+ * away. Frames the record pipeline isn't ready for are dropped, so it
+ * never holds more than PIPELINE_RECORD_HELD_BUFFERS capture buffers.
+ * An error in there stops the recording, the camera goes on. All the
+ * calls below are for the thread running the main loop.
+ */
+void
+recorder_set_pipeline(struct recorder *recorder, GstElement *pipeline,
+		      const struct pipeline_config *config);
+
+void
+recorder_start(struct recorder *recorder);
+
+void
+recorder_stop(struct recorder *recorder);
+
+bool
+recorder_is_recording(struct recorder *recorder);
+
+/*
+ * Keep the segment being written to out of the rotation. Returns false
+ * if there is none.
+ */
+bool
+recorder_lock_segment(struct recorder *recorder);
+
+void
+recorder_get_stats(struct recorder *recorder, struct record_stats *stats);
+
+void
+recorder_print(struct recorder *recorder, FILE *out);
+
+/* JSON object, without a trailing newline */
+void
+recorder_write_json(struct recorder *recorder, FILE *out);
+
+#endif
@@ -0,0 +1,298 @@
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+
+#include "shm-pool.h"
+#include "utils.h"
+
+#define SHM_POOL_ALIGN		64
+#define SHM_POOL_MIN_SIZE	4096
+
+struct shm_pool {
+	struct wl_shm *shm;
+	struct wl_shm_pool *wl_pool;
+	int fd;
+	void *data;
+	size_t size;
+
+	/* end of the last slot, slots cover [0, used) without gaps */
+	size_t used;
+	struct wl_list slot_list;
+
+	struct shm_pool_stats stats;
+};
+
+static size_t
+align_size(size_t size, size_t alignment)
+{
+	return (size + alignment - 1) & ~(alignment - 1);
+}
+
+struct shm_pool *
+shm_pool_create(struct wl_shm *shm, size_t size)
+{
+	struct shm_pool *pool;
+
+	pool = static_cast<struct shm_pool *>(calloc(1, sizeof(*pool)));
+	if (!pool)
+		return NULL;
+
+	size = align_size(size < SHM_POOL_MIN_SIZE ? SHM_POOL_MIN_SIZE : size,
+			  SHM_POOL_MIN_SIZE);
+
+	pool->fd = os_create_anonymous_file(size);
+	if (pool->fd < 0) {
+		fprintf(stderr, "creating a buffer file for %zu B failed: %s\n",
+				size, strerror(errno));
+		free(pool);
+		return NULL;
+	}
+	pool->stats.files_created++;
+	pool->stats.file_resizes++;
+
+	pool->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			  pool->fd, 0);
+	if (pool->data == MAP_FAILED) {
+		fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+		close(pool->fd);
+		free(pool);
+		return NULL;
+	}
+	pool->stats.maps++;
+
+	pool->shm = shm;
+	pool->wl_pool = wl_shm_create_pool(shm, pool->fd, size);
+	pool->size = size;
+	pool->stats.size = size;
+	wl_list_init(&pool->slot_list);
+
+	return pool;
+}
+
+static void
+slot_drop_wl_buffer(struct shm_buffer *slot)
+{
+	if (!slot->wl_buffer)
+		return;
+
+	wl_buffer_destroy(slot->wl_buffer);
+	slot->wl_buffer = NULL;
+	slot->pool->stats.buffers_destroyed++;
+}
+
+void
+shm_pool_destroy(struct shm_pool *pool)
+{
+	struct shm_buffer *slot, *next;
+
+	wl_list_for_each_safe(slot, next, &pool->slot_list, link) {
+		slot_drop_wl_buffer(slot);
+		wl_list_remove(&slot->link);
+		free(slot);
+	}
+
+	wl_shm_pool_destroy(pool->wl_pool);
+	munmap(pool->data, pool->size);
+	close(pool->fd);
+	free(pool);
+}
+
+static bool
+shm_pool_grow(struct shm_pool *pool, size_t needed)
+{
+	size_t size = pool->size;
+	void *data;
+
+	if (needed <= pool->size)
+		return true;
+
+	while (size < needed)
+		size *= 2;
+
+	if (os_resize_anonymous_file(pool->fd, size) < 0) {
+		fprintf(stderr, "growing the shm pool to %zu B failed: %s\n",
+				size, strerror(errno));
+		return false;
+	}
+	pool->stats.file_resizes++;
+
+	data = mremap(pool->data, pool->size, size, MREMAP_MAYMOVE);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "mremap failed: %s\n", strerror(errno));
+		return false;
+	}
+	pool->stats.maps++;
+
+	wl_shm_pool_resize(pool->wl_pool, size);
+
+	pool->data = data;
+	pool->size = size;
+	pool->stats.size = size;
+
+	return true;
+}
+
+static struct shm_buffer *
+slot_create(struct shm_pool *pool, size_t offset, size_t size,
+	    struct wl_list *after)
+{
+	struct shm_buffer *slot;
+
+	slot = static_cast<struct shm_buffer *>(calloc(1, sizeof(*slot)));
+	if (!slot)
+		return NULL;
+
+	slot->pool = pool;
+	slot->offset = offset;
+	slot->size = size;
+	wl_list_insert(after, &slot->link);
+
+	return slot;
+}
+
+/* merge the free slots from @first to @last into @first */
+static void
+merge_slots(struct shm_buffer *first, struct shm_buffer *last)
+{
+	struct shm_buffer *slot;
+	bool done = first == last;
+
+	slot_drop_wl_buffer(first);
+
+	while (!done) {
+		slot = wl_container_of(first->link.next, slot, link);
+		done = slot == last;
+
+		first->size += slot->size;
+		slot_drop_wl_buffer(slot);
+		wl_list_remove(&slot->link);
+		free(slot);
+	}
+}
+
+/*
+ * Find a run of free slots covering at least @size bytes and merge it
+ * into a single slot. A free run at the end of the pool can be extended
+ * by growing the pool instead.
+ */
+static struct shm_buffer *
+find_free_slot(struct shm_pool *pool, size_t size)
+{
+	struct shm_buffer *start = NULL, *slot;
+	size_t run = 0;
+
+	wl_list_for_each(slot, &pool->slot_list, link) {
+		if (slot->busy) {
+			start = NULL;
+			run = 0;
+			continue;
+		}
+
+		if (!start)
+			start = slot;
+
+		run += slot->size;
+		if (run >= size) {
+			merge_slots(start, slot);
+			return start;
+		}
+	}
+
+	if (!start)
+		return NULL;
+
+	// free tail, grow the pool under it
+	if (!shm_pool_grow(pool, start->offset + size))
+		return NULL;
+
+	slot = wl_container_of(pool->slot_list.prev, slot, link);
+	merge_slots(start, slot);
+
+	start->size = size;
+	pool->used = start->offset + size;
+
+	return start;
+}
+
+static void
+buffer_release(void *data, struct wl_buffer *wl_buffer)
+{
+	struct shm_buffer *buffer = static_cast<struct shm_buffer *>(data);
+
+	buffer->busy = false;
+	buffer->pool->stats.in_use -= buffer->size;
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	buffer_release
+};
+
+struct shm_buffer *
+shm_pool_get_buffer(struct shm_pool *pool, int width, int height,
+		    uint32_t format)
+{
+	struct shm_buffer *slot;
+	int stride = width * 4;
+	size_t size = align_size(stride * height, SHM_POOL_ALIGN);
+
+	wl_list_for_each(slot, &pool->slot_list, link) {
+		if (!slot->busy && slot->wl_buffer &&
+		    slot->width == width && slot->height == height &&
+		    slot->format == format) {
+			slot->busy = true;
+			slot->fresh = false;
+			pool->stats.buffers_reused++;
+			pool->stats.in_use += slot->size;
+			return slot;
+		}
+	}
+
+	slot = find_free_slot(pool, size);
+	if (!slot) {
+		if (!shm_pool_grow(pool, pool->used + size))
+			return NULL;
+
+		slot = slot_create(pool, pool->used, size, pool->slot_list.prev);
+		if (!slot)
+			return NULL;
+
+		pool->used += size;
+	} else if (slot->size > size) {
+		// hand back what we don't need
+		if (!slot_create(pool, slot->offset + size, slot->size - size,
+				 &slot->link))
+			return NULL;
+
+		slot->size = size;
+	}
+
+	slot->wl_buffer = wl_shm_pool_create_buffer(pool->wl_pool, slot->offset,
+						    width, height, stride, format);
+	wl_buffer_add_listener(slot->wl_buffer, &buffer_listener, slot);
+	pool->stats.buffers_created++;
+
+	slot->width = width;
+	slot->height = height;
+	slot->stride = stride;
+	slot->format = format;
+	slot->busy = true;
+	slot->fresh = true;
+	pool->stats.in_use += slot->size;
+
+	return slot;
+}
+
+void *
+shm_buffer_get_data(struct shm_buffer *buffer)
+{
+	return static_cast<char *>(buffer->pool->data) + buffer->offset;
+}
+
+void
+shm_pool_get_stats(struct shm_pool *pool, struct shm_pool_stats *stats)
+{
+	*stats = pool->stats;
+}
@@ -0,0 +1,66 @@
+#ifndef __SHM_POOL_H
+#define __SHM_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <wayland-client.h>
+#include <wayland-util.h>
+
+/*
+ * One growable wl_shm_pool, backed by a single file and mapping, out of
+ * which buffers are sub-allocated. Released buffers keep their
+ * wl_buffer and are handed out again for the same size and format;
+ * otherwise free neighbouring slots get merged, and the pool only
+ * grows (wl_shm_pool.resize can't shrink) when nothing fits.
+ */
+
+struct shm_pool_stats {
+	uint32_t files_created;		/* memfd_create()/mkstemp() */
+	uint32_t file_resizes;		/* posix_fallocate()/ftruncate() */
+	uint32_t maps;			/* mmap()/mremap() */
+	uint32_t buffers_created;	/* wl_shm_pool.create_buffer */
+	uint32_t buffers_reused;
+	uint32_t buffers_destroyed;
+	size_t size;			/* bytes in the pool */
+	size_t in_use;			/* bytes in busy buffers */
+};
+
+struct shm_buffer {
+	struct wl_buffer *wl_buffer;
+	int width, height, stride;
+	uint32_t format;
+
+	/* attached and not released by the compositor yet */
+	bool busy;
+
+	/* set when the memory of the buffer changed hands, its content
+	 * has to be painted again */
+	bool fresh;
+
+	/* private */
+	struct shm_pool *pool;
+	size_t offset;
+	size_t size;
+	struct wl_list link;	/* shm_pool::slot_list, by offset */
+};
+
+struct shm_pool *
+shm_pool_create(struct wl_shm *shm, size_t size);
+
+void
+shm_pool_destroy(struct shm_pool *pool);
+
+/* the returned buffer is marked busy, until the compositor releases it */
+struct shm_buffer *
+shm_pool_get_buffer(struct shm_pool *pool, int width, int height,
+		    uint32_t format);
+
+/* only valid until the next shm_pool_get_buffer(), the pool may move */
+void *
+shm_buffer_get_data(struct shm_buffer *buffer);
+
+void
+shm_pool_get_stats(struct shm_pool *pool, struct shm_pool_stats *stats);
+
+#endif
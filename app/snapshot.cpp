@@ -0,0 +1,294 @@
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <unistd.h>
+
+#include <gst/app/gstappsink.h>
+#include <gst/video/video.h>
+
+#include "snapshot.h"
+
+/* how long to wait for a frame when the ring is empty */
+#define SNAPSHOT_FRAME_TIMEOUT		(500 * GST_MSECOND)
+#define SNAPSHOT_ENCODE_TIMEOUT		(2 * GST_SECOND)
+
+struct snapshot {
+	char dir[PATH_MAX];
+	enum snapshot_format format;
+	FILE *log;
+
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool quit;
+
+	/* everything below is protected by mutex */
+	GstElement *appsink;
+	/* monotonic time each pending request was made at */
+	std::deque<gint64> requests;
+	bool busy;
+
+	struct snapshot_stats stats;
+	gint64 latency_total;
+	gint64 encode_total;
+};
+
+static const char *
+snapshot_format_ext(enum snapshot_format format)
+{
+	return format == SNAPSHOT_FORMAT_PNG ? "png" : "jpg";
+}
+
+static const char *
+snapshot_format_mime(enum snapshot_format format)
+{
+	return format == SNAPSHOT_FORMAT_PNG ? "image/png" : "image/jpeg";
+}
+
+/*
+ * The appsink holds the last frames by reference, oldest first; take
+ * them all and keep the newest. If it's empty, e.g. right after the
+ * previous snapshot, wait for the next frame.
+ */
+static GstSample *
+take_newest_sample(GstElement *appsink)
+{
+	GstSample *newest = NULL;
+	GstSample *sample;
+
+	while ((sample = gst_app_sink_try_pull_sample(GST_APP_SINK(appsink), 0))) {
+		if (newest)
+			gst_sample_unref(newest);
+		newest = sample;
+	}
+
+	if (!newest)
+		newest = gst_app_sink_try_pull_sample(GST_APP_SINK(appsink),
+						      SNAPSHOT_FRAME_TIMEOUT);
+
+	return newest;
+}
+
+static bool
+write_file(const char *path, GstBuffer *buffer)
+{
+	char tmp_path[PATH_MAX];
+	GstMapInfo map;
+	bool written;
+	FILE *out;
+
+	if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+		return false;
+
+	// whoever picks the file up never sees it half written
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	out = fopen(tmp_path, "w");
+	if (!out) {
+		gst_buffer_unmap(buffer, &map);
+		fprintf(stderr, "Couldn't write %s: %s\n", tmp_path, strerror(errno));
+		return false;
+	}
+
+	written = fwrite(map.data, 1, map.size, out) == map.size;
+	written = fclose(out) == 0 && written;
+	gst_buffer_unmap(buffer, &map);
+
+	if (!written || rename(tmp_path, path) < 0) {
+		fprintf(stderr, "Couldn't write %s: %s\n", path, strerror(errno));
+		unlink(tmp_path);
+		return false;
+	}
+
+	return true;
+}
+
+/* runs on the worker thread, without the lock */
+static bool
+take_snapshot(struct snapshot *snapshot, GstElement *appsink,
+	      unsigned int index, gint64 *encode_us)
+{
+	char path[PATH_MAX];
+	GstSample *sample;
+	GstSample *encoded;
+	GstCaps *caps;
+	GError *error = NULL;
+	gint64 start;
+	bool ok;
+
+	sample = take_newest_sample(appsink);
+	if (!sample) {
+		fprintf(stderr, "Snapshot %u: no frame to take\n", index);
+		return false;
+	}
+
+	start = g_get_monotonic_time();
+	caps = gst_caps_new_empty_simple(snapshot_format_mime(snapshot->format));
+	encoded = gst_video_convert_sample(sample, caps, SNAPSHOT_ENCODE_TIMEOUT,
+					   &error);
+	gst_caps_unref(caps);
+	gst_sample_unref(sample);
+	*encode_us = g_get_monotonic_time() - start;
+
+	if (!encoded) {
+		fprintf(stderr, "Snapshot %u: encoding failed: %s\n", index,
+			error ? error->message : "unknown error");
+		g_clear_error(&error);
+		return false;
+	}
+
+	snprintf(path, sizeof(path), "%s/snapshot-%u.%s", snapshot->dir, index,
+		 snapshot_format_ext(snapshot->format));
+	ok = write_file(path, gst_sample_get_buffer(encoded));
+	gst_sample_unref(encoded);
+
+	if (ok && snapshot->log)
+		fprintf(snapshot->log, "Snapshot %u written to %s\n", index, path);
+
+	return ok;
+}
+
+static void
+snapshot_worker(struct snapshot *snapshot)
+{
+	std::unique_lock<std::mutex> lock(snapshot->mutex);
+
+	while (true) {
+		GstElement *appsink;
+		gint64 requested_at;
+		gint64 encode_us = 0;
+		gint64 latency;
+		unsigned int index;
+		bool ok = false;
+
+		snapshot->cond.wait(lock, [snapshot] {
+			return snapshot->quit || !snapshot->requests.empty();
+		});
+		if (snapshot->quit)
+			break;
+
+		requested_at = snapshot->requests.front();
+		snapshot->requests.pop_front();
+		snapshot->busy = true;
+		index = snapshot->stats.written + snapshot->stats.failed;
+		appsink = snapshot->appsink ?
+			  GST_ELEMENT(gst_object_ref(snapshot->appsink)) : NULL;
+
+		// neither the pipeline nor new requests wait for this
+		lock.unlock();
+		if (appsink) {
+			ok = take_snapshot(snapshot, appsink, index, &encode_us);
+			gst_object_unref(appsink);
+		} else {
+			fprintf(stderr, "Snapshot %u: no camera running\n", index);
+		}
+		latency = g_get_monotonic_time() - requested_at;
+		lock.lock();
+
+		snapshot->busy = false;
+		if (!ok) {
+			snapshot->stats.failed++;
+			continue;
+		}
+
+		snapshot->stats.written++;
+		snapshot->latency_total += latency;
+		snapshot->encode_total += encode_us;
+		if (latency > snapshot->stats.latency_max)
+			snapshot->stats.latency_max = latency;
+
+		if (snapshot->log)
+			fprintf(snapshot->log, "Snapshot %u took %.1f ms, %.1f ms of it "
+				"encoding\n", index, latency / 1000.0, encode_us / 1000.0);
+	}
+}
+
+struct snapshot *
+snapshot_create(const char *dir, enum snapshot_format format, FILE *log)
+{
+	struct snapshot *snapshot = new struct snapshot();
+
+	snprintf(snapshot->dir, sizeof(snapshot->dir), "%s", dir);
+	snapshot->format = format;
+	snapshot->log = log;
+	snapshot->worker = std::thread(snapshot_worker, snapshot);
+
+	return snapshot;
+}
+
+void
+snapshot_destroy(struct snapshot *snapshot)
+{
+	{
+		std::lock_guard<std::mutex> lock(snapshot->mutex);
+		snapshot->quit = true;
+	}
+	snapshot->cond.notify_one();
+	snapshot->worker.join();
+
+	if (snapshot->appsink)
+		gst_object_unref(snapshot->appsink);
+	delete snapshot;
+}
+
+void
+snapshot_set_sink(struct snapshot *snapshot, GstElement *appsink)
+{
+	std::lock_guard<std::mutex> lock(snapshot->mutex);
+
+	if (snapshot->appsink)
+		gst_object_unref(snapshot->appsink);
+	snapshot->appsink = appsink ? GST_ELEMENT(gst_object_ref(appsink)) : NULL;
+}
+
+void
+snapshot_request(struct snapshot *snapshot)
+{
+	{
+		std::lock_guard<std::mutex> lock(snapshot->mutex);
+		snapshot->requests.push_back(g_get_monotonic_time());
+		snapshot->stats.requested++;
+	}
+	snapshot->cond.notify_one();
+}
+
+bool
+snapshot_idle(struct snapshot *snapshot)
+{
+	std::lock_guard<std::mutex> lock(snapshot->mutex);
+
+	return snapshot->requests.empty() && !snapshot->busy;
+}
+
+void
+snapshot_get_stats(struct snapshot *snapshot, struct snapshot_stats *stats)
+{
+	std::lock_guard<std::mutex> lock(snapshot->mutex);
+
+	*stats = snapshot->stats;
+	if (stats->written) {
+		stats->latency_mean = snapshot->latency_total / stats->written;
+		stats->encode_mean = snapshot->encode_total / stats->written;
+	}
+}
+
+void
+snapshot_write_json(struct snapshot *snapshot, FILE *out)
+{
+	struct snapshot_stats s;
+
+	snapshot_get_stats(snapshot, &s);
+
+	fprintf(out, "{\"requested\": %u, \"written\": %u, \"failed\": %u, "
+		"\"latency_us\": {\"mean\": %lld, \"max\": %lld}, "
+		"\"encode_us_mean\": %lld}",
+		s.requested, s.written, s.failed,
+		(long long) s.latency_mean, (long long) s.latency_max,
+		(long long) s.encode_mean);
+}
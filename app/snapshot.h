@@ -0,0 +1,63 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include <cstdio>
+
+#include <gst/gst.h>
+
+enum snapshot_format {
+	SNAPSHOT_FORMAT_JPEG,
+	SNAPSHOT_FORMAT_PNG,
+};
+
+struct snapshot_stats {
+	unsigned int requested;
+	unsigned int written;
+	unsigned int failed;
+
+	/* from the request to the file being in place, us */
+	gint64 latency_mean;
+	gint64 latency_max;
+	/* of which spent encoding */
+	gint64 encode_mean;
+};
+
+struct snapshot;
+
+/*
+ * Starts the worker thread that encodes and writes the snapshots, as
+ * snapshot-<n>.jpg or .png in @dir. Each one is reported on @log, if
+ * not NULL.
+ */
+struct snapshot *
+snapshot_create(const char *dir, enum snapshot_format format, FILE *log);
+
+void
+snapshot_destroy(struct snapshot *snapshot);
+
+/*
+ * Take the frames from @appsink, the "snapshot" element of a pipeline
+ * built with add_snapshot_tap. NULL when the pipeline goes away.
+ */
+void
+snapshot_set_sink(struct snapshot *snapshot, GstElement *appsink);
+
+/*
+ * Ask for the newest frame to be written out. Returns right away, the
+ * worker reports on the log once the file is there.
+ */
+void
+snapshot_request(struct snapshot *snapshot);
+
+/* no request is waiting or being handled */
+bool
+snapshot_idle(struct snapshot *snapshot);
+
+void
+snapshot_get_stats(struct snapshot *snapshot, struct snapshot_stats *stats);
+
+/* JSON object, without a trailing newline */
+void
+snapshot_write_json(struct snapshot *snapshot, FILE *out);
+
+#endif
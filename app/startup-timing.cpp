@@ -0,0 +1,124 @@
+#include <atomic>
+
+#include "startup-timing.h"
+
+static gint64 startup_time;
+
+// in enum startup_stage order
+static const char *const stage_names[STARTUP_STAGE_COUNT] = {
+	"shell-connect",
+	"gst-init",
+	"discovery",
+	"wayland",
+	"shell-layout",
+	"window",
+	"config",
+	"pipeline",
+	"standby",
+	"first-frame",
+};
+
+/* written from the thread running the stage (gst-init and
+ * shell-connect have threads of their own), read from the main one */
+static std::atomic<gint64> stage_begin[STARTUP_STAGE_COUNT];
+static std::atomic<gint64> stage_end[STARTUP_STAGE_COUNT];
+
+void
+startup_timing_init(void)
+{
+	startup_time = g_get_monotonic_time();
+}
+
+void
+startup_stage_begin(enum startup_stage stage)
+{
+	stage_end[stage] = 0;
+	stage_begin[stage] = g_get_monotonic_time();
+}
+
+void
+startup_stage_end(enum startup_stage stage)
+{
+	startup_stage_end_at(stage, g_get_monotonic_time());
+}
+
+void
+startup_stage_end_at(enum startup_stage stage, gint64 when)
+{
+	gint64 running = 0;
+
+	if (stage_begin[stage])
+		stage_end[stage].compare_exchange_strong(running, when);
+}
+
+bool
+startup_stage_done(enum startup_stage stage)
+{
+	return stage_end[stage] != 0;
+}
+
+void
+startup_timing_print(FILE *out)
+{
+	gint64 first_frame = stage_end[STARTUP_FIRST_FRAME];
+	int i;
+
+	fprintf(out, "Startup stages (ms since start):\n");
+	for (i = 0; i < STARTUP_STAGE_COUNT; i++) {
+		gint64 begin = stage_begin[i];
+		gint64 end = stage_end[i];
+
+		if (!begin)
+			continue;
+
+		if (!end) {
+			fprintf(out, "  %-13s %8.1f ->      ...\n", stage_names[i],
+				startup_timing_since_start(begin));
+			continue;
+		}
+
+		fprintf(out, "  %-13s %8.1f -> %8.1f  (%.1f ms)\n", stage_names[i],
+			startup_timing_since_start(begin),
+			startup_timing_since_start(end),
+			(end - begin) / 1000.0);
+	}
+
+	if (first_frame)
+		fprintf(out, "Time to first frame: %.1f ms\n",
+			startup_timing_since_start(first_frame));
+}
+
+double
+startup_timing_since_start(gint64 when)
+{
+	return (when - startup_time) / 1000.0;
+}
+
+void
+startup_timing_write_json(FILE *out)
+{
+	gint64 first_frame = stage_end[STARTUP_FIRST_FRAME];
+	const char *sep = "";
+	int i;
+
+	fprintf(out, "{\"stages\": {");
+	for (i = 0; i < STARTUP_STAGE_COUNT; i++) {
+		gint64 begin = stage_begin[i];
+		gint64 end = stage_end[i];
+
+		if (!begin || !end)
+			continue;
+
+		fprintf(out, "%s\"%s\": {\"begin_ms\": %.1f, \"end_ms\": %.1f}",
+			sep, stage_names[i], startup_timing_since_start(begin),
+			startup_timing_since_start(end));
+		sep = ", ";
+	}
+	fprintf(out, "}");
+
+	if (first_frame)
+		fprintf(out, ", \"first_frame_ms\": %.1f",
+			startup_timing_since_start(first_frame));
+
+	fprintf(out, "}");
+}
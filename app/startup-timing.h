@@ -0,0 +1,66 @@
+#ifndef __STARTUP_TIMING_H
+#define __STARTUP_TIMING_H
+
+#include <cstdio>
+
+#include <glib.h>
+
+/*
+ * The startup stages, some of which overlap:
+ *
+ *   shell-connect ---------------------------------------------> ...
+ *   gst-init ------------------------------.
+ *   discovery ------------------.          |
+ *   wayland ----------.         |          |
+ *   shell-layout -----+-> window +-> config +-> pipeline -> first-frame
+ *                               `-------------> standby
+ *
+ * The pipeline pre-rolls while the window waits for its first configure,
+ * the shell channel connects on a thread of its own.
+ */
+enum startup_stage {
+	STARTUP_SHELL_CONNECT,
+	STARTUP_GST_INIT,
+	STARTUP_DISCOVERY,
+	STARTUP_WAYLAND,
+	STARTUP_SHELL_LAYOUT,
+	STARTUP_WINDOW,
+	STARTUP_CONFIG,
+	STARTUP_PIPELINE,
+	STARTUP_STANDBY,
+	STARTUP_FIRST_FRAME,
+	STARTUP_STAGE_COUNT,
+};
+
+/* call first thing in main(), stage times are relative to it */
+void
+startup_timing_init(void);
+
+/* a stage may be begun and ended from different threads, but each
+ * stage only from one at a time; any thread may read them */
+void
+startup_stage_begin(enum startup_stage stage);
+
+void
+startup_stage_end(enum startup_stage stage);
+
+/* end @stage at a time taken earlier, e.g. from a streaming thread */
+void
+startup_stage_end_at(enum startup_stage stage, gint64 when);
+
+bool
+startup_stage_done(enum startup_stage stage);
+
+/* per-stage breakdown, and the time to first frame if there was one */
+void
+startup_timing_print(FILE *out);
+
+/* same as a JSON object, without a trailing newline */
+void
+startup_timing_write_json(FILE *out);
+
+/* ms between startup_timing_init() and @when */
+double
+startup_timing_since_start(gint64 when);
+
+#endif
@@ -0,0 +1,328 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+
+#include "pipeline.h"
+#include "still-image.h"
+
+#define STILL_IMAGE_CACHE_MAGIC		0x43475332	/* CGS2 */
+#define STILL_IMAGE_CACHE_FILE		"camera-gstreamer-still-image.raw"
+#define STILL_IMAGE_DECODE_TIMEOUT	(5 * GST_SECOND)
+
+/* what a decoded frame depends on */
+struct still_image_key {
+	char location[PATH_MAX];
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t file_size;
+	int32_t target_width;
+	int32_t target_height;
+};
+
+/* on-disk layout: header followed by the raw STILL_IMAGE_FORMAT frame */
+struct still_image_header {
+	uint32_t magic;
+	uint32_t header_size;
+	struct still_image_key key;
+	int32_t width;
+	int32_t height;
+	uint64_t data_size;
+};
+
+struct still_image_mapping {
+	void *data;
+	size_t size;
+};
+
+static struct {
+	struct still_image_key key;
+	GstSample *sample;
+} cache;
+
+static bool
+still_image_key_init(struct still_image_key *key, const char *location,
+		     int width, int height)
+{
+	struct stat st;
+
+	// zero the whole thing, keys are compared with memcmp()
+	memset(key, 0, sizeof(*key));
+
+	if (stat(location, &st) < 0) {
+		fprintf(stderr, "Couldn't stat %s: %s\n", location, strerror(errno));
+		return false;
+	}
+
+	snprintf(key->location, sizeof(key->location), "%s", location);
+	key->mtime_sec = st.st_mtim.tv_sec;
+	key->mtime_nsec = st.st_mtim.tv_nsec;
+	key->file_size = st.st_size;
+	key->target_width = width;
+	key->target_height = height;
+
+	return true;
+}
+
+static bool
+still_image_key_equal(const struct still_image_key *a,
+		      const struct still_image_key *b)
+{
+	return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+static bool
+still_image_cache_path(char *path, size_t size)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+
+	if (!dir)
+		return false;
+
+	snprintf(path, size, "%s/%s", dir, STILL_IMAGE_CACHE_FILE);
+	return true;
+}
+
+static GstCaps *
+still_image_caps(int width, int height)
+{
+	return gst_caps_new_simple("video/x-raw",
+				   "format", G_TYPE_STRING, STILL_IMAGE_FORMAT,
+				   "width", G_TYPE_INT, width,
+				   "height", G_TYPE_INT, height,
+				   "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
+				   "framerate", GST_TYPE_FRACTION, 0, 1,
+				   NULL);
+}
+
+static size_t
+still_image_frame_size(int width, int height)
+{
+	// 4 bytes per pixel, so the default stride has no padding
+	return (size_t) width * 4 * height;
+}
+
+static void
+still_image_unmap(gpointer data)
+{
+	struct still_image_mapping *mapping =
+		static_cast<struct still_image_mapping *>(data);
+
+	munmap(mapping->data, mapping->size);
+	free(mapping);
+}
+
+static GstSample *
+still_image_load_from_disk(const struct still_image_key *key)
+{
+	const struct still_image_header *header;
+	struct still_image_mapping *mapping;
+	char path[PATH_MAX];
+	GstBuffer *buffer;
+	GstSample *sample;
+	GstCaps *caps;
+	struct stat st;
+	void *data;
+	int fd;
+
+	if (!still_image_cache_path(path, sizeof(path)))
+		return NULL;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 ||
+	    (size_t) st.st_size < sizeof(struct still_image_header)) {
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED)
+		return NULL;
+
+	header = static_cast<const struct still_image_header *>(data);
+	if (header->magic != STILL_IMAGE_CACHE_MAGIC ||
+	    header->header_size != sizeof(*header) ||
+	    !still_image_key_equal(&header->key, key) ||
+	    header->data_size != still_image_frame_size(header->width, header->height) ||
+	    sizeof(*header) + header->data_size > (size_t) st.st_size) {
+		munmap(data, st.st_size);
+		return NULL;
+	}
+
+	mapping = static_cast<struct still_image_mapping *>(malloc(sizeof(*mapping)));
+	mapping->data = data;
+	mapping->size = st.st_size;
+
+	// the buffer points straight into the mapping, which goes away
+	// together with the last reference to it
+	buffer = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, data,
+					     st.st_size, sizeof(*header),
+					     header->data_size, mapping,
+					     still_image_unmap);
+	caps = still_image_caps(header->width, header->height);
+	sample = gst_sample_new(buffer, caps, NULL, NULL);
+
+	gst_caps_unref(caps);
+	gst_buffer_unref(buffer);
+
+	fprintf(stdout, "Using cached still image from %s\n", path);
+	return sample;
+}
+
+static void
+still_image_save_to_disk(const struct still_image_key *key, GstSample *sample)
+{
+	struct still_image_header header = {};
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX + 4];
+	GstStructure *structure;
+	GstMapInfo map;
+	bool written;
+	FILE *file;
+
+	if (!still_image_cache_path(path, sizeof(path)))
+		return;
+
+	structure = gst_caps_get_structure(gst_sample_get_caps(sample), 0);
+
+	header.magic = STILL_IMAGE_CACHE_MAGIC;
+	header.header_size = sizeof(header);
+	header.key = *key;
+	gst_structure_get_int(structure, "width", &header.width);
+	gst_structure_get_int(structure, "height", &header.height);
+	header.data_size = still_image_frame_size(header.width, header.height);
+
+	if (!gst_buffer_map(gst_sample_get_buffer(sample), &map, GST_MAP_READ))
+		return;
+
+	// frames with a padded stride are only kept in memory
+	if (map.size != header.data_size) {
+		gst_buffer_unmap(gst_sample_get_buffer(sample), &map);
+		return;
+	}
+
+	// write to a temporary file first so that a concurrent start never
+	// sees a partially written cache
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	file = fopen(tmp_path, "wb");
+	if (!file) {
+		gst_buffer_unmap(gst_sample_get_buffer(sample), &map);
+		return;
+	}
+
+	written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		  fwrite(map.data, map.size, 1, file) == 1;
+	written = fclose(file) == 0 && written;
+
+	gst_buffer_unmap(gst_sample_get_buffer(sample), &map);
+
+	if (!written || rename(tmp_path, path) < 0) {
+		fprintf(stderr, "Couldn't write still image cache %s\n", path);
+		unlink(tmp_path);
+	}
+}
+
+static GstSample *
+still_image_decode(const char *location, int width, int height)
+{
+	struct pipeline_config config = {};
+	GstElement *pipeline;
+	GstElement *filter;
+	GstElement *sink;
+	GstSample *sample;
+	GstCaps *caps;
+
+	config.source = PIPELINE_SOURCE_IMAGE_FILE;
+	config.location = location;
+	config.width = width;
+	config.height = height;
+	config.format = STILL_IMAGE_FORMAT;
+	config.sink = "appsink";
+
+	pipeline = pipeline_build(&config);
+	if (!pipeline)
+		return NULL;
+
+	// square pixels, which is all still_image_caps() can describe;
+	// videoscale keeps the picture's aspect ratio and adds borders
+	filter = gst_bin_get_by_name(GST_BIN(pipeline), "caps");
+	g_object_get(filter, "caps", &caps, NULL);
+	caps = gst_caps_make_writable(caps);
+	gst_caps_set_simple(caps, "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
+			    NULL);
+	g_object_set(filter, "caps", caps, NULL);
+	gst_caps_unref(caps);
+	gst_object_unref(filter);
+
+	sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+
+	gst_element_set_state(pipeline, GST_STATE_PAUSED);
+	sample = gst_app_sink_try_pull_preroll(GST_APP_SINK(sink),
+					       STILL_IMAGE_DECODE_TIMEOUT);
+	gst_element_set_state(pipeline, GST_STATE_NULL);
+
+	gst_object_unref(sink);
+	gst_object_unref(pipeline);
+
+	if (!sample)
+		fprintf(stderr, "Failed to decode %s\n", location);
+
+	return sample;
+}
+
+GstSample *
+still_image_get(const char *location, int width, int height)
+{
+	struct still_image_key key;
+	GstSample *sample;
+
+	if (!still_image_key_init(&key, location, width, height))
+		return NULL;
+
+	if (cache.sample && still_image_key_equal(&cache.key, &key))
+		return cache.sample;
+
+	sample = still_image_load_from_disk(&key);
+	if (!sample) {
+		sample = still_image_decode(location, width, height);
+		if (!sample)
+			return NULL;
+
+		still_image_save_to_disk(&key, sample);
+	}
+
+	if (cache.sample)
+		gst_sample_unref(cache.sample);
+
+	cache.key = key;
+	cache.sample = sample;
+
+	return sample;
+}
+
+bool
+still_image_push(GstElement *pipeline, GstSample *sample)
+{
+	GstElement *source = gst_bin_get_by_name(GST_BIN(pipeline), "source");
+	GstFlowReturn ret;
+
+	ret = gst_app_src_push_sample(GST_APP_SRC(source), sample);
+	gst_object_unref(source);
+
+	return ret == GST_FLOW_OK;
+}
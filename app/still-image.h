@@ -0,0 +1,29 @@
+#ifndef __STILL_IMAGE_H
+#define __STILL_IMAGE_H
+
+#include <gst/gst.h>
+
+/* format the still image is decoded to, wl_shm XRGB8888 */
+#define STILL_IMAGE_FORMAT	"BGRx"
+
+/*
+ * Returns the decoded still image at @location, converted to
+ * STILL_IMAGE_FORMAT and scaled to @width x @height (0 keeps the
+ * original size) with square pixels, letterboxed if the aspect ratio
+ * doesn't match. The frame is decoded once per process and kept in
+ * memory; if XDG_RUNTIME_DIR is set the raw frame is also stored there
+ * and mmap'd on the next start, as long as the file mtime and the target
+ * size didn't change. The returned sample belongs to the cache.
+ */
+GstSample *
+still_image_get(const char *location, int width, int height);
+
+/*
+ * Queue the frame in the appsrc of a PIPELINE_SOURCE_STILL_IMAGE
+ * pipeline. This has to be done whenever the pipeline goes from READY
+ * to PAUSED, as that flushes the appsrc.
+ */
+bool
+still_image_push(GstElement *pipeline, GstSample *sample);
+
+#endif
@@ -1,16 +1,12 @@
 #include <sys/mman.h>
 #include <sys/types.h>
-#include <sys/ioctl.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <dirent.h>
 #include <assert.h>
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
 #include <cstdio>
-#include <cctype>
-#include <linux/videodev2.h>
 
 #include "utils.h"
 
@@ -133,67 +129,41 @@ os_create_anonymous_file(off_t size)
 			return -1;
 	}
 
-#ifdef HAVE_POSIX_FALLOCATE
-	do {
-		ret = posix_fallocate(fd, 0, size);
-	} while (ret == EINTR);
-	if (ret != 0) {
-		close(fd);
-		errno = ret;
-		return -1;
-	}
-#else
-	do {
-		ret = ftruncate(fd, size);
-	} while (ret < 0 && errno == EINTR);
+	ret = os_resize_anonymous_file(fd, size);
 	if (ret < 0) {
 		close(fd);
 		return -1;
 	}
-#endif
 
 	return fd;
 }
 
-const char*
-get_first_camera_device(void)
+/*
+ * Grow or shrink the file created with os_create_anonymous_file(). Files
+ * coming from memfd_create() are sealed against shrinking.
+ */
+int
+os_resize_anonymous_file(int fd, off_t size)
 {
-	DIR *dir = opendir("/dev");
-	if (!dir) {
-		perror("Couldn't open the '/dev' directory");
-		return NULL;
-	}
-
-	static char device[PATH_MAX];
-	struct dirent *dirent;
-	bool found = false;
-	while ((dirent = readdir(dir)) != NULL) {
-		struct v4l2_capability vid_cap;
-		int fd;
-
-		if (strcmp(dirent->d_name, "video"))
-			continue;
-		if (!isdigit(dirent->d_name[5]))
-			continue;
-
-		snprintf(device, sizeof(device), "/dev/%s", dirent->d_name);
-
-		fd = open(device, O_RDWR);
-		if (fd == -1)
-			continue;
-		if (ioctl(fd, VIDIOC_QUERYCAP, &vid_cap) < 0) {
-			close(fd);
-			continue;
-		}
-		close(fd);
+#ifdef HAVE_POSIX_FALLOCATE
+	int ret;
 
-		if ((vid_cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) ||
-			(vid_cap.capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE)) {
-			found = true;
-			break;
-		}
+	do {
+		ret = posix_fallocate(fd, 0, size);
+	} while (ret == EINTR);
+	if (ret == 0)
+		return 0;
+	else if (ret != EINVAL && ret != EOPNOTSUPP) {
+		errno = ret;
+		return -1;
 	}
+	// some filesystems don't support fallocate, fall back to ftruncate
+#endif
+	int err;
+
+	do {
+		err = ftruncate(fd, size);
+	} while (err < 0 && errno == EINTR);
 
-	closedir(dir);
-	return found ? device : NULL;
+	return err < 0 ? -1 : 0;
 }
@@ -8,8 +8,8 @@ extern "C" {
 int
 os_create_anonymous_file(off_t size);
 
-const char*
-get_first_camera_device(void);
+int
+os_resize_anonymous_file(int fd, off_t size);
 
 #ifdef  __cplusplus
 }
@@ -0,0 +1,200 @@
+#include <cstdio>
+#include <linux/videodev2.h>
+
+#include "video-format.h"
+
+// the few DRM fourccs we need, libdrm isn't a dependency
+#define DRM_FOURCC(a, b, c, d) \
+	((uint32_t)(a) | ((uint32_t)(b) << 8) | \
+	 ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+#define DRM_FORMAT_ARGB8888	DRM_FOURCC('A', 'R', '2', '4')
+#define DRM_FORMAT_XRGB8888	DRM_FOURCC('X', 'R', '2', '4')
+#define DRM_FORMAT_RGB565	DRM_FOURCC('R', 'G', '1', '6')
+#define DRM_FORMAT_YUYV		DRM_FOURCC('Y', 'U', 'Y', 'V')
+#define DRM_FORMAT_UYVY		DRM_FOURCC('U', 'Y', 'V', 'Y')
+#define DRM_FORMAT_NV12		DRM_FOURCC('N', 'V', '1', '2')
+#define DRM_FORMAT_NV16		DRM_FOURCC('N', 'V', '1', '6')
+#define DRM_FORMAT_YUV420	DRM_FOURCC('Y', 'U', '1', '2')
+
+#define DRM_FORMAT_MOD_LINEAR	0ULL
+#define DRM_FORMAT_MOD_INVALID	0x00ffffffffffffffULL
+
+/* wl_shm uses 0 and 1 instead of the DRM fourccs for these two */
+#define WL_SHM_FORMAT_ARGB8888_CODE	0
+#define WL_SHM_FORMAT_XRGB8888_CODE	1
+
+struct video_format_map {
+	const char *gst_format;
+	uint32_t v4l2;
+	uint32_t drm;
+};
+
+/*
+ * Formats that go from the camera to the compositor untouched, in order
+ * of preference: YUV that display controllers can usually put on a
+ * plane as is, then RGB. Several V4L2 formats may map to the same
+ * GStreamer/DRM one.
+ */
+static const struct video_format_map video_formats[] = {
+	{ "NV12",  V4L2_PIX_FMT_NV12,   DRM_FORMAT_NV12 },
+	{ "YUY2",  V4L2_PIX_FMT_YUYV,   DRM_FORMAT_YUYV },
+	{ "UYVY",  V4L2_PIX_FMT_UYVY,   DRM_FORMAT_UYVY },
+	{ "NV16",  V4L2_PIX_FMT_NV16,   DRM_FORMAT_NV16 },
+	{ "I420",  V4L2_PIX_FMT_YUV420, DRM_FORMAT_YUV420 },
+	{ "BGRx",  V4L2_PIX_FMT_XBGR32, DRM_FORMAT_XRGB8888 },
+	{ "BGRx",  V4L2_PIX_FMT_BGR32,  DRM_FORMAT_XRGB8888 },
+	{ "BGRA",  V4L2_PIX_FMT_ABGR32, DRM_FORMAT_ARGB8888 },
+	{ "RGB16", V4L2_PIX_FMT_RGB565, DRM_FORMAT_RGB565 },
+};
+
+void
+compositor_formats_add_shm(struct compositor_formats *formats, uint32_t format)
+{
+	if (format == WL_SHM_FORMAT_ARGB8888_CODE)
+		format = DRM_FORMAT_ARGB8888;
+	else if (format == WL_SHM_FORMAT_XRGB8888_CODE)
+		format = DRM_FORMAT_XRGB8888;
+
+	if (formats->n_shm < VIDEO_FORMAT_MAX_SHM)
+		formats->shm[formats->n_shm++] = format;
+}
+
+void
+compositor_formats_add_dmabuf(struct compositor_formats *formats,
+			      uint32_t format, uint64_t modifier)
+{
+	if (formats->n_dmabuf < VIDEO_FORMAT_MAX_DMABUF) {
+		formats->dmabuf[formats->n_dmabuf].format = format;
+		formats->dmabuf[formats->n_dmabuf].modifier = modifier;
+		formats->n_dmabuf++;
+	}
+}
+
+static bool
+compositor_has_shm(const struct compositor_formats *compositor, uint32_t drm)
+{
+	int i;
+
+	for (i = 0; i < compositor->n_shm; i++)
+		if (compositor->shm[i] == drm)
+			return true;
+
+	return false;
+}
+
+/* V4L2 buffers are linear, so only those modifiers are of any use */
+static bool
+compositor_has_dmabuf(const struct compositor_formats *compositor, uint32_t drm)
+{
+	int i;
+
+	for (i = 0; i < compositor->n_dmabuf; i++) {
+		const struct dmabuf_format *f = &compositor->dmabuf[i];
+
+		if (f->format == drm &&
+		    (f->modifier == DRM_FORMAT_MOD_LINEAR ||
+		     f->modifier == DRM_FORMAT_MOD_INVALID))
+			return true;
+	}
+
+	return false;
+}
+
+static bool
+camera_has_format(const uint32_t *camera_formats, int n_camera_formats,
+		  uint32_t v4l2)
+{
+	int i;
+
+	for (i = 0; i < n_camera_formats; i++)
+		if (camera_formats[i] == v4l2)
+			return true;
+
+	return false;
+}
+
+static const struct video_format_map *
+find_common_format(const struct compositor_formats *compositor,
+		   const uint32_t *camera_formats, int n_camera_formats,
+		   bool dmabuf)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(video_formats) / sizeof(video_formats[0]); i++) {
+		const struct video_format_map *map = &video_formats[i];
+		bool supported;
+
+		if (!camera_has_format(camera_formats, n_camera_formats, map->v4l2))
+			continue;
+
+		supported = dmabuf ? compositor_has_dmabuf(compositor, map->drm) :
+				     compositor_has_shm(compositor, map->drm);
+		if (supported)
+			return map;
+	}
+
+	return NULL;
+}
+
+/* the first raw format of ours the camera has, videoconvert takes them all */
+static const struct video_format_map *
+find_camera_format(const uint32_t *camera_formats, int n_camera_formats)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(video_formats) / sizeof(video_formats[0]); i++)
+		if (camera_has_format(camera_formats, n_camera_formats,
+				      video_formats[i].v4l2))
+			return &video_formats[i];
+
+	return NULL;
+}
+
+bool
+video_format_negotiate(const struct compositor_formats *compositor,
+		       const uint32_t *camera_formats, int n_camera_formats,
+		       bool dmabuf, struct video_format_choice *choice)
+{
+	const struct video_format_map *map = NULL;
+
+	choice->gst_format = NULL;
+	choice->v4l2_format = 0;
+	choice->needs_convert = false;
+	choice->dmabuf = false;
+
+	if (dmabuf) {
+		map = find_common_format(compositor, camera_formats,
+					 n_camera_formats, true);
+		choice->dmabuf = map != NULL;
+	}
+
+	// waylandsink copies into wl_shm what it can't import as a dmabuf
+	if (!map)
+		map = find_common_format(compositor, camera_formats,
+					 n_camera_formats, false);
+
+	if (!map) {
+		choice->needs_convert = true;
+		map = find_camera_format(camera_formats, n_camera_formats);
+		if (map) {
+			choice->gst_format = map->gst_format;
+			choice->v4l2_format = map->v4l2;
+		}
+		return false;
+	}
+
+	choice->gst_format = map->gst_format;
+	choice->v4l2_format = map->v4l2;
+	return true;
+}
+
+const char *
+video_format_fourcc_str(uint32_t fourcc, char *str)
+{
+	snprintf(str, 5, "%c%c%c%c",
+		 fourcc & 0xff, (fourcc >> 8) & 0xff,
+		 (fourcc >> 16) & 0xff, (fourcc >> 24) & 0xff);
+
+	return str;
+}
@@ -0,0 +1,66 @@
+#ifndef __VIDEO_FORMAT_H
+#define __VIDEO_FORMAT_H
+
+#include <cstdint>
+
+#define VIDEO_FORMAT_MAX_SHM		64
+#define VIDEO_FORMAT_MAX_DMABUF		128
+
+struct dmabuf_format {
+	uint32_t format;	/* DRM fourcc */
+	uint64_t modifier;
+};
+
+/* what the compositor can import, as announced by wl_shm and
+ * zwp_linux_dmabuf_v1 */
+struct compositor_formats {
+	int n_shm;
+	uint32_t shm[VIDEO_FORMAT_MAX_SHM];	/* DRM fourccs */
+
+	int n_dmabuf;
+	struct dmabuf_format dmabuf[VIDEO_FORMAT_MAX_DMABUF];
+};
+
+struct video_format_choice {
+	/* GStreamer name of the format to ask the camera for, NULL to
+	 * leave it to the caps negotiation */
+	const char *gst_format;
+	/* and its V4L2 fourcc, 0 along with a NULL gst_format */
+	uint32_t v4l2_format;
+
+	/* the camera format can't be shown as is, a videoconvert is
+	 * needed in front of the sink; the format above is then a raw one
+	 * of the camera for videoconvert to take, if it has any */
+	bool needs_convert;
+
+	/* the format was matched against the dmabuf list */
+	bool dmabuf;
+};
+
+/* @format is a wl_shm_format */
+void
+compositor_formats_add_shm(struct compositor_formats *formats, uint32_t format);
+
+void
+compositor_formats_add_dmabuf(struct compositor_formats *formats,
+			      uint32_t format, uint64_t modifier);
+
+/*
+ * Pick the camera format (V4L2 fourccs, see camera_device::formats) the
+ * compositor can take without any conversion, YUV formats the display
+ * controller can scan out directly first. With @dmabuf, formats the
+ * compositor imports as (linear) dmabufs are preferred over the ones it
+ * only takes through wl_shm. Returns false, with needs_convert set, if
+ * there's no common format; a compressed-only camera gets no format at
+ * all then.
+ */
+bool
+video_format_negotiate(const struct compositor_formats *compositor,
+		       const uint32_t *camera_formats, int n_camera_formats,
+		       bool dmabuf, struct video_format_choice *choice);
+
+/* printable V4L2/DRM fourcc, @str has to hold at least 5 chars */
+const char *
+video_format_fourcc_str(uint32_t fourcc, char *str);
+
+#endif
@@ -0,0 +1,174 @@
+#include <sys/resource.h>
+
+#include <algorithm>
+
+#include "visibility.h"
+
+enum {
+	STATE_VISIBLE,
+	STATE_HIDDEN,
+	N_STATES,
+};
+
+static const char *const state_names[N_STATES] = { "visible", "hidden" };
+
+struct visibility {
+	bool reasons[VISIBILITY_N_REASONS];
+	bool hidden;
+
+	/* start of the current state, wall and CPU time in us */
+	gint64 since;
+	gint64 cpu_since;
+
+	/* time spent and CPU used in each state, the current one excluded */
+	gint64 time[N_STATES];
+	gint64 cpu[N_STATES];
+
+	unsigned int suspends;
+	unsigned int resumes;
+	gint64 resume_last;
+	gint64 resume_total;
+	gint64 resume_max;
+};
+
+/* all the threads, the streaming ones included */
+static gint64
+cpu_time_now(void)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) < 0)
+		return 0;
+
+	return (gint64) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC +
+	       usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+struct visibility *
+visibility_create(void)
+{
+	struct visibility *visibility = new struct visibility();
+
+	visibility->since = g_get_monotonic_time();
+	visibility->cpu_since = cpu_time_now();
+
+	return visibility;
+}
+
+void
+visibility_destroy(struct visibility *visibility)
+{
+	delete visibility;
+}
+
+/* time and CPU of each state, up to now */
+static void
+visibility_totals(struct visibility *visibility, gint64 time[N_STATES],
+		  gint64 cpu[N_STATES])
+{
+	int current = visibility->hidden ? STATE_HIDDEN : STATE_VISIBLE;
+	int i;
+
+	for (i = 0; i < N_STATES; i++) {
+		time[i] = visibility->time[i];
+		cpu[i] = visibility->cpu[i];
+	}
+
+	time[current] += g_get_monotonic_time() - visibility->since;
+	cpu[current] += cpu_time_now() - visibility->cpu_since;
+}
+
+bool
+visibility_set(struct visibility *visibility, enum visibility_reason reason,
+	       bool hidden)
+{
+	int current = visibility->hidden ? STATE_HIDDEN : STATE_VISIBLE;
+	gint64 now = g_get_monotonic_time();
+	gint64 cpu_now = cpu_time_now();
+	bool was_hidden = visibility->hidden;
+	int i;
+
+	visibility->reasons[reason] = hidden;
+
+	visibility->hidden = false;
+	for (i = 0; i < VISIBILITY_N_REASONS; i++)
+		visibility->hidden |= visibility->reasons[i];
+
+	if (visibility->hidden == was_hidden)
+		return false;
+
+	visibility->time[current] += now - visibility->since;
+	visibility->cpu[current] += cpu_now - visibility->cpu_since;
+	visibility->since = now;
+	visibility->cpu_since = cpu_now;
+
+	if (visibility->hidden)
+		visibility->suspends++;
+
+	return true;
+}
+
+bool
+visibility_is_hidden(struct visibility *visibility)
+{
+	return visibility->hidden;
+}
+
+void
+visibility_resumed(struct visibility *visibility, gint64 visible_at,
+		   gint64 shown_at)
+{
+	gint64 latency = shown_at - visible_at;
+
+	visibility->resumes++;
+	visibility->resume_last = latency;
+	visibility->resume_total += latency;
+	visibility->resume_max = std::max(visibility->resume_max, latency);
+}
+
+/* share of one CPU, in percent */
+static double
+cpu_usage(gint64 cpu, gint64 time)
+{
+	return time > 0 ? 100.0 * cpu / time : 0;
+}
+
+void
+visibility_print(struct visibility *visibility, FILE *out)
+{
+	gint64 time[N_STATES], cpu[N_STATES];
+	int i;
+
+	visibility_totals(visibility, time, cpu);
+
+	fprintf(out, "app %s", visibility->hidden ? "hidden" : "visible");
+	for (i = 0; i < N_STATES; i++)
+		fprintf(out, ", %s %.1f s at %.1f%% CPU", state_names[i],
+			time[i] / 1000000.0, cpu_usage(cpu[i], time[i]));
+	fprintf(out, ", %u suspends, resume last %.1f ms max %.1f ms\n",
+		visibility->suspends, visibility->resume_last / 1000.0,
+		visibility->resume_max / 1000.0);
+}
+
+void
+visibility_write_json(struct visibility *visibility, FILE *out)
+{
+	gint64 time[N_STATES], cpu[N_STATES];
+	int i;
+
+	visibility_totals(visibility, time, cpu);
+
+	fprintf(out, "{\"hidden\": %s", visibility->hidden ? "true" : "false");
+	for (i = 0; i < N_STATES; i++)
+		fprintf(out, ", \"%s\": {\"time_us\": %lld, \"cpu_us\": %lld, "
+			"\"cpu_percent\": %.2f}", state_names[i],
+			(long long) time[i], (long long) cpu[i],
+			cpu_usage(cpu[i], time[i]));
+	fprintf(out, ", \"suspends\": %u, \"resumes\": %u, "
+		"\"resume_last_us\": %lld, \"resume_mean_us\": %lld, "
+		"\"resume_max_us\": %lld}", visibility->suspends,
+		visibility->resumes, (long long) visibility->resume_last,
+		(long long) (visibility->resumes ?
+			     visibility->resume_total / visibility->resumes : 0),
+		(long long) visibility->resume_max);
+}
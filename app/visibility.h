@@ -0,0 +1,51 @@
+#ifndef __VISIBILITY_H
+#define __VISIBILITY_H
+
+#include <cstdio>
+
+#include <glib.h>
+
+/* what can hide the app, it's visible when none of them does */
+enum visibility_reason {
+	/* the shell deactivated us, e.g. for another app */
+	VISIBILITY_SHELL,
+	/* the xdg_toplevel suspended state */
+	VISIBILITY_SUSPENDED,
+	/* frame callbacks stopped coming */
+	VISIBILITY_OCCLUDED,
+	VISIBILITY_N_REASONS,
+};
+
+struct visibility;
+
+struct visibility *
+visibility_create(void);
+
+void
+visibility_destroy(struct visibility *visibility);
+
+/* returns true if that hid the app or made it visible again */
+bool
+visibility_set(struct visibility *visibility, enum visibility_reason reason,
+	       bool hidden);
+
+bool
+visibility_is_hidden(struct visibility *visibility);
+
+/*
+ * The camera showed a frame again at @shown_at, after the app became
+ * visible at @visible_at.
+ */
+void
+visibility_resumed(struct visibility *visibility, gint64 visible_at,
+		   gint64 shown_at);
+
+/* single line, for periodic logging */
+void
+visibility_print(struct visibility *visibility, FILE *out);
+
+/* JSON object, without a trailing newline */
+void
+visibility_write_json(struct visibility *visibility, FILE *out);
+
+#endif